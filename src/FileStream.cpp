@@ -18,6 +18,10 @@
 #include "StormCommon.h"
 #include "FileStream.h"
 
+#ifndef STORMLIB_WIIU
+#include <mutex>
+#endif
+
 #ifdef _MSC_VER
 #pragma comment(lib, "wininet.lib")             // Internet functions for HTTP stream
 #pragma warning(disable: 4800)                  // 'BOOL' : forcing value to bool 'true' or 'false' (performance warning)
@@ -30,6 +34,15 @@
 #define INVALID_HANDLE_VALUE ((HANDLE)-1)
 #endif
 
+// Serializes reads through the stream providers that keep shared state.
+// Each stream has its own lock, so streams of different archives don't wait for each other
+#ifndef STORMLIB_WIIU
+struct TStreamLock
+{
+    std::recursive_mutex Lock;
+};
+#endif
+
 //-----------------------------------------------------------------------------
 // Local functions - platform-specific functions
 
@@ -214,9 +227,6 @@ static bool BaseFile_Read(
         // file offset to read from file. This allows us to skip
         // one system call to SetFilePointer
 
-        // Update the byte offset
-        pStream->Base.File.FilePos = ByteOffset;
-
         // Read the data
         if(dwBytesToRead != 0)
         {
@@ -235,32 +245,38 @@ static bool BaseFile_Read(
     {
         ssize_t bytes_read;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position   xxx
-        if(ByteOffset != pStream->Base.File.FilePos)
-        {
-            lseek64((intptr_t)pStream->Base.File.hFile, (off64_t)(ByteOffset), SEEK_SET);
-            pStream->Base.File.FilePos = ByteOffset;
-        }
-
-        // Perform the read operation
-        if(dwBytesToRead != 0)
+        // Read the data from the given offset. The pread64 doesn't use
+        // the file position of the handle, so we don't need to seek.
+        // It may return less data than requested, so we repeat it until
+        // we have all the data or until we reach the end of the file
+        while(dwBytesRead < dwBytesToRead)
         {
-            bytes_read = read((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToRead);
+            bytes_read = pread64((intptr_t)pStream->Base.File.hFile,
+                                 (LPBYTE)pvBuffer + dwBytesRead,
+                                 (size_t)(dwBytesToRead - dwBytesRead),
+                                 (off64_t)(ByteOffset + dwBytesRead));
             if(bytes_read == -1)
             {
+                if(errno == EINTR)
+                    continue;
                 dwLastError = errno;
                 return false;
             }
 
-            dwBytesRead = (DWORD)(size_t)bytes_read;
+            // End of the file
+            if(bytes_read == 0)
+                break;
+            dwBytesRead += (DWORD)(size_t)bytes_read;
         }
     }
 #endif
 
-    // Increment the current file position by number of bytes read
+    // Increment the current file position by number of bytes read.
+    // Reads from a given byte offset leave the position alone,
+    // so that concurrent readers of one archive don't share any state.
     // If the number of bytes read doesn't match to required amount, return false
-    pStream->Base.File.FilePos = ByteOffset + dwBytesRead;
+    if(pByteOffset == NULL)
+        pStream->Base.File.FilePos = ByteOffset + dwBytesRead;
     if(dwBytesRead != dwBytesToRead)
         SetLastError(ERROR_HANDLE_EOF);
     return (dwBytesRead == dwBytesToRead);
@@ -306,27 +322,32 @@ static bool BaseFile_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const
     {
         ssize_t bytes_written;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(ByteOffset != pStream->Base.File.FilePos)
+        // Write the data to the given offset. Same like pread64, the pwrite64
+        // doesn't need seeking and it may write less data than requested
+        while(dwBytesWritten < dwBytesToWrite)
         {
-            lseek64((intptr_t)pStream->Base.File.hFile, (off64_t)(ByteOffset), SEEK_SET);
-            pStream->Base.File.FilePos = ByteOffset;
-        }
+            bytes_written = pwrite64((intptr_t)pStream->Base.File.hFile,
+                                     (const BYTE *)pvBuffer + dwBytesWritten,
+                                     (size_t)(dwBytesToWrite - dwBytesWritten),
+                                     (off64_t)(ByteOffset + dwBytesWritten));
+            if(bytes_written == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+                dwLastError = errno;
+                return false;
+            }
 
-        // Perform the read operation
-        bytes_written = write((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToWrite);
-        if(bytes_written == -1)
-        {
-            dwLastError = errno;
-            return false;
+            // No space left on the device
+            if(bytes_written == 0)
+                break;
+            dwBytesWritten += (DWORD)(size_t)bytes_written;
         }
-
-        dwBytesWritten = (DWORD)(size_t)bytes_written;
     }
 #endif
 
-    // Increment the current file position by number of bytes read
+    // Increment the current file position by number of bytes written.
+    // This is only used by the reads and writes that go to the current position
     pStream->Base.File.FilePos = ByteOffset + dwBytesWritten;
 
     // Also modify the file size, if needed
@@ -383,6 +404,24 @@ static bool BaseFile_Resize(TFileStream * pStream, ULONGLONG NewFileSize)
 #endif
 }
 
+// Makes sure that all written data are on the disk
+static bool BaseFile_Flush(TFileStream * pStream)
+{
+#ifdef STORMLIB_WINDOWS
+    return (bool)FlushFileBuffers(pStream->Base.File.hFile);
+#endif
+
+#if defined(STORMLIB_MAC) || defined(STORMLIB_LINUX)
+    if(fsync((intptr_t)pStream->Base.File.hFile) == -1)
+    {
+        dwLastError = errno;
+        return false;
+    }
+
+    return true;
+#endif
+}
+
 // Gives the current file size
 static bool BaseFile_GetSize(TFileStream * pStream, ULONGLONG * pFileSize)
 {
@@ -450,6 +489,7 @@ static void BaseFile_Init(TFileStream * pStream)
     pStream->BaseRead    = BaseFile_Read;
     pStream->BaseWrite   = BaseFile_Write;
     pStream->BaseResize  = BaseFile_Resize;
+    pStream->BaseFlush   = BaseFile_Flush;
     pStream->BaseGetSize = BaseFile_GetSize;
     pStream->BaseGetPos  = BaseFile_GetPos;
     pStream->BaseClose   = BaseFile_Close;
@@ -629,8 +669,9 @@ static bool BaseMap_Read(
         memcpy(pvBuffer, pStream->Base.Map.pbFile + (size_t)ByteOffset, dwBytesToRead);
     }
 
-    // Move the current file position
-    pStream->Base.Map.FilePos += dwBytesToRead;
+    // Move the current file position, unless we read from a given byte offset
+    if(pByteOffset == NULL)
+        pStream->Base.Map.FilePos = ByteOffset + dwBytesToRead;
     return true;
 }
 
@@ -2507,25 +2548,50 @@ TFileStream * FileStream_OpenFile(
     dwStreamFlags = (dwStreamFlags & STREAM_OPTIONS_MASK) | dwProvider;
     szFileName += nPrefixLength;
 
+    TFileStream * pStream;
+
     // Perform provider-specific open
     switch(dwStreamFlags & STREAM_PROVIDER_MASK)
     {
         case STREAM_PROVIDER_FLAT:
-            return FlatStream_Open(szFileName, dwStreamFlags);
+            pStream = FlatStream_Open(szFileName, dwStreamFlags);
+            break;
 
         case STREAM_PROVIDER_PARTIAL:
-            return PartStream_Open(szFileName, dwStreamFlags);
+            pStream = PartStream_Open(szFileName, dwStreamFlags);
+            break;
 
         case STREAM_PROVIDER_MPQE:
-            return MpqeStream_Open(szFileName, dwStreamFlags);
+            pStream = MpqeStream_Open(szFileName, dwStreamFlags);
+            break;
 
         case STREAM_PROVIDER_BLOCK4:
-            return Block4Stream_Open(szFileName, dwStreamFlags);
+            pStream = Block4Stream_Open(szFileName, dwStreamFlags);
+            break;
 
         default:
             SetLastError(ERROR_INVALID_PARAMETER);
             return NULL;
     }
+
+#ifndef STORMLIB_WIIU
+    // Only the local file and the mapped file can be read by multiple threads at once.
+    // The other providers keep shared buffers and positions, so their reads need a lock
+    if(pStream != NULL)
+    {
+        if(pStream->StreamRead != pStream->BaseRead || pStream->BaseRead == BaseHttp_Read || pStream->pMaster != NULL)
+        {
+            if((pStream->pReadLock = new(std::nothrow) TStreamLock) == NULL)
+            {
+                FileStream_Close(pStream);
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return NULL;
+            }
+        }
+    }
+#endif
+
+    return pStream;
 }
 
 /**
@@ -2743,8 +2809,10 @@ bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap
  * - Returns true if the read operation succeeded and all bytes have been read
  * - Returns false if either read failed or not all bytes have been read
  * - If the pByteOffset is NULL, the function must read the data from the current file position
+ * - Reading from a given byte offset of a local or mapped file doesn't move the file position
+ * - Reads through the block, partial, encrypted and HTTP providers are serialized
+ *   per stream, because these providers keep shared buffers and positions
  * - The function can be called with dwBytesToRead = 0. In that case, pvBuffer is ignored
- *   and the function just adjusts file pointer.
  *
  * \a pStream Pointer to an open stream
  * \a pByteOffset Pointer to file byte offset. If NULL, it reads from the current position
@@ -2759,9 +2827,54 @@ bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead)
 {
     assert(pStream->StreamRead != NULL);
+
+#ifndef STORMLIB_WIIU
+    // Streams that can't be read by multiple threads at once have a lock
+    if(pStream->pReadLock != NULL)
+    {
+        std::lock_guard<std::recursive_mutex> Lock(pStream->pReadLock->Lock);
+        return pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
+    }
+#endif
+
     return pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
 }
 
+/**
+ * Gives a pointer to the stream data instead of copying them.
+ * Only works for complete streams on top of a memory-mapped file.
+ *
+ * \a pStream Pointer to an open stream
+ * \a ByteOffset File byte offset of the data
+ * \a dwLength Number of bytes the caller wants to access
+ * \a ppvData Receives pointer to the data. Valid until the stream is closed.
+ *
+ * \returns
+ * - If the stream is memory-mapped and the range is within the file, it returns true.
+ * - If the stream is not memory-mapped, it returns false and GetLastError() returns ERROR_NOT_SUPPORTED
+ * - If the range is beyond the end of the file, it returns false and GetLastError() returns ERROR_HANDLE_EOF
+ */
+bool FileStream_GetView(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwLength, const void ** ppvData)
+{
+    // Block-oriented streams (partial, encrypted or incomplete files)
+    // go through a transfer buffer, so there is nothing to point to
+    if(pStream->BaseRead != BaseMap_Read || pStream->StreamRead != pStream->BaseRead || pStream->pMaster != NULL)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    // Check the range
+    if(ByteOffset > pStream->Base.Map.FileSize || dwLength > (pStream->Base.Map.FileSize - ByteOffset))
+    {
+        SetLastError(ERROR_HANDLE_EOF);
+        return false;
+    }
+
+    ppvData[0] = pStream->Base.Map.pbFile + (size_t)ByteOffset;
+    return true;
+}
+
 /**
  * This function writes data to the stream
  *
@@ -2786,6 +2899,19 @@ bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void
     return pStream->StreamWrite(pStream, pByteOffset, pvBuffer, dwBytesToWrite);
 }
 
+/**
+ * Makes sure that the data written so far are on the disk. Streams whose
+ * base provider can't write, like mapped files or HTTP, have nothing to flush
+ *
+ * \a pStream Pointer to an open stream
+ */
+bool FileStream_Flush(TFileStream * pStream)
+{
+    if(pStream->BaseFlush != NULL)
+        return pStream->BaseFlush(pStream);
+    return true;
+}
+
 /**
  * Returns the size of a file
  *
@@ -2922,6 +3048,12 @@ void FileStream_Close(TFileStream * pStream)
         else if(pStream->BaseClose != NULL)
             pStream->BaseClose(pStream);
 
+#ifndef STORMLIB_WIIU
+        // Free the read lock, if any
+        delete pStream->pReadLock;
+        pStream->pReadLock = NULL;
+#endif
+
         // Free the stream itself
         STORM_FREE(pStream);
     }
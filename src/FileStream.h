@@ -47,6 +47,10 @@ typedef bool (*STREAM_RESIZE)(
     ULONGLONG FileSize                  // New size for the file, in bytes
     );
 
+typedef bool (*STREAM_FLUSH)(
+    struct TFileStream * pStream        // Pointer to an open stream
+    );
+
 typedef bool (*STREAM_GETSIZE)(
     struct TFileStream * pStream,       // Pointer to an open stream
     ULONGLONG * pFileSize               // Receives the file size, in bytes
@@ -170,6 +174,7 @@ struct TFileStream
     STREAM_READ    BaseRead;                // Read from the stream
     STREAM_WRITE   BaseWrite;               // Write to the stream
     STREAM_RESIZE  BaseResize;              // Pointer to function changing file size
+    STREAM_FLUSH   BaseFlush;               // Pointer to function writing the file data to the disk
     STREAM_GETSIZE BaseGetSize;             // Pointer to function returning file size
     STREAM_GETPOS  BaseGetPos;              // Pointer to function that returns current file position
     STREAM_CLOSE   BaseClose;               // Pointer to function closing the stream
@@ -179,6 +184,7 @@ struct TFileStream
 
     // Stream provider data
     TFileStream * pMaster;                  // Master stream (e.g. MPQ on a web server)
+    struct TStreamLock * pReadLock;         // Serializes reads through providers that keep shared state (NULL = not needed)
     TCHAR * szFileName;                     // File name (self-relative pointer)
 
     ULONGLONG StreamSize;                   // Stream size (can be less than file size)
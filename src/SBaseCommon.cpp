@@ -15,6 +15,13 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+#ifndef STORMLIB_WIIU
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#endif
+
 char StormLibCopyright[] = "StormLib v " STORMLIB_VERSION_STRING " Copyright Ladislav Zezula 1998-2023";
 
 //-----------------------------------------------------------------------------
@@ -531,6 +538,111 @@ void DecryptMpqBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey1)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Encrypting/Decrypting multiple MPQ data blocks
+//
+// Each DWORD depends on the previous one through the key schedule, so one block
+// can't be processed faster than one DWORD after another. Multiple blocks
+// (e.g. file sectors with keys dwFileKey + dwSectorIndex) are independent,
+// so we interleave their key schedules and let the CPU work on them in parallel.
+
+#ifdef STORMLIB_LITTLE_ENDIAN
+
+// Encrypts or decrypts one DWORD and moves the key schedule
+static inline void CryptUInt32(LPBYTE pbData, DWORD & dwKey1, DWORD & dwKey2, bool bDecrypt)
+{
+    DWORD dwInput32;
+    DWORD dwOutput32;
+
+    // Modify the second key
+    dwKey2 += StormBuffer[MPQ_HASH_KEY2_MIX + (dwKey1 & 0xFF)];
+
+    // memcpy handles unaligned data. On little endian, this is the same as the byte-wise XOR
+    memcpy(&dwInput32, pbData, sizeof(DWORD));
+    dwOutput32 = dwInput32 ^ (dwKey1 + dwKey2);
+    memcpy(pbData, &dwOutput32, sizeof(DWORD));
+
+    dwKey1 = ((~dwKey1 << 0x15) + 0x11111111) | (dwKey1 >> 0x0B);
+    dwKey2 = (bDecrypt ? dwOutput32 : dwInput32) + dwKey2 + (dwKey2 << 5) + 3;
+}
+
+static void CryptMpqBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount, bool bDecrypt)
+{
+    LPBYTE DataPointer[MPQ_CRYPT_LANES];
+    DWORD dwDwordCount[MPQ_CRYPT_LANES];
+    DWORD dwKey1[MPQ_CRYPT_LANES];
+    DWORD dwKey2[MPQ_CRYPT_LANES];
+    DWORD dwCommonCount;
+    DWORD dwLaneCount;
+    DWORD i;
+
+    while(dwBlockCount > 0)
+    {
+        // Prepare the lanes
+        dwLaneCount = STORMLIB_MIN(dwBlockCount, MPQ_CRYPT_LANES);
+        for(DWORD n = 0; n < MPQ_CRYPT_LANES; n++)
+        {
+            DataPointer[n] = (n < dwLaneCount) ? (LPBYTE)pBlocks[n].pvDataBlock : NULL;
+            dwDwordCount[n] = (n < dwLaneCount) ? (pBlocks[n].dwLength >> 2) : 0;
+            dwKey1[n] = (n < dwLaneCount) ? pBlocks[n].dwKey : 0;
+            dwKey2[n] = 0xEEEEEEEE;
+        }
+
+        // Process all lanes together, as long as all of them have data
+        dwCommonCount = (dwLaneCount == MPQ_CRYPT_LANES) ? dwDwordCount[0] : 0;
+        for(DWORD n = 1; n < MPQ_CRYPT_LANES; n++)
+            dwCommonCount = STORMLIB_MIN(dwCommonCount, dwDwordCount[n]);
+
+        for(i = 0; i < dwCommonCount; i++)
+        {
+            CryptUInt32(DataPointer[0] + i * sizeof(DWORD), dwKey1[0], dwKey2[0], bDecrypt);
+            CryptUInt32(DataPointer[1] + i * sizeof(DWORD), dwKey1[1], dwKey2[1], bDecrypt);
+            CryptUInt32(DataPointer[2] + i * sizeof(DWORD), dwKey1[2], dwKey2[2], bDecrypt);
+            CryptUInt32(DataPointer[3] + i * sizeof(DWORD), dwKey1[3], dwKey2[3], bDecrypt);
+        }
+
+        // Finish the rest of every lane separately
+        for(DWORD n = 0; n < dwLaneCount; n++)
+        {
+            for(i = dwCommonCount; i < dwDwordCount[n]; i++)
+            {
+                CryptUInt32(DataPointer[n] + i * sizeof(DWORD), dwKey1[n], dwKey2[n], bDecrypt);
+            }
+        }
+
+        // Move to the next group of blocks
+        dwBlockCount -= dwLaneCount;
+        pBlocks += dwLaneCount;
+    }
+}
+
+#else   // STORMLIB_LITTLE_ENDIAN
+
+// On big endian platforms, unaligned blocks are handled differently by the single-block
+// functions, so we call them for every block
+static void CryptMpqBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount, bool bDecrypt)
+{
+    for(DWORD i = 0; i < dwBlockCount; i++)
+    {
+        if(bDecrypt)
+            DecryptMpqBlock(pBlocks[i].pvDataBlock, pBlocks[i].dwLength, pBlocks[i].dwKey);
+        else
+            EncryptMpqBlock(pBlocks[i].pvDataBlock, pBlocks[i].dwLength, pBlocks[i].dwKey);
+    }
+}
+
+#endif  // STORMLIB_LITTLE_ENDIAN
+
+void EncryptMpqBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount)
+{
+    CryptMpqBlocks(pBlocks, dwBlockCount, false);
+}
+
+void DecryptMpqBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount)
+{
+    CryptMpqBlocks(pBlocks, dwBlockCount, true);
+}
+
 /**
  * Functions tries to get file decryption key. This comes from these facts
  *
@@ -872,17 +984,26 @@ TMPQHash * AllocateHashEntry(
     return pHash;
 }
 
-// Finds a free space in the MPQ where to store next data
-// The free space begins beyond the file that is stored at the fuhrtest
-// position in the MPQ. (listfile), (attributes) and (signature) are ignored,
-// unless the MPQ is being flushed.
-ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
+// Returns the end of the file data, including the MD5 chunks
+ULONGLONG GetFileDataEnd(TMPQArchive * ha, TFileEntry * pFileEntry)
+{
+    ULONGLONG FileDataEnd = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
+    DWORD dwRawChunkSize = ha->pHeader->dwRawChunkSize;
+
+    // Add the MD5 chunks, if present
+    if(dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
+        FileDataEnd += (((pFileEntry->dwCmpSize - 1) / dwRawChunkSize) + 1) * MD5_DIGEST_SIZE;
+    return FileDataEnd;
+}
+
+// Scans the file table for the end of the furthest file. Every file entry counts,
+// so data shared by multiple entries (see SFileSetDeduplication) stay protected
+// as long as any of them exists
+static ULONGLONG ScanFreeMpqSpace(TMPQArchive * ha, bool bIncludeInternalFiles)
 {
-    TMPQHeader * pHeader = ha->pHeader;
     TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
     TFileEntry * pFileEntry;
     ULONGLONG FreeSpacePos = ha->pHeader->dwHeaderSize;
-    DWORD dwChunkCount;
 
     // Parse the entire block table
     for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
@@ -891,29 +1012,63 @@ ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
         if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && (pFileEntry->dwCmpSize != 0))
         {
             // If we are not saving MPQ tables, ignore internal MPQ files
-            if((ha->dwFlags & MPQ_FLAG_SAVING_TABLES) == 0 && IsInternalMpqFileName(pFileEntry->szFileName))
+            if(bIncludeInternalFiles == false && IsInternalMpqFileName(pFileEntry->szFileName))
                 continue;
 
             // If the end of the file is bigger than current MPQ table pos, update it
             if((pFileEntry->ByteOffset + pFileEntry->dwCmpSize) > FreeSpacePos)
-            {
-                // Get the end of the file data
-                FreeSpacePos = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
-
-                // Add the MD5 chunks, if present
-                if(pHeader->dwRawChunkSize != 0 && pFileEntry->dwCmpSize != 0)
-                {
-                    dwChunkCount = ((pFileEntry->dwCmpSize - 1) / pHeader->dwRawChunkSize) + 1;
-                    FreeSpacePos += dwChunkCount * MD5_DIGEST_SIZE;
-                }
-            }
+                FreeSpacePos = GetFileDataEnd(ha, pFileEntry);
         }
     }
 
-    // Give the free space position to the caller
     return FreeSpacePos;
 }
 
+// Finds a free space in the MPQ where to store next data
+// The free space begins beyond the file that is stored at the fuhrtest
+// position in the MPQ. (listfile), (attributes) and (signature) are ignored,
+// unless the MPQ is being flushed.
+// The position is remembered in the archive, so the file table is only
+// scanned after the position has been invalidated.
+ULONGLONG FindFreeMpqSpace(TMPQArchive * ha)
+{
+    if(ha->dwFlags & MPQ_FLAG_SAVING_TABLES)
+    {
+        if(ha->FreeSpacePosAll == 0)
+            ha->FreeSpacePosAll = ScanFreeMpqSpace(ha, true);
+        return ha->FreeSpacePosAll;
+    }
+    else
+    {
+        if(ha->FreeSpacePos == 0)
+            ha->FreeSpacePos = ScanFreeMpqSpace(ha, false);
+        return ha->FreeSpacePos;
+    }
+}
+
+// Moves the free space position beyond the data of a file being written
+void UpdateFreeMpqSpace(TMPQArchive * ha, TFileEntry * pFileEntry)
+{
+    ULONGLONG FileEnd = pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
+
+    // Same rules as in ScanFreeMpqSpace. Positions that are not known yet
+    // will be scanned when needed.
+    if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && (pFileEntry->dwCmpSize != 0))
+    {
+        if(ha->FreeSpacePosAll != 0 && FileEnd > ha->FreeSpacePosAll)
+            ha->FreeSpacePosAll = GetFileDataEnd(ha, pFileEntry);
+        if(ha->FreeSpacePos != 0 && FileEnd > ha->FreeSpacePos && !IsInternalMpqFileName(pFileEntry->szFileName))
+            ha->FreeSpacePos = GetFileDataEnd(ha, pFileEntry);
+    }
+}
+
+// Must be called whenever file data are removed or moved within the MPQ
+void InvalidateFreeMpqSpace(TMPQArchive * ha)
+{
+    ha->FreeSpacePos = 0;
+    ha->FreeSpacePosAll = 0;
+}
+
 //-----------------------------------------------------------------------------
 // Common functions - MPQ File
 
@@ -978,6 +1133,9 @@ TMPQFile * CreateWritableHandle(TMPQArchive * ha, DWORD dwFileSize)
         return NULL;
     }
 
+    // The new data may overwrite space of a deleted file. Drop the cached sectors.
+    InvalidateSectorCache(ha);
+
     // We need to find the position in the MPQ where we save the file data
     hf->MpqFilePos = FreeMpqSpace;
     hf->bIsWriteHandle = true;
@@ -1664,7 +1822,7 @@ DWORD WriteMpqDataMD5(
     // Write the array od MD5's to the file
     if(dwErrCode == ERROR_SUCCESS)
     {
-        if(!FileStream_Write(pStream, NULL, md5_array, dwMd5ArraySize))
+        if(!FileStream_Write(pStream, &RawDataOffs, md5_array, dwMd5ArraySize))
             dwErrCode = GetLastError();
     }
 
@@ -1696,6 +1854,8 @@ void FreeFileHandle(TMPQFile *& hf)
             STORM_FREE(hf->hctx);
         if(hf->pbFileSector != NULL)
             STORM_FREE(hf->pbFileSector);
+        if(hf->pbReadAhead != NULL)
+            STORM_FREE(hf->pbReadAhead);
         if(hf->pStream != NULL)
             FileStream_Close(hf->pStream);
         STORM_FREE(hf);
@@ -1738,6 +1898,9 @@ void FreeArchiveHandle(TMPQArchive *& ha)
             STORM_FREE(ha->pHashTable);
         if(ha->pHetTable != NULL)
             FreeHetTable(ha->pHetTable);
+        FreeSectorCache(ha);
+        FreePatchCache(ha);
+        SetArchiveThreadCount(ha, 0);
         STORM_FREE(ha);
         ha = NULL;
     }
@@ -1842,6 +2005,253 @@ void CalculateDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE md5_ha
     md5_done(&md5_state, md5_hash);
 }
 
+//-----------------------------------------------------------------------------
+// Support for worker threads
+
+#ifndef STORMLIB_WIIU
+
+// Shared state of one ParallelForEach call
+struct TParallelWork
+{
+    TParallelWork(DWORD dwItemCount) : NextItem(0), ErrItem(dwItemCount), ErrCode(ERROR_SUCCESS)
+    {}
+
+    std::atomic<DWORD> NextItem;                // Index of the next item to be processed
+    std::atomic<DWORD> ErrItem;                 // Index of the first failed item (dwItemCount if none)
+    std::mutex ErrLock;                         // Protects ErrItem + ErrCode pair
+    DWORD ErrCode;                              // Error code of the first failed item
+};
+
+static void ParallelWorker(TParallelWork * pWork, DWORD dwItemCount, PARALLEL_WORK pfnWork, void * pvContext)
+{
+    DWORD dwItemIndex;
+    DWORD dwErrCode;
+
+    // Keep picking items until we run out of them or until something failed
+    while((dwItemIndex = pWork->NextItem++) < dwItemCount)
+    {
+        // Don't start items beyond the one that already failed
+        if(dwItemIndex > pWork->ErrItem)
+            break;
+
+        // Remember the error of the lowest failed item
+        if((dwErrCode = pfnWork(pvContext, dwItemIndex)) != ERROR_SUCCESS)
+        {
+            std::lock_guard<std::mutex> Lock(pWork->ErrLock);
+
+            if(dwItemIndex < pWork->ErrItem)
+            {
+                pWork->ErrItem = dwItemIndex;
+                pWork->ErrCode = dwErrCode;
+            }
+        }
+    }
+}
+
+// Worker threads of an archive. The threads are started by SFileSetThreadCount
+// and wait for jobs until the archive is closed, so that operations which process
+// many small batches don't pay for starting and joining threads for each of them.
+struct TThreadPool
+{
+    std::atomic<bool> bRunning;                 // True while a job is running
+    std::mutex Lock;                            // Protects the members below
+    std::condition_variable WorkReady;          // Signalled when a new job is posted or when exiting
+    std::condition_variable WorkDone;           // Signalled when the last worker finishes the job
+    std::thread * pThreads;                     // Array of worker threads
+    DWORD dwThreads;                            // Number of started worker threads
+
+    TParallelWork * pWork;                      // Current job
+    PARALLEL_WORK pfnWork;
+    void * pvContext;
+    DWORD dwItemCount;
+    DWORD dwJobId;                              // Incremented for each job
+    DWORD dwWorkers;                            // Number of workers that take part in the current job
+    DWORD dwBusy;                               // Number of workers that haven't finished the current job yet
+    bool bExit;                                 // If true, the workers end
+};
+
+static void PoolWorker(TThreadPool * pPool, DWORD dwWorkerIndex)
+{
+    std::unique_lock<std::mutex> Lock(pPool->Lock);
+    DWORD dwJobId = 0;
+
+    for(;;)
+    {
+        pPool->WorkReady.wait(Lock, [&]{ return pPool->bExit || pPool->dwJobId != dwJobId; });
+        if(pPool->bExit)
+            break;
+        dwJobId = pPool->dwJobId;
+
+        // Small jobs don't need all workers
+        if(dwWorkerIndex < pPool->dwWorkers)
+        {
+            Lock.unlock();
+            ParallelWorker(pPool->pWork, pPool->dwItemCount, pPool->pfnWork, pPool->pvContext);
+            Lock.lock();
+
+            if(--pPool->dwBusy == 0)
+                pPool->WorkDone.notify_all();
+        }
+    }
+}
+
+static void StopThreadPool(TThreadPool * pPool)
+{
+    // Tell the workers to end
+    {
+        std::lock_guard<std::mutex> Lock(pPool->Lock);
+        pPool->bExit = true;
+    }
+    pPool->WorkReady.notify_all();
+
+    // Wait for them
+    for(DWORD i = 0; i < pPool->dwThreads; i++)
+        pPool->pThreads[i].join();
+    delete [] pPool->pThreads;
+    delete pPool;
+}
+
+static TThreadPool * StartThreadPool(DWORD dwThreads)
+{
+    TThreadPool * pPool;
+
+    if((pPool = new(std::nothrow) TThreadPool) != NULL)
+    {
+        pPool->pWork = NULL;
+        pPool->pfnWork = NULL;
+        pPool->pvContext = NULL;
+        pPool->dwItemCount = 0;
+        pPool->dwJobId = pPool->dwWorkers = pPool->dwBusy = 0;
+        pPool->dwThreads = 0;
+        pPool->bRunning = pPool->bExit = false;
+
+        // If a thread can't be started, we just go with less threads
+        if((pPool->pThreads = new(std::nothrow) std::thread[dwThreads]) != NULL)
+        {
+            try
+            {
+                for(; pPool->dwThreads < dwThreads; pPool->dwThreads++)
+                    pPool->pThreads[pPool->dwThreads] = std::thread(PoolWorker, pPool, pPool->dwThreads);
+            }
+            catch(...)
+            {}
+        }
+
+        // No threads means no pool
+        if(pPool->dwThreads == 0)
+        {
+            StopThreadPool(pPool);
+            pPool = NULL;
+        }
+    }
+    return pPool;
+}
+
+// Runs the job on the pool. The calling thread works too
+static DWORD RunOnThreadPool(TThreadPool * pPool, DWORD dwItemCount, PARALLEL_WORK pfnWork, void * pvContext)
+{
+    TParallelWork Work(dwItemCount);
+
+    // Post the job to the workers. One worker less, because the calling thread also works
+    {
+        std::lock_guard<std::mutex> Lock(pPool->Lock);
+
+        pPool->pWork = &Work;
+        pPool->pfnWork = pfnWork;
+        pPool->pvContext = pvContext;
+        pPool->dwItemCount = dwItemCount;
+        pPool->dwWorkers = pPool->dwBusy = STORMLIB_MIN(pPool->dwThreads, dwItemCount - 1);
+        pPool->dwJobId++;
+    }
+    pPool->WorkReady.notify_all();
+
+    // Work on the job and wait until the workers are done
+    ParallelWorker(&Work, dwItemCount, pfnWork, pvContext);
+    {
+        std::unique_lock<std::mutex> Lock(pPool->Lock);
+
+        pPool->WorkDone.wait(Lock, [&]{ return pPool->dwBusy == 0; });
+        pPool->pWork = NULL;
+    }
+    return Work.ErrCode;
+}
+
+#endif  // STORMLIB_WIIU
+
+// Sets the number of threads working on the archive, including the calling one.
+// Starts the worker threads of the archive, or stops them if no longer needed.
+void SetArchiveThreadCount(TMPQArchive * ha, DWORD dwThreadCount)
+{
+    // Never more than the maximum
+    dwThreadCount = STORMLIB_MIN(dwThreadCount, MAX_THREAD_COUNT);
+
+#ifndef STORMLIB_WIIU
+    // Stop the old workers
+    if(ha->pThreadPool != NULL)
+        StopThreadPool(ha->pThreadPool);
+    ha->pThreadPool = NULL;
+
+    // Start the new ones. If that fails, everything is done on the calling thread
+    if(dwThreadCount > 1)
+        ha->pThreadPool = StartThreadPool(dwThreadCount - 1);
+#endif
+
+    ha->dwThreadCount = dwThreadCount;
+}
+
+// Calls pfnWork for each item in the range of <0; dwItemCount), using the worker threads
+// of the archive and the calling thread. Items are picked in increasing order, but may complete
+// in any order. If the workers are already busy with another job (e.g. a nested call),
+// the items are processed on the calling thread.
+// Returns the error code of the failed item with the lowest index, or ERROR_SUCCESS
+DWORD ParallelForEach(TMPQArchive * ha, DWORD dwItemCount, PARALLEL_WORK pfnWork, void * pvContext)
+{
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+#ifndef STORMLIB_WIIU
+    TThreadPool * pPool = ha->pThreadPool;
+
+    if(pPool != NULL && dwItemCount > 1 && !pPool->bRunning.exchange(true))
+    {
+        dwErrCode = RunOnThreadPool(pPool, dwItemCount, pfnWork, pvContext);
+        pPool->bRunning = false;
+        return dwErrCode;
+    }
+#else
+    STORMLIB_UNUSED(ha);
+#endif
+
+    // Single-threaded processing
+    for(DWORD i = 0; i < dwItemCount; i++)
+    {
+        if((dwErrCode = pfnWork(pvContext, i)) != ERROR_SUCCESS)
+            break;
+    }
+
+    return dwErrCode;
+}
+
+//-----------------------------------------------------------------------------
+// Sorting items by the position of their data
+
+static int CompareOffsetOrder(const void * pvItem1, const void * pvItem2)
+{
+    TMPQOffsetOrder * pItem1 = (TMPQOffsetOrder *)pvItem1;
+    TMPQOffsetOrder * pItem2 = (TMPQOffsetOrder *)pvItem2;
+
+    if(pItem1->ByteOffset != pItem2->ByteOffset)
+        return (pItem1->ByteOffset < pItem2->ByteOffset) ? -1 : +1;
+    return (pItem1->dwIndex < pItem2->dwIndex) ? -1 : +1;
+}
+
+// Sorts the items so that the archive is read sequentially.
+// Items with the same position keep the order of their indexes.
+void SortByByteOffset(TMPQOffsetOrder * pOrder, DWORD dwItemCount)
+{
+    if(dwItemCount > 1)
+        qsort(pOrder, dwItemCount, sizeof(TMPQOffsetOrder), CompareOffsetOrder);
+}
+
 //-----------------------------------------------------------------------------
 // Swapping functions
 
@@ -180,4 +180,9 @@ void DumpFileTable(TFileEntry * pFileTable, DWORD dwFileTableSize)
     printf("-----------------------------------------------\n\n");
 }
 
+void DumpStaleJournal(const TCHAR * szJournalFile)
+{
+    _tprintf(_T("Ignoring compaction journal that doesn't match the archive: %s\n"), szJournalFile);
+}
+
 #endif  // __STORMLIB_DUMP_DATA__
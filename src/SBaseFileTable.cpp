@@ -12,6 +12,10 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+#ifndef STORMLIB_WIIU
+#include <mutex>
+#endif
+
 //-----------------------------------------------------------------------------
 // Local defines
 
@@ -2040,8 +2044,18 @@ TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, LCID l
     return NULL;
 }
 
+// Opening a file by name stores the name into the shared file entry.
+// Concurrent readers of one archive may do that for the same entry at once.
+#ifndef STORMLIB_WIIU
+static std::mutex FileNameLock;
+#endif
+
 void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * szFileName)
 {
+#ifndef STORMLIB_WIIU
+    std::lock_guard<std::mutex> Lock(FileNameLock);
+#endif
+
     // Sanity check
     assert(pFileEntry != NULL);
 
@@ -2088,8 +2102,8 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID l
 
     // Now find a free entry in the file table.
     // Note that in the case when free entries are in the middle,
-    // we need to use these
-    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    // we need to use these. Entries below dwFirstFreeFile are known to be used.
+    for(pFileEntry = ha->pFileTable + ha->dwFirstFreeFile; pFileEntry < pFileTableEnd; pFileEntry++)
     {
         if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0)
         {
@@ -2110,6 +2124,10 @@ TFileEntry * AllocateFileEntry(TMPQArchive * ha, const char * szFileName, LCID l
     if(pFreeEntry == NULL || dwFreeCount <= dwReservedFiles)
         return NULL;
 
+    // All entries before the one we take are in use. The entry itself
+    // becomes used once the caller fills it, so the next search starts with it.
+    ha->dwFirstFreeFile = (DWORD)(pFreeEntry - ha->pFileTable);
+
     // Initialize the file entry and set its file name
     memset(pFreeEntry, 0, sizeof(TFileEntry));
     AllocateFileName(ha, pFreeEntry, szFileName);
@@ -2220,11 +2238,20 @@ DWORD DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf)
     // Don't modify the HET table, because it gets recreated by the caller
     // Don't decrement the number of entries in the file table
     // Keep Byte Offset, file size, compressed size, CRC32 and MD5
-    // Clear the file name hash and the MPQ_FILE_EXISTS bit
+    // Clear the file name hash, the MPQ_FILE_EXISTS bit and the current attributes,
+    // so that the checksums are not used for deduplication anymore
     //
 
     pFileEntry->dwFlags &= ~MPQ_FILE_EXISTS;
     pFileEntry->FileNameHash = 0;
+    pFileEntry->dwCurrentAttrs = 0;
+
+    // The entry can be reused by the next file
+    if((DWORD)(pFileEntry - ha->pFileTable) < ha->dwFirstFreeFile)
+        ha->dwFirstFreeFile = (DWORD)(pFileEntry - ha->pFileTable);
+
+    // The file data may have been the last one in the MPQ
+    InvalidateFreeMpqSpace(ha);
     return ERROR_SUCCESS;
 }
 
@@ -2832,8 +2859,9 @@ DWORD DefragmentFileTable(TMPQArchive * ha)
             }
         }
 
-        // Save the block table size
+        // Save the block table size. All entries before it are in use now
         ha->pHeader->dwBlockTableSize = ha->dwReservedFiles + dwBlockTableSize;
+        ha->dwFirstFreeFile = dwBlockTableSize;
 
         // Free the defragment table
         STORM_FREE(DefragmentTable);
@@ -3070,12 +3098,10 @@ DWORD SaveMPQTables(TMPQArchive * ha)
         TablePos += HiBlockTableSize64;
     }
 
-    // Cut the MPQ
-    if(dwErrCode == ERROR_SUCCESS)
+    // If requested, the tables must be on the disk before the header points to them
+    if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_FLUSH_TABLES))
     {
-        ULONGLONG FileSize = ha->MpqPos + TablePos;
-
-        if(!FileStream_SetSize(ha->pStream, FileSize))
+        if(!FileStream_Flush(ha->pStream))
             dwErrCode = GetLastError();
     }
 
@@ -3101,6 +3127,18 @@ DWORD SaveMPQTables(TMPQArchive * ha)
             dwErrCode = GetLastError();
     }
 
+    // Cut the MPQ. This is done after the header points to the new tables,
+    // so the old ones stay usable if we get interrupted before
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        ULONGLONG FileSize = ha->MpqPos + TablePos;
+
+        if(!FileStream_SetSize(ha->pStream, FileSize))
+            dwErrCode = GetLastError();
+        if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_FLUSH_TABLES) && !FileStream_Flush(ha->pStream))
+            dwErrCode = GetLastError();
+    }
+
     // Clear the changed flag
     if(dwErrCode == ERROR_SUCCESS)
         ha->dwFlags &= ~MPQ_FLAG_CHANGED;
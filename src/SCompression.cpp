@@ -37,7 +37,8 @@ typedef void (*COMPRESS)(
     void * pvInBuffer,                  // [in]  Pointer to the buffer with data to compress
     int cbInBuffer,                     // [in]  Length of the buffer pointer by pvInBuffer
     int * pCmpType,                     // [in]  Compression-method specific value. ADPCM Setups this for the following Huffman compression
-    int nCmpLevel);                     // [in]  Compression specific value. ADPCM uses this. Should be set to zero.
+    int nCmpLevel,                      // [in]  Compression specific value. ADPCM uses this. Should be set to zero.
+    PSFILE_COMPRESSION_PARAMS pParams); // [in]  Settings for zlib, bzip2 and LZMA. NULL = default settings
 
 // Prototype of the decompression function
 // Returns 1 if success, 0 if failure
@@ -62,6 +63,34 @@ typedef struct
     DECOMPRESS    Decompress;           // Decompression function
 } TDecompressTable;
 
+// Setting up a zlib stream, an LZMA encoder or a Pklib work buffer costs more
+// than compressing a typical 4 KB sector. Each thread keeps its contexts and resets
+// them for the next sector. Bzip2 has no reset function, so it is not cached.
+// The contexts are freed by the destructor, which runs when the thread ends.
+#define ZLIB_WINDOW_BITS_MIN    8
+#define ZLIB_WINDOW_BITS_MAX   15
+#define ZLIB_WINDOW_BITS_COUNT (ZLIB_WINDOW_BITS_MAX - ZLIB_WINDOW_BITS_MIN + 1)
+
+struct TCompressionContexts
+{
+    TCompressionContexts();
+    ~TCompressionContexts();
+
+    z_stream Deflate[ZLIB_WINDOW_BITS_COUNT];       // Deflate streams, one for each window size
+    int DeflateLevel[ZLIB_WINDOW_BITS_COUNT];       // Compression level of the stream (0 = not initialized)
+    int DeflateStrategy[ZLIB_WINDOW_BITS_COUNT];    // Compression strategy of the stream
+    z_stream Inflate;                               // Inflate stream
+    bool bInflateReady;                             // true if the inflate stream is initialized
+    CLzmaEncHandle hLzmaEnc;                        // LZMA encoder
+    char * PklibBuffer;                             // Work buffer for both implode and explode
+};
+
+#ifndef STORMLIB_WIIU
+static thread_local TCompressionContexts Contexts;
+#else
+static TCompressionContexts Contexts;               // No worker threads on Wii U
+#endif
+
 
 /*****************************************************************************/
 /*                                                                           */
@@ -69,12 +98,13 @@ typedef struct
 /*                                                                           */
 /*****************************************************************************/
 
-void Compress_huff(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+void Compress_huff(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
     THuffmannTree ht(true);
     TOutputStream os(pvOutBuffer, *pcbOutBuffer);
 
     STORMLIB_UNUSED(nCmpLevel);
+    STORMLIB_UNUSED(pParams);
     *pcbOutBuffer = ht.Compress(&os, pvInBuffer, cbInBuffer, *pCmpType);
 }
 
@@ -93,25 +123,71 @@ int Decompress_huff(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, i
 /*                                                                            */
 /******************************************************************************/
 
-void Compress_ZLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+// Returns the thread's deflate stream for the given window size, ready for compression
+static z_stream * GetDeflateStream(int windowBits, int nLevel, int nStrategy)
+{
+    int nIndex = windowBits - ZLIB_WINDOW_BITS_MIN;
+    z_stream * z = &Contexts.Deflate[nIndex];
+
+    // Reuse the stream if it has been created with the same settings
+    if(Contexts.DeflateLevel[nIndex] == nLevel && Contexts.DeflateStrategy[nIndex] == nStrategy)
+        return (deflateReset(z) == Z_OK) ? z : NULL;
+
+    // Free the stream with different settings
+    if(Contexts.DeflateLevel[nIndex] != 0)
+        deflateEnd(z);
+    Contexts.DeflateLevel[nIndex] = 0;
+
+    // Initialize the compression.
+    // Storm.dll uses zlib version 1.1.3
+    // Wow.exe uses zlib version 1.2.3
+    memset(z, 0, sizeof(z_stream));
+    if(deflateInit2(z, nLevel, Z_DEFLATED, windowBits, 8, nStrategy) != Z_OK)
+        return NULL;
+
+    Contexts.DeflateLevel[nIndex] = nLevel;
+    Contexts.DeflateStrategy[nIndex] = nStrategy;
+    return z;
+}
+
+// Returns the thread's inflate stream, ready for decompression
+static z_stream * GetInflateStream()
+{
+    z_stream * z = &Contexts.Inflate;
+
+    // Reuse the stream if it already exists
+    if(Contexts.bInflateReady)
+        return (inflateReset(z) == Z_OK) ? z : NULL;
+
+    // Initialize the decompression structure. Storm.dll uses zlib version 1.1.3
+    memset(z, 0, sizeof(z_stream));
+    if(inflateInit(z) != Z_OK)
+        return NULL;
+
+    Contexts.bInflateReady = true;
+    return z;
+}
+
+void Compress_ZLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
-    z_stream z;                        // Stream information for zlib
+    z_stream * z;                      // Stream information for zlib
     int windowBits;
+    int nLevel = 6;                    // Compression level used by WoW MPQs
+    int nStrategy = Z_DEFAULT_STRATEGY;
     int nResult;
 
     // Keep compilers happy
     STORMLIB_UNUSED(pCmpType);
     STORMLIB_UNUSED(nCmpLevel);
 
-    // Fill the stream structure for zlib
-    z.next_in   = (Bytef *)pvInBuffer;
-    z.avail_in  = (uInt)cbInBuffer;
-    z.total_in  = cbInBuffer;
-    z.next_out  = (Bytef *)pvOutBuffer;
-    z.avail_out = *pcbOutBuffer;
-    z.total_out = 0;
-    z.zalloc    = NULL;
-    z.zfree     = NULL;
+    // Apply the caller's settings, if any
+    if(pParams != NULL)
+    {
+        if(1 <= pParams->nZlibLevel && pParams->nZlibLevel <= 9)
+            nLevel = pParams->nZlibLevel;
+        if(Z_FILTERED <= pParams->nZlibStrategy && pParams->nZlibStrategy <= Z_FIXED)
+            nStrategy = pParams->nZlibStrategy;
+    }
 
     // Determine the proper window bits (WoW.exe build 12694)
     if(cbInBuffer <= 0x100)
@@ -131,49 +207,40 @@ void Compress_ZLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, in
     else
         windowBits = 15;
 
-    // Initialize the compression.
-    // Storm.dll uses zlib version 1.1.3
-    // Wow.exe uses zlib version 1.2.3
-    nResult = deflateInit2(&z,
-                            6,                  // Compression level used by WoW MPQs
-                            Z_DEFLATED,
-                            windowBits,
-                            8,
-                            Z_DEFAULT_STRATEGY);
-    if(nResult == Z_OK)
+    // Get the compression stream for the window size
+    if((z = GetDeflateStream(windowBits, nLevel, nStrategy)) != NULL)
     {
+        // Fill the stream structure for zlib
+        z->next_in   = (Bytef *)pvInBuffer;
+        z->avail_in  = (uInt)cbInBuffer;
+        z->next_out  = (Bytef *)pvOutBuffer;
+        z->avail_out = *pcbOutBuffer;
+
         // Call zlib to compress the data
-        nResult = deflate(&z, Z_FINISH);
+        nResult = deflate(z, Z_FINISH);
 
         if(nResult == Z_OK || nResult == Z_STREAM_END)
-            *pcbOutBuffer = z.total_out;
-
-        deflateEnd(&z);
+            *pcbOutBuffer = z->total_out;
     }
 }
 
 int Decompress_ZLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer)
 {
-    z_stream z;                        // Stream information for zlib
-    int nResult;
+    z_stream * z;                      // Stream information for zlib
+    int nResult = Z_MEM_ERROR;
 
-    // Fill the stream structure for zlib
-    z.next_in   = (Bytef *)pvInBuffer;
-    z.avail_in  = (uInt)cbInBuffer;
-    z.total_in  = cbInBuffer;
-    z.next_out  = (Bytef *)pvOutBuffer;
-    z.avail_out = *pcbOutBuffer;
-    z.total_out = 0;
-    z.zalloc    = NULL;
-    z.zfree     = NULL;
-
-    // Initialize the decompression structure. Storm.dll uses zlib version 1.1.3
-    if((nResult = inflateInit(&z)) == Z_OK)
+    // Get the decompression stream
+    if((z = GetInflateStream()) != NULL)
     {
+        // Fill the stream structure for zlib
+        z->next_in   = (Bytef *)pvInBuffer;
+        z->avail_in  = (uInt)cbInBuffer;
+        z->next_out  = (Bytef *)pvOutBuffer;
+        z->avail_out = *pcbOutBuffer;
+
         // Call zlib to decompress the data
-        nResult = inflate(&z, Z_FINISH);
-        *pcbOutBuffer = z.total_out;
-        inflateEnd(&z);
+        nResult = inflate(z, Z_FINISH);
+        *pcbOutBuffer = z->total_out;
     }
 
     return (nResult >= Z_OK);
@@ -233,16 +300,25 @@ static void WriteOutputData(char * buf, unsigned int * size, void * param)
     assert(pInfo->pbOutBuff <= pInfo->pbOutBuffEnd);
 }
 
-static void Compress_PKLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+// Returns the thread's work buffer for implode and explode
+static char * GetPklibBuffer()
+{
+    if(Contexts.PklibBuffer == NULL)
+        Contexts.PklibBuffer = STORM_ALLOC(char, STORMLIB_MAX(CMP_BUFFER_SIZE, EXP_BUFFER_SIZE));
+    return Contexts.PklibBuffer;
+}
+
+static void Compress_PKLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
     TDataInfo Info;                                      // Data information
-    char * work_buf = STORM_ALLOC(char, CMP_BUFFER_SIZE);// Pklib's work buffer
+    char * work_buf = GetPklibBuffer();                  // Pklib's work buffer
     unsigned int dict_size;                              // Dictionary size
     unsigned int ctype = CMP_BINARY;                     // Compression type
 
     // Keep compilers happy
     STORMLIB_UNUSED(pCmpType);
     STORMLIB_UNUSED(nCmpLevel);
+    STORMLIB_UNUSED(pParams);
 
     // Handle no-memory condition
     if(work_buf != NULL)
@@ -271,8 +347,6 @@ static void Compress_PKLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBu
         // Do the compression
         if(implode(ReadInputData, WriteOutputData, work_buf, &Info, &ctype, &dict_size) == CMP_NO_ERROR)
             *pcbOutBuffer = (int)(Info.pbOutBuff - (unsigned char *)pvOutBuffer);
-
-        STORM_FREE(work_buf);
     }
 }
 
@@ -282,8 +356,8 @@ static int Decompress_PKLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInB
     char * work_buf;
     int nResult = 0;
 
-    // Allocate Pklib's work buffer
-    if((work_buf = STORM_ALLOC(char, EXP_BUFFER_SIZE)) != NULL)
+    // Get Pklib's work buffer
+    if((work_buf = GetPklibBuffer()) != NULL)
     {
         // Fill data information structure
         memset(work_buf, 0, EXP_BUFFER_SIZE);
@@ -298,7 +372,6 @@ static int Decompress_PKLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInB
         
         // Give away the number of decompressed bytes
         *pcbOutBuffer = (int)(Info.pbOutBuff - (unsigned char *)pvOutBuffer);
-              STORM_FREE(work_buf);
     }
 
     return nResult;
@@ -310,7 +383,7 @@ static int Decompress_PKLIB(void * pvOutBuffer, int * pcbOutBuffer, void * pvInB
 /*                                                                            */
 /******************************************************************************/
 
-static void Compress_BZIP2(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+static void Compress_BZIP2(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
     bz_stream strm;
     int blockSize100k = 9;
@@ -321,6 +394,10 @@ static void Compress_BZIP2(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBu
     STORMLIB_UNUSED(pCmpType);
     STORMLIB_UNUSED(nCmpLevel);
 
+    // Apply the caller's block size, if any
+    if(pParams != NULL && 1 <= pParams->nBzip2BlockSize && pParams->nBzip2BlockSize <= 9)
+        blockSize100k = pParams->nBzip2BlockSize;
+
     // Initialize the BZIP2 compression
     strm.bzalloc = NULL;
     strm.bzfree  = NULL;
@@ -404,6 +481,44 @@ static void LZMA_Callback_Free(void *p, void *address)
         STORM_FREE(address);
 }
 
+static ISzAlloc LzmaAlloc = {LZMA_Callback_Alloc, LZMA_Callback_Free};
+
+// Returns the thread's LZMA encoder. The encoder keeps its match finder
+// between the calls, as long as the dictionary size doesn't change.
+static CLzmaEncHandle GetLzmaEncoder()
+{
+    if(Contexts.hLzmaEnc == NULL)
+        Contexts.hLzmaEnc = LzmaEnc_Create(&LzmaAlloc);
+    return Contexts.hLzmaEnc;
+}
+
+//-----------------------------------------------------------------------------
+// Creation and destruction of the per-thread contexts
+
+TCompressionContexts::TCompressionContexts()
+{
+    memset(DeflateLevel, 0, sizeof(DeflateLevel));
+    bInflateReady = false;
+    hLzmaEnc = NULL;
+    PklibBuffer = NULL;
+}
+
+TCompressionContexts::~TCompressionContexts()
+{
+    for(int i = 0; i < ZLIB_WINDOW_BITS_COUNT; i++)
+    {
+        if(DeflateLevel[i] != 0)
+            deflateEnd(&Deflate[i]);
+    }
+
+    if(bInflateReady)
+        inflateEnd(&Inflate);
+    if(hLzmaEnc != NULL)
+        LzmaEnc_Destroy(hLzmaEnc, &LzmaAlloc, &LzmaAlloc);
+    if(PklibBuffer != NULL)
+        STORM_FREE(PklibBuffer);
+}
+
 //
 // Note: So far, I haven't seen any files compressed by LZMA.
 // This code haven't been verified against code ripped from Starcraft II Beta,
@@ -411,11 +526,11 @@ static void LZMA_Callback_Free(void *p, void *address)
 // the data compressed by StormLib.
 //
 
-static void Compress_LZMA(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+static void Compress_LZMA(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
     ICompressProgress Progress;
     CLzmaEncProps props;
-    ISzAlloc SzAlloc;
+    CLzmaEncHandle hLzmaEnc;
     Byte * pbOutBuffer = (Byte *)pvOutBuffer;
     Byte * destBuffer;
     SizeT destLen = *pcbOutBuffer;
@@ -430,26 +545,37 @@ static void Compress_LZMA(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuf
 
     // Fill the callbacks in structures
     Progress.Progress = LZMA_Callback_Progress;
-    SzAlloc.Alloc = LZMA_Callback_Alloc;
-    SzAlloc.Free = LZMA_Callback_Free;
 
-    // Initialize properties
+    // Get the encoder of this thread
+    if((hLzmaEnc = GetLzmaEncoder()) == NULL)
+        return;
+
+    // Initialize properties. Apply the caller's settings, if any
     LzmaEncProps_Init(&props);
+    if(pParams != NULL)
+    {
+        if(1 <= pParams->nLzmaLevel && pParams->nLzmaLevel <= 9)
+            props.level = pParams->nLzmaLevel;
+        if(pParams->dwLzmaDictSize != 0)
+            props.dictSize = pParams->dwLzmaDictSize;
+    }
 
     // Perform compression
     destBuffer = (Byte *)pvOutBuffer + LZMA_HEADER_SIZE;
     destLen = *pcbOutBuffer - LZMA_HEADER_SIZE;
-    nResult = LzmaEncode(destBuffer,
-                        &destLen,
-                 (Byte *)pvInBuffer,
-                         srcLen,
-                        &props,
-                         encodedProps,
-                        &encodedPropsSize,
-                         0,
-                        &Progress,
-                        &SzAlloc,
-                        &SzAlloc);
+    nResult = LzmaEnc_SetProps(hLzmaEnc, &props);
+    if(nResult == SZ_OK)
+        nResult = LzmaEnc_WriteProperties(hLzmaEnc, encodedProps, &encodedPropsSize);
+    if(nResult == SZ_OK)
+        nResult = LzmaEnc_MemEncode(hLzmaEnc,
+                                    destBuffer,
+                                   &destLen,
+                            (Byte *)pvInBuffer,
+                                    srcLen,
+                                    0,
+                                   &Progress,
+                                   &LzmaAlloc,
+                                   &LzmaAlloc);
     if(nResult != SZ_OK)
         return;
 
@@ -565,11 +691,12 @@ static int Decompress_LZMA_MPK(void * pvOutBuffer, int * pcbOutBuffer, void * pv
 /*                                                                            */
 /******************************************************************************/
 
-void Compress_SPARSE(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+void Compress_SPARSE(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
     // Keep compilers happy
     STORMLIB_UNUSED(pCmpType);
     STORMLIB_UNUSED(nCmpLevel);
+    STORMLIB_UNUSED(pParams);
 
     CompressSparse(pvOutBuffer, pcbOutBuffer, pvInBuffer, cbInBuffer);
 }
@@ -585,8 +712,10 @@ int Decompress_SPARSE(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer,
 /*                                                                            */
 /******************************************************************************/
 
-static void Compress_ADPCM_mono(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+static void Compress_ADPCM_mono(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
+    STORMLIB_UNUSED(pParams);
+
     // Prepare the compression level for Huffmann compression,
     // which will be called as next step
     if(0 < nCmpLevel && nCmpLevel <= 2)
@@ -619,8 +748,10 @@ static int Decompress_ADPCM_mono(void * pvOutBuffer, int * pcbOutBuffer, void *
 /*                                                                            */
 /******************************************************************************/
 
-static void Compress_ADPCM_stereo(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel)
+static void Compress_ADPCM_stereo(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, int * pCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
+    STORMLIB_UNUSED(pParams);
+
     // Prepare the compression level for Huffmann compression,
     // which will be called as next step
     if(0 < nCmpLevel && nCmpLevel <= 2)
@@ -684,7 +815,7 @@ int WINAPI SCompImplode(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffe
 
     // Perform the compression
     cbOutBuffer = *pcbOutBuffer;
-    Compress_PKLIB(pvOutBuffer, &cbOutBuffer, pvInBuffer, cbInBuffer, NULL, 0);
+    Compress_PKLIB(pvOutBuffer, &cbOutBuffer, pvInBuffer, cbInBuffer, NULL, 0, NULL);
 
     // If the compression was unsuccessful, copy the data as-is
     if(cbOutBuffer >= *pcbOutBuffer)
@@ -764,6 +895,11 @@ static TCompressTable cmp_table[] =
 };
 
 int WINAPI SCompCompress(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, unsigned uCompressionMask, int nCmpType, int nCmpLevel)
+{
+    return SCompCompressEx(pvOutBuffer, pcbOutBuffer, pvInBuffer, cbInBuffer, uCompressionMask, nCmpType, nCmpLevel, NULL);
+}
+
+int WINAPI SCompCompressEx(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, unsigned uCompressionMask, int nCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams)
 {
     COMPRESS CompressFuncArray[0x10];                       // Array of compression functions, applied sequentially
     unsigned char CompressByte[0x10];                       // CompressByte for each method in the CompressFuncArray array
@@ -850,7 +986,7 @@ int WINAPI SCompCompress(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuff
             // Note that if the compression method is unable to compress the input data block
             // by at least 2 bytes, we consider it as failure and will use source data instead
             cbOutBuffer = *pcbOutBuffer - 1;
-            CompressFuncArray[i](pbOutput + 1, &cbOutBuffer, pbInput, cbInLength, &nCmpType, nCmpLevel);
+            CompressFuncArray[i](pbOutput + 1, &cbOutBuffer, pbInput, cbInLength, &nCmpType, nCmpLevel, pParams);
 
             // If the compression failed, we copy the input buffer as-is.
             // Note that there is one extra byte at the end of the intermediate buffer, so it should be OK
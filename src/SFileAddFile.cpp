@@ -92,6 +92,7 @@ static DWORD FillWritableHandle(
     // Initialize the hash entry for the file
     hf->RawFilePos = ha->MpqPos + hf->MpqFilePos;
     hf->dwDataSize = dwFileSize;
+    hf->CompressionParams = ha->CompressionParams;
 
     // Initialize the block table entry for the file
     pFileEntry->ByteOffset = hf->MpqFilePos;
@@ -103,9 +104,11 @@ static DWORD FillWritableHandle(
     if((hf->hctx = STORM_ALLOC(hash_state, 1)) != NULL)
         md5_init((hash_state *)hf->hctx);
 
-    // Fill-in file time and CRC
+    // Fill-in file time and CRC. The checksums of the previous file
+    // in a reused entry are not valid until the new data are complete
     pFileEntry->FileTime = FileTime;
     pFileEntry->dwCrc32 = crc32(0, Z_NULL, 0);
+    pFileEntry->dwCurrentAttrs = 0;
 
     // Mark the archive as modified
     ha->dwFlags |= MPQ_FLAG_CHANGED;
@@ -121,6 +124,231 @@ static DWORD FillWritableHandle(
 //-----------------------------------------------------------------------------
 // MPQ write data functions
 
+// Maximum amount of compressed data held by one batch of file sectors
+#define MAX_SECTOR_BATCH_SIZE   0x04000000
+
+// Batch of file sectors that are compressed and encrypted by worker threads
+typedef struct _TMPQSectorBatch
+{
+    TMPQFile * hf;                          // File being written
+    LPBYTE pbFileData;                      // Plain data of the first sector in the batch
+    LPBYTE pbWorkBuffer;                    // Buffer for compressed sectors, (dwSectorSize + 0x100) bytes per sector
+    LPBYTE * ppbToWrite;                    // Data to be written for each sector
+    LPDWORD pdwToWrite;                     // Length of data to be written for each sector
+    DWORD dwSectorIndex;                    // Index of the first sector in the batch
+    DWORD dwCompression;                    // Compression of the sectors. The first sector of the file uses hf->dwCompression0
+} TMPQSectorBatch;
+
+// Compresses one file sector. Returns the length of the compressed data.
+// If the file is not compressed, the returned pointer points to the sector data
+static DWORD CompressFileSector(
+    DWORD dwFlags,                          // MPQ_FILE_XXX flags of the file
+    LPBYTE pbCompressed,                    // Buffer for compressed data, at least (dwSectorSize + 0x100) bytes
+    LPBYTE pbSector,                        // Plain sector data
+    DWORD dwBytesInSector,
+    DWORD dwCompression,
+    PSFILE_COMPRESSION_PARAMS pParams,      // Settings for zlib, bzip2 and LZMA
+    LPBYTE * ppbToWrite)
+{
+    LPBYTE pbToWrite = pbSector;            // Data to write to the file
+    int nCompressionLevel;                  // ADPCM compression level (only used for wave files)
+
+    // Compress the file sector, if needed
+    if(dwFlags & MPQ_FILE_COMPRESS_MASK)
+    {
+        int nOutBuffer = (int)dwBytesInSector;
+        int nInBuffer = (int)dwBytesInSector;
+
+        //
+        // Note that both SCompImplode and SCompCompress copy data as-is,
+        // if they are unable to compress the data.
+        //
+
+        if(dwFlags & MPQ_FILE_IMPLODE)
+        {
+            SCompImplode(pbCompressed, &nOutBuffer, pbSector, nInBuffer);
+        }
+
+        if(dwFlags & MPQ_FILE_COMPRESS)
+        {
+            // If the caller wants ADPCM compression, we will set wave compression level to 4,
+            // which corresponds to medium quality
+            nCompressionLevel = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? 4 : -1;
+            SCompCompressEx(pbCompressed, &nOutBuffer, pbSector, nInBuffer, (unsigned)dwCompression, 0, nCompressionLevel, pParams);
+        }
+
+        dwBytesInSector = nOutBuffer;
+        pbToWrite = pbCompressed;
+    }
+
+    *ppbToWrite = pbToWrite;
+    return dwBytesInSector;
+}
+
+static void EncryptFileSector(LPBYTE pbSector, DWORD dwBytesInSector, DWORD dwKey)
+{
+    BSWAP_ARRAY32_UNSIGNED(pbSector, dwBytesInSector);
+    EncryptMpqBlock(pbSector, dwBytesInSector, dwKey);
+    BSWAP_ARRAY32_UNSIGNED(pbSector, dwBytesInSector);
+}
+
+// Compresses and encrypts one file sector. If the file is not compressed,
+// the sector data is encrypted in place. Returns the length of data to be written
+static DWORD PrepareFileSector(
+    TMPQFile * hf,
+    LPBYTE pbCompressed,                    // Buffer for compressed data, at least (dwSectorSize + 0x100) bytes
+    LPBYTE pbSector,                        // Plain sector data
+    DWORD dwBytesInSector,
+    DWORD dwSectorIndex,
+    DWORD dwCompression,
+    LPBYTE * ppbToWrite)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+
+    // Compress the file sector, if needed
+    dwBytesInSector = CompressFileSector(pFileEntry->dwFlags, pbCompressed, pbSector, dwBytesInSector, dwCompression, &hf->CompressionParams, ppbToWrite);
+
+    // We have to calculate sector CRC, if enabled
+    if(hf->SectorChksums != NULL)
+        hf->SectorChksums[dwSectorIndex] = adler32(0, *ppbToWrite, dwBytesInSector);
+
+    // Encrypt the sector, if necessary
+    if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+        EncryptFileSector(*ppbToWrite, dwBytesInSector, hf->dwFileKey + dwSectorIndex);
+    return dwBytesInSector;
+}
+
+// Writes one prepared file sector at the end of the file data
+static DWORD WriteFileSector(
+    TMPQArchive * ha,
+    TMPQFile * hf,
+    LPBYTE pbToWrite,
+    DWORD dwBytesToWrite,
+    DWORD dwSectorIndex)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    ULONGLONG ByteOffset = hf->RawFilePos + pFileEntry->dwCmpSize;
+
+    // Update sector positions
+    if(hf->SectorOffsets != NULL)
+        hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + dwBytesToWrite;
+
+    // Do not allow Warcraft III maps to go over 2GB. 
+    // https://github.com/ladislav-zezula/StormLib/issues/306
+    if((ha->dwFlags & MPQ_FLAG_WAR3_MAP) && (ByteOffset + dwBytesToWrite) > 0x7FFFFFFF)
+        return ERROR_DISK_FULL;
+
+    // Write the file sector
+    if(!FileStream_Write(ha->pStream, &ByteOffset, pbToWrite, dwBytesToWrite))
+        return GetLastError();
+
+    // Call the compact callback, if any
+    if(ha->pfnAddFileCB != NULL)
+        ha->pfnAddFileCB(ha->pvAddFileUserData, hf->dwFilePos, hf->dwDataSize, false);
+
+    // Update the compressed file size
+    pFileEntry->dwCmpSize += dwBytesToWrite;
+    return ERROR_SUCCESS;
+}
+
+// Worker for compressing one sector of the batch
+static DWORD CompressBatchSector(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQSectorBatch * pBatch = (TMPQSectorBatch *)pvContext;
+    TMPQFile * hf = pBatch->hf;
+    LPBYTE pbCompressed = pBatch->pbWorkBuffer + dwItemIndex * (hf->dwSectorSize + 0x100);
+    LPBYTE pbSector = pBatch->pbFileData + dwItemIndex * hf->dwSectorSize;
+    DWORD dwBytesInSector = pBatch->pdwToWrite[dwItemIndex];
+    DWORD dwSectorIndex = pBatch->dwSectorIndex + dwItemIndex;
+
+    // The caller's data must stay intact. If the sector is only encrypted,
+    // we need to copy it to the work buffer first
+    if(!(hf->pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK))
+    {
+        memcpy(pbCompressed, pbSector, dwBytesInSector);
+        pbSector = pbCompressed;
+    }
+
+    pBatch->pdwToWrite[dwItemIndex] = PrepareFileSector(hf,
+                                                        pbCompressed,
+                                                        pbSector,
+                                                        dwBytesInSector,
+                                                        dwSectorIndex,
+                                                        (dwSectorIndex == 0) ? hf->dwCompression0 : pBatch->dwCompression,
+                                                        &pBatch->ppbToWrite[dwItemIndex]);
+    return ERROR_SUCCESS;
+}
+
+// Returns the maximum number of sectors in one batch. We give each thread
+// a few sectors, but we don't want to allocate too much memory
+static DWORD GetMaxSectorBatch(TMPQArchive * ha, TMPQFile * hf)
+{
+    DWORD dwMaxSectors = STORMLIB_MAX(ha->dwThreadCount, MAX_SECTOR_BATCH_SIZE / (hf->dwSectorSize + 0x100));
+
+    dwMaxSectors = STORMLIB_MIN(dwMaxSectors, ha->dwThreadCount * 4);
+    return STORMLIB_MIN(dwMaxSectors, hf->dwSectorCount);
+}
+
+// Determines how many sectors can be processed as one batch
+// directly from the caller's buffer. Returns 0 if batching is not worth it
+static DWORD GetSectorBatchSize(TMPQArchive * ha, TMPQFile * hf, DWORD dwDataSize)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    DWORD dwSectors;
+
+    // Only makes sense when we have worker threads and some work for them
+    if(ha->dwThreadCount < 2 || !(pFileEntry->dwFlags & (MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED)))
+        return 0;
+
+    // The batch must begin on a sector boundary
+    if((hf->dwFilePos % hf->dwSectorSize) != 0)
+        return 0;
+
+    // Count the complete sectors. The last sector of the file may be incomplete
+    dwSectors = dwDataSize / hf->dwSectorSize;
+    if((dwDataSize % hf->dwSectorSize) && (hf->dwFilePos + dwDataSize) >= pFileEntry->dwFileSize)
+        dwSectors++;
+
+    // Don't go beyond the maximum batch size
+    dwSectors = STORMLIB_MIN(dwSectors, GetMaxSectorBatch(ha, hf));
+    return (dwSectors > 1) ? dwSectors : 0;
+}
+
+// Processes a batch of file sectors. The sectors are hashed sequentially,
+// compressed and encrypted on worker threads, and then written in order.
+// The result is byte-identical to the one produced by the sector-by-sector loop
+static DWORD WriteSectorBatch(
+    TMPQArchive * ha,
+    TMPQFile * hf,
+    TMPQSectorBatch * pBatch,
+    DWORD dwSectorCount,
+    DWORD dwDataSize)
+{
+    DWORD dwErrCode;
+
+    // Prepare the raw sizes of the sectors
+    for(DWORD i = 0; i < dwSectorCount; i++)
+        pBatch->pdwToWrite[i] = STORMLIB_MIN(dwDataSize - i * hf->dwSectorSize, hf->dwSectorSize);
+    dwDataSize = STORMLIB_MIN(dwDataSize, dwSectorCount * hf->dwSectorSize);
+
+    // Update MD5 and CRC32 of the file. This is the same as doing it sector by sector
+    if(hf->hctx != NULL)
+        md5_process((hash_state *)hf->hctx, pBatch->pbFileData, dwDataSize);
+    hf->dwCrc32 = crc32(hf->dwCrc32, pBatch->pbFileData, dwDataSize);
+
+    // Compress and encrypt all sectors in the batch
+    dwErrCode = ParallelForEach(ha, dwSectorCount, CompressBatchSector, pBatch);
+
+    // Write the sectors in order
+    for(DWORD i = 0; i < dwSectorCount && dwErrCode == ERROR_SUCCESS; i++)
+    {
+        hf->dwFilePos += STORMLIB_MIN(dwDataSize - i * hf->dwSectorSize, hf->dwSectorSize);
+        dwErrCode = WriteFileSector(ha, hf, pBatch->ppbToWrite[i], pBatch->pdwToWrite[i], pBatch->dwSectorIndex + i);
+    }
+
+    return dwErrCode;
+}
+
 static DWORD WriteDataToMpqFile(
     TMPQArchive * ha,
     TMPQFile * hf,
@@ -128,12 +356,11 @@ static DWORD WriteDataToMpqFile(
     DWORD dwDataSize,
     DWORD dwCompression)
 {
+    TMPQSectorBatch Batch = {};
     TFileEntry * pFileEntry = hf->pFileEntry;
-    ULONGLONG ByteOffset;
     LPBYTE pbCompressed = NULL;             // Compressed (target) data
-    LPBYTE pbToWrite = hf->pbFileSector;    // Data to write to the file
+    LPBYTE pbToWrite;                       // Data to write to the file
     DWORD dwErrCode = ERROR_SUCCESS;
-    int nCompressionLevel;                  // ADPCM compression level (only used for wave files)
 
     // Make sure that the caller won't overrun the previously initiated file size
     assert(hf->dwFilePos + dwDataSize <= pFileEntry->dwFileSize);
@@ -147,11 +374,49 @@ static DWORD WriteDataToMpqFile(
     {
         DWORD dwBytesInSector = hf->dwFilePos % hf->dwSectorSize;
         DWORD dwSectorIndex = hf->dwFilePos / hf->dwSectorSize;
+        DWORD dwSectorCompression;
+        DWORD dwBatchSectors;
         DWORD dwBytesToCopy;
 
         // Process all data.
         while(dwDataSize != 0)
         {
+            // If there are more complete sectors in the caller's buffer,
+            // process them on worker threads directly from the buffer
+            if((dwBatchSectors = GetSectorBatchSize(ha, hf, dwDataSize)) != 0)
+            {
+                // Allocate the batch buffers on the first use
+                if(Batch.pbWorkBuffer == NULL)
+                {
+                    DWORD dwMaxSectors = GetMaxSectorBatch(ha, hf);
+
+                    Batch.pbWorkBuffer = STORM_ALLOC(BYTE, dwMaxSectors * (hf->dwSectorSize + 0x100));
+                    Batch.ppbToWrite = STORM_ALLOC(LPBYTE, dwMaxSectors);
+                    Batch.pdwToWrite = STORM_ALLOC(DWORD, dwMaxSectors);
+                    if(Batch.pbWorkBuffer == NULL || Batch.ppbToWrite == NULL || Batch.pdwToWrite == NULL)
+                    {
+                        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                        break;
+                    }
+                }
+
+                // Process the batch
+                Batch.hf = hf;
+                Batch.pbFileData = pbFileData;
+                Batch.dwSectorIndex = dwSectorIndex;
+                Batch.dwCompression = dwCompression;
+                dwErrCode = WriteSectorBatch(ha, hf, &Batch, dwBatchSectors, dwDataSize);
+                if(dwErrCode != ERROR_SUCCESS)
+                    break;
+
+                // Move to the next batch
+                dwBytesToCopy = STORMLIB_MIN(dwDataSize, dwBatchSectors * hf->dwSectorSize);
+                pbFileData += dwBytesToCopy;
+                dwDataSize -= dwBytesToCopy;
+                dwSectorIndex += dwBatchSectors;
+                continue;
+            }
+
             dwBytesToCopy = dwDataSize;
 
             // Check for sector overflow
@@ -171,102 +436,44 @@ static DWORD WriteDataToMpqFile(
             // then write the data to the MPQ
             if(dwBytesInSector >= hf->dwSectorSize || hf->dwFilePos >= pFileEntry->dwFileSize)
             {
-                // Set the position in the file
-                ByteOffset = hf->RawFilePos + pFileEntry->dwCmpSize;
-
                 // Update MD5 and CRC32 of the file
                 if(hf->hctx != NULL)
                     md5_process((hash_state *)hf->hctx, hf->pbFileSector, dwBytesInSector);
                 hf->dwCrc32 = crc32(hf->dwCrc32, hf->pbFileSector, dwBytesInSector);
 
-                // Compress the file sector, if needed
-                if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
+                // If the file is compressed, allocate buffer for the compressed data.
+                // Note that we allocate buffer that is a bit longer than sector size,
+                // for case if the compression method performs a buffer overrun
+                if(pbCompressed == NULL && (pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK))
                 {
-                    int nOutBuffer = (int)dwBytesInSector;
-                    int nInBuffer = (int)dwBytesInSector;
-
-                    // If the file is compressed, allocate buffer for the compressed data.
-                    // Note that we allocate buffer that is a bit longer than sector size,
-                    // for case if the compression method performs a buffer overrun
+                    pbCompressed = STORM_ALLOC(BYTE, hf->dwSectorSize + 0x100);
                     if(pbCompressed == NULL)
                     {
-                        pbToWrite = pbCompressed = STORM_ALLOC(BYTE, hf->dwSectorSize + 0x100);
-                        if(pbCompressed == NULL)
-                        {
-                            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
-                            break;
-                        }
-                    }
-
-                    //
-                    // Note that both SCompImplode and SCompCompress copy data as-is,
-                    // if they are unable to compress the data.
-                    //
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                    {
-                        SCompImplode(pbCompressed, &nOutBuffer, hf->pbFileSector, nInBuffer);
-                    }
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                    {
-                        // If this is the first sector, we need to override the given compression
-                        // by the first sector compression. This is because the entire sector must
-                        // be compressed by the same compression.
-                        //
-                        // Test case:
-                        //
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_PKWARE)       // Write 0x10 bytes (sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        dwCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
-
-                        // If the caller wants ADPCM compression, we will set wave compression level to 4,
-                        // which corresponds to medium quality
-                        nCompressionLevel = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? 4 : -1;
-                        SCompCompress(pbCompressed, &nOutBuffer, hf->pbFileSector, nInBuffer, (unsigned)dwCompression, 0, nCompressionLevel);
+                        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+                        break;
                     }
-
-                    // Update sector positions
-                    dwBytesInSector = nOutBuffer;
-                    if(hf->SectorOffsets != NULL)
-                        hf->SectorOffsets[dwSectorIndex+1] = hf->SectorOffsets[dwSectorIndex] + dwBytesInSector;
-
-                    // We have to calculate sector CRC, if enabled
-                    if(hf->SectorChksums != NULL)
-                        hf->SectorChksums[dwSectorIndex] = adler32(0, pbCompressed, nOutBuffer);
-                }
-
-                // Encrypt the sector, if necessary
-                if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-                {
-                    BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
-                    EncryptMpqBlock(pbToWrite, dwBytesInSector, hf->dwFileKey + dwSectorIndex);
-                    BSWAP_ARRAY32_UNSIGNED(pbToWrite, dwBytesInSector);
-                }
-
-                // Do not allow Warcraft III maps to go over 2GB. 
-                // https://github.com/ladislav-zezula/StormLib/issues/306
-                if((ha->dwFlags & MPQ_FLAG_WAR3_MAP) && (ByteOffset + dwBytesInSector) > 0x7FFFFFFF)
-                {
-                    dwErrCode = ERROR_DISK_FULL;
-                    break;
                 }
 
-                // Write the file sector
-                if(!FileStream_Write(ha->pStream, &ByteOffset, pbToWrite, dwBytesInSector))
-                {
-                    dwErrCode = GetLastError();
+                // The first sector is compressed by the first sector compression, even if it
+                // gets completed by a later call. This is because the entire sector must
+                // be compressed by the same compression. Only that sector is affected.
+                //
+                // Test case:
+                //
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_PKWARE)       // Write 0x10 bytes (sector 0)
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                dwSectorCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
+
+                // Compress and encrypt the sector
+                dwBytesInSector = PrepareFileSector(hf, pbCompressed, hf->pbFileSector, dwBytesInSector, dwSectorIndex, dwSectorCompression, &pbToWrite);
+
+                // Write the sector to the MPQ
+                dwErrCode = WriteFileSector(ha, hf, pbToWrite, dwBytesInSector, dwSectorIndex);
+                if(dwErrCode != ERROR_SUCCESS)
                     break;
-                }
-
-                // Call the compact callback, if any
-                if(ha->pfnAddFileCB != NULL)
-                    ha->pfnAddFileCB(ha->pvAddFileUserData, hf->dwFilePos, hf->dwDataSize, false);
 
-                // Update the compressed file size
-                pFileEntry->dwCmpSize += dwBytesInSector;
                 dwBytesInSector = 0;
                 dwSectorIndex++;
             }
@@ -274,11 +481,159 @@ static DWORD WriteDataToMpqFile(
     }
 
     // Cleanup
+    if(Batch.pdwToWrite != NULL)
+        STORM_FREE(Batch.pdwToWrite);
+    if(Batch.ppbToWrite != NULL)
+        STORM_FREE(Batch.ppbToWrite);
+    if(Batch.pbWorkBuffer != NULL)
+        STORM_FREE(Batch.pbWorkBuffer);
     if(pbCompressed != NULL)
         STORM_FREE(pbCompressed);
     return dwErrCode;
 }
 
+//-----------------------------------------------------------------------------
+// Automatic choice of the compression (MPQ_COMPRESSION_AUTO)
+//
+// A few sectors of the file are compressed by all candidate compressions,
+// and the one that produces the smallest data is used for the entire file.
+// Compressions that decompress slower must save more to be chosen.
+//
+
+// Maximum number of sectors that are compressed on trial
+#define AUTO_COMPRESSION_SAMPLES    4
+
+typedef struct _TAutoCompression
+{
+    DWORD dwCompression;                    // The candidate compression
+    USHORT wFormatVersion;                  // Minimal MPQ format version for the compression
+    DWORD dwDecodeCost;                     // Penalty for slower decompression, in percent of the compressed size
+} TAutoCompression;
+
+// The candidates, in the order of preference. Sparse and LZMA compressions
+// were added in Starcraft II, so older games can't decompress them
+static const TAutoCompression AutoCompressions[] =
+{
+    {MPQ_COMPRESSION_ZLIB,                          MPQ_FORMAT_VERSION_1,  0},
+    {MPQ_COMPRESSION_PKWARE,                        MPQ_FORMAT_VERSION_1,  0},
+    {MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB, MPQ_FORMAT_VERSION_3,  0},
+    {MPQ_COMPRESSION_LZMA,                          MPQ_FORMAT_VERSION_3,  5},
+    {MPQ_COMPRESSION_BZIP2,                         MPQ_FORMAT_VERSION_1, 10}
+};
+
+// Returns the number of samples taken from the data and the size of one sample
+static DWORD GetAutoCompressionSamples(TMPQArchive * ha, DWORD cbData, LPDWORD pdwSampleSize)
+{
+    DWORD dwSampleSize = STORMLIB_MIN(cbData, ha->dwSectorSize);
+
+    pdwSampleSize[0] = dwSampleSize;
+    return (dwSampleSize != 0) ? STORMLIB_MIN(cbData / dwSampleSize, AUTO_COMPRESSION_SAMPLES) : 0;
+}
+
+// Returns the offset of a sample. The samples are evenly spread across the data
+static DWORD GetAutoCompressionSampleOffset(DWORD cbData, DWORD dwSampleSize, DWORD dwSampleCount, DWORD dwSampleIndex)
+{
+    if(dwSampleCount < 2)
+        return 0;
+    return (DWORD)((ULONGLONG)(cbData - dwSampleSize) * dwSampleIndex / (dwSampleCount - 1));
+}
+
+// Chooses the compression for the file from the data samples.
+// Returns 0 if none of the compressions makes the samples smaller
+static DWORD SelectAutoCompression(
+    TMPQArchive * ha,
+    LPBYTE * SamplePtrs,
+    DWORD dwSampleSize,
+    DWORD dwSampleCount,
+    PSFILE_COMPRESSION_PARAMS pParams)
+{
+    ULONGLONG BestSize = (ULONGLONG)dwSampleSize * dwSampleCount;
+    LPBYTE pbCompressed;
+    DWORD dwBestCompression = 0;
+
+    // Allocate the buffer for the compressed samples
+    if(dwSampleCount == 0 || (pbCompressed = STORM_ALLOC(BYTE, dwSampleSize + 0x100)) == NULL)
+        return MPQ_COMPRESSION_ZLIB;
+
+    // Try all candidates that the archive format supports
+    for(size_t i = 0; i < _countof(AutoCompressions); i++)
+    {
+        const TAutoCompression * pCandidate = &AutoCompressions[i];
+        ULONGLONG TotalSize = 0;
+
+        if(ha->pHeader->wFormatVersion < pCandidate->wFormatVersion)
+            continue;
+
+        // Compress all samples
+        for(DWORD j = 0; j < dwSampleCount; j++)
+        {
+            int cbCompressed = (int)dwSampleSize;
+
+            if(!SCompCompressEx(pbCompressed, &cbCompressed, SamplePtrs[j], (int)dwSampleSize, pCandidate->dwCompression, 0, -1, pParams))
+                cbCompressed = (int)dwSampleSize;
+            TotalSize += cbCompressed;
+        }
+
+        // Penalize the slower decompression and remember the best one
+        TotalSize += TotalSize * pCandidate->dwDecodeCost / 100;
+        if(TotalSize < BestSize)
+        {
+            dwBestCompression = pCandidate->dwCompression;
+            BestSize = TotalSize;
+        }
+    }
+
+    STORM_FREE(pbCompressed);
+    return dwBestCompression;
+}
+
+// Chooses the compression for the file from the data in memory
+static DWORD SelectAutoCompressionFromData(TMPQArchive * ha, LPBYTE pbData, DWORD cbData, PSFILE_COMPRESSION_PARAMS pParams)
+{
+    LPBYTE SamplePtrs[AUTO_COMPRESSION_SAMPLES];
+    DWORD dwSampleSize;
+    DWORD dwSampleCount = GetAutoCompressionSamples(ha, cbData, &dwSampleSize);
+
+    for(DWORD i = 0; i < dwSampleCount; i++)
+        SamplePtrs[i] = pbData + GetAutoCompressionSampleOffset(cbData, dwSampleSize, dwSampleCount, i);
+    return SelectAutoCompression(ha, SamplePtrs, dwSampleSize, dwSampleCount, pParams);
+}
+
+// Chooses the compression for the file from the samples of a local file
+static DWORD SelectAutoCompressionFromStream(TMPQArchive * ha, TFileStream * pStream, DWORD cbData, PSFILE_COMPRESSION_PARAMS pParams, LPDWORD pdwCompression)
+{
+    LPBYTE SamplePtrs[AUTO_COMPRESSION_SAMPLES];
+    LPBYTE pbSamples;
+    ULONGLONG ByteOffset;
+    DWORD dwSampleSize;
+    DWORD dwSampleCount = GetAutoCompressionSamples(ha, cbData, &dwSampleSize);
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Allocate buffer for all samples
+    pbSamples = STORM_ALLOC(BYTE, dwSampleSize * dwSampleCount + 1);
+    if(pbSamples == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Load the samples from the file
+    for(DWORD i = 0; i < dwSampleCount; i++)
+    {
+        ByteOffset = GetAutoCompressionSampleOffset(cbData, dwSampleSize, dwSampleCount, i);
+        SamplePtrs[i] = pbSamples + i * dwSampleSize;
+
+        if(!FileStream_Read(pStream, &ByteOffset, SamplePtrs[i], dwSampleSize))
+        {
+            dwErrCode = GetLastError();
+            break;
+        }
+    }
+
+    // Choose the compression
+    if(dwErrCode == ERROR_SUCCESS)
+        pdwCompression[0] = SelectAutoCompression(ha, SamplePtrs, dwSampleSize, dwSampleCount, pParams);
+    STORM_FREE(pbSamples);
+    return dwErrCode;
+}
+
 //-----------------------------------------------------------------------------
 // Recrypts file data for file renaming
 
@@ -403,6 +758,23 @@ static DWORD RecryptFileData(
 //-----------------------------------------------------------------------------
 // Internal support for MPQ modifications
 
+static DWORD NormalizeAddFileFlags(DWORD dwFlags)
+{
+    // Sestor CRC is not allowed with single unit files
+    if(dwFlags & MPQ_FILE_SINGLE_UNIT)
+        dwFlags &= ~MPQ_FILE_SECTOR_CRC;
+
+    // Sector CRC is not allowed if the file is not compressed
+    if(!(dwFlags & MPQ_FILE_COMPRESS_MASK))
+        dwFlags &= ~MPQ_FILE_SECTOR_CRC;
+
+    // Fix Key is not allowed if the file is not encrypted
+    if(!(dwFlags & MPQ_FILE_ENCRYPTED))
+        dwFlags &= ~MPQ_FILE_KEY_V2;
+
+    return dwFlags;
+}
+
 DWORD SFileAddFile_Init(
     TMPQArchive * ha,
     const char * szFileName,
@@ -423,17 +795,8 @@ DWORD SFileAddFile_Init(
     // flags get to this point
     //
 
-    // Sestor CRC is not allowed with single unit files
-    if(dwFlags & MPQ_FILE_SINGLE_UNIT)
-        dwFlags &= ~MPQ_FILE_SECTOR_CRC;
-
-    // Sector CRC is not allowed if the file is not compressed
-    if(!(dwFlags & MPQ_FILE_COMPRESS_MASK))
-        dwFlags &= ~MPQ_FILE_SECTOR_CRC;
-
-    // Fix Key is not allowed if the file is not encrypted
-    if(!(dwFlags & MPQ_FILE_ENCRYPTED))
-        dwFlags &= ~MPQ_FILE_KEY_V2;
+    // Remove flags that are not allowed in the given combination
+    dwFlags = NormalizeAddFileFlags(dwFlags);
 
     // If the MPQ is of version 3.0 or higher, we ignore file locale.
     // This is because HET and BET tables have no known support for it
@@ -574,142 +937,181 @@ DWORD SFileAddFile_Init(
     return dwErrCode;
 }
 
-DWORD SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD dwCompression)
+// Allocates the buffers needed for writing the file. Called before the first data are written.
+// Also pre-saves the patch info and sector offset table to reserve space in the file
+static DWORD PrepareFileWrite(TMPQArchive * ha, TMPQFile * hf, const void * pvData, DWORD dwSize)
 {
-    TMPQArchive * ha;
-    TFileEntry * pFileEntry;
-    DWORD dwErrCode = ERROR_SUCCESS;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    ULONGLONG RawFilePos = hf->RawFilePos;
+    DWORD dwErrCode;
 
-    // Don't bother if the caller gave us zero size
-    if(pvData == NULL || dwSize == 0)
-        return ERROR_SUCCESS;
+    // Allocate buffer for file sector
+    dwErrCode = AllocateSectorBuffer(hf);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
 
-    // Get pointer to the MPQ archive
-    pFileEntry = hf->pFileEntry;
-    ha = hf->ha;
+    // Allocate patch info, if the data is patch
+    if(hf->pPatchInfo == NULL && IsIncrementalPatchFile(pvData, dwSize, &hf->dwPatchedFileSize))
+    {
+        // Set the MPQ_FILE_PATCH_FILE flag
+        pFileEntry->dwFlags |= MPQ_FILE_PATCH_FILE;
 
-    // Allocate file buffers
-    if(hf->pbFileSector == NULL)
+        // Allocate the patch info
+        dwErrCode = AllocatePatchInfo(hf, false);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Allocate sector offsets
+    if(hf->SectorOffsets == NULL)
     {
-        ULONGLONG RawFilePos = hf->RawFilePos;
+        dwErrCode = AllocateSectorOffsets(hf, false);
+        if(dwErrCode != ERROR_SUCCESS)
+            return dwErrCode;
+    }
 
-        // Allocate buffer for file sector
-        hf->dwAddFileError = dwErrCode = AllocateSectorBuffer(hf);
+    // Create array of sector checksums
+    if(hf->SectorChksums == NULL && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+    {
+        dwErrCode = AllocateSectorChecksums(hf, false);
         if(dwErrCode != ERROR_SUCCESS)
             return dwErrCode;
+    }
 
-        // Allocate patch info, if the data is patch
-        if(hf->pPatchInfo == NULL && IsIncrementalPatchFile(pvData, dwSize, &hf->dwPatchedFileSize))
-        {
-            // Set the MPQ_FILE_PATCH_FILE flag
-            pFileEntry->dwFlags |= MPQ_FILE_PATCH_FILE;
+    // Pre-save the patch info, if any
+    if(hf->pPatchInfo != NULL)
+    {
+        if(!FileStream_Write(ha->pStream, &RawFilePos, hf->pPatchInfo, hf->pPatchInfo->dwLength))
+            dwErrCode = GetLastError();
 
-            // Allocate the patch info
-            hf->dwAddFileError = dwErrCode = AllocatePatchInfo(hf, false);
-            if(dwErrCode != ERROR_SUCCESS)
-                return dwErrCode;
-        }
+        pFileEntry->dwCmpSize += hf->pPatchInfo->dwLength;
+        RawFilePos += hf->pPatchInfo->dwLength;
+    }
 
-        // Allocate sector offsets
-        if(hf->SectorOffsets == NULL)
-        {
-            hf->dwAddFileError = dwErrCode = AllocateSectorOffsets(hf, false);
-            if(dwErrCode != ERROR_SUCCESS)
-                return dwErrCode;
-        }
+    // Pre-save the sector offset table, just to reserve space in the file.
+    // Note that we dont need to swap the sector positions, nor encrypt the table
+    // at the moment, as it will be written again after writing all file sectors.
+    if(hf->SectorOffsets != NULL)
+    {
+        if(!FileStream_Write(ha->pStream, &RawFilePos, hf->SectorOffsets, hf->SectorOffsets[0]))
+            dwErrCode = GetLastError();
 
-        // Create array of sector checksums
-        if(hf->SectorChksums == NULL && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
-        {
-            hf->dwAddFileError = dwErrCode = AllocateSectorChecksums(hf, false);
-            if(dwErrCode != ERROR_SUCCESS)
-                return dwErrCode;
-        }
+        pFileEntry->dwCmpSize += hf->SectorOffsets[0];
+        RawFilePos += hf->SectorOffsets[0];
+    }
 
-        // Pre-save the patch info, if any
-        if(hf->pPatchInfo != NULL)
-        {
-            if(!FileStream_Write(ha->pStream, &RawFilePos, hf->pPatchInfo, hf->pPatchInfo->dwLength))
-                dwErrCode = GetLastError();
+    return dwErrCode;
+}
 
-            pFileEntry->dwCmpSize += hf->pPatchInfo->dwLength;
-            RawFilePos += hf->pPatchInfo->dwLength;
-        }
+// Called after all file data have been written. Stores the file checksums
+// and re-saves the sector offset table, sector checksums and patch info
+static DWORD CompleteFileWrite(TMPQArchive * ha, TMPQFile * hf)
+{
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    DWORD dwErrCode = ERROR_SUCCESS;
 
-        // Pre-save the sector offset table, just to reserve space in the file.
-        // Note that we dont need to swap the sector positions, nor encrypt the table
-        // at the moment, as it will be written again after writing all file sectors.
-        if(hf->SectorOffsets != NULL)
-        {
-            if(!FileStream_Write(ha->pStream, &RawFilePos, hf->SectorOffsets, hf->SectorOffsets[0]))
-                dwErrCode = GetLastError();
+    // Finish calculating CRC32
+    pFileEntry->dwCrc32 = hf->dwCrc32;
+    pFileEntry->dwCurrentAttrs = MPQ_ATTRIBUTE_CRC32;
 
-            pFileEntry->dwCmpSize += hf->SectorOffsets[0];
-            RawFilePos += hf->SectorOffsets[0];
-        }
+    // Finish calculating MD5
+    if(hf->hctx != NULL)
+    {
+        md5_done((hash_state *)hf->hctx, pFileEntry->md5);
+        pFileEntry->dwCurrentAttrs |= MPQ_ATTRIBUTE_MD5;
     }
 
-    // Write the MPQ data to the file
-    if(dwErrCode == ERROR_SUCCESS)
+    // If we also have sector checksums, write them to the file
+    if(hf->SectorChksums != NULL)
     {
-        // Save the first sector compression to the file structure
-        // Note that the entire first file sector will be compressed
-        // by compression that was passed to the first call of SFileAddFile_Write
-        if(hf->dwFilePos == 0)
-            hf->dwCompression0 = dwCompression;
+        dwErrCode = WriteSectorChecksums(hf);
+    }
 
-        // Write the data to the MPQ
-        dwErrCode = WriteDataToMpqFile(ha, hf, (LPBYTE)pvData, dwSize, dwCompression);
+    // Now write patch info
+    if(hf->pPatchInfo != NULL)
+    {
+        memcpy(hf->pPatchInfo->md5, pFileEntry->md5, MD5_DIGEST_SIZE);
+        hf->pPatchInfo->dwDataSize  = pFileEntry->dwFileSize;
+        pFileEntry->dwFileSize = hf->dwPatchedFileSize;
+        dwErrCode = WritePatchInfo(hf);
     }
 
-    // If it succeeded and we wrote all the file data,
-    // we need to re-save sector offset table
-    if(dwErrCode == ERROR_SUCCESS)
+    // Now write sector offsets to the file
+    if(hf->SectorOffsets != NULL)
     {
-        if(hf->dwFilePos >= pFileEntry->dwFileSize)
-        {
-            // Finish calculating CRC32
-            pFileEntry->dwCrc32 = hf->dwCrc32;
+        dwErrCode = WriteSectorOffsets(hf);
+    }
 
-            // Finish calculating MD5
-            if(hf->hctx != NULL)
-                md5_done((hash_state *)hf->hctx, pFileEntry->md5);
+    // Write the MD5 hashes of each file chunk, if required
+    if(ha->pHeader->dwRawChunkSize != 0)
+    {
+        dwErrCode = WriteMpqDataMD5(ha->pStream,
+                                    ha->MpqPos + pFileEntry->ByteOffset,
+                                    hf->pFileEntry->dwCmpSize,
+                                    ha->pHeader->dwRawChunkSize);
+    }
 
-            // If we also have sector checksums, write them to the file
-            if(hf->SectorChksums != NULL)
-            {
-                dwErrCode = WriteSectorChecksums(hf);
-            }
+    return dwErrCode;
+}
 
-            // Now write patch info
-            if(hf->pPatchInfo != NULL)
-            {
-                memcpy(hf->pPatchInfo->md5, pFileEntry->md5, MD5_DIGEST_SIZE);
-                hf->pPatchInfo->dwDataSize  = pFileEntry->dwFileSize;
-                pFileEntry->dwFileSize = hf->dwPatchedFileSize;
-                dwErrCode = WritePatchInfo(hf);
-            }
+DWORD SFileAddFile_Write(TMPQFile * hf, const void * pvData, DWORD dwSize, DWORD dwCompression)
+{
+    TMPQArchive * ha;
+    TFileEntry * pFileEntry;
+    DWORD dwErrCode = ERROR_SUCCESS;
 
-            // Now write sector offsets to the file
-            if(hf->SectorOffsets != NULL)
-            {
-                dwErrCode = WriteSectorOffsets(hf);
-            }
+    // Don't bother if the caller gave us zero size
+    if(pvData == NULL || dwSize == 0)
+        return ERROR_SUCCESS;
+
+    // Get pointer to the MPQ archive
+    pFileEntry = hf->pFileEntry;
+    ha = hf->ha;
+
+    // Allocate file buffers
+    if(hf->pbFileSector == NULL)
+        dwErrCode = PrepareFileWrite(ha, hf, pvData, dwSize);
 
-            // Write the MD5 hashes of each file chunk, if required
-            if(ha->pHeader->dwRawChunkSize != 0)
+    // Write the MPQ data to the file
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        // The automatic compression is chosen from the data of the first write
+        // that asks for it, and then it is used for the rest of the file
+        if(dwCompression == MPQ_COMPRESSION_AUTO)
+        {
+            if(hf->bCompressionAutoChosen == false)
             {
-                dwErrCode = WriteMpqDataMD5(ha->pStream,
-                                            ha->MpqPos + pFileEntry->ByteOffset,
-                                            hf->pFileEntry->dwCmpSize,
-                                            ha->pHeader->dwRawChunkSize);
+                if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
+                    hf->dwCompressionAuto = SelectAutoCompressionFromData(ha, (LPBYTE)pvData, dwSize, &hf->CompressionParams);
+                hf->bCompressionAutoChosen = true;
             }
+            dwCompression = hf->dwCompressionAuto;
+        }
+
+        // Save the first sector compression to the file structure
+        // Note that the entire first file sector will be compressed
+        // by compression that was passed to the first call of SFileAddFile_Write
+        if(hf->dwFilePos == 0)
+            hf->dwCompression0 = dwCompression;
+
+        // Write the data to the MPQ
+        dwErrCode = WriteDataToMpqFile(ha, hf, (LPBYTE)pvData, dwSize, dwCompression);
+    }
+
+    // If it succeeded and we wrote all the file data,
+    // we need to re-save sector offset table
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if(hf->dwFilePos >= pFileEntry->dwFileSize)
+        {
+            dwErrCode = CompleteFileWrite(ha, hf);
         }
     }
 
     // Update the archive size
     if((ha->MpqPos + pFileEntry->ByteOffset + pFileEntry->dwCmpSize) > ha->FileSize)
         ha->FileSize = ha->MpqPos + pFileEntry->ByteOffset + pFileEntry->dwCmpSize;
+    UpdateFreeMpqSpace(ha, pFileEntry);
 
     // Store the error code from the Write File operation
     hf->dwAddFileError = dwErrCode;
@@ -854,7 +1256,7 @@ bool WINAPI SFileWriteFile(
 //          dwErrCode = ERROR_INVALID_PARAMETER;
 
         // Lossy compression is not allowed on single unit files
-        if(dwCompression & MPQ_LOSSY_COMPRESSION_MASK)
+        if(dwCompression != MPQ_COMPRESSION_AUTO && (dwCompression & MPQ_LOSSY_COMPRESSION_MASK))
             dwErrCode = ERROR_INVALID_PARAMETER;
     }
 
@@ -893,16 +1295,67 @@ bool WINAPI SFileFinishFile(HANDLE hFile)
 //-----------------------------------------------------------------------------
 // Adds a file to the archive
 
-bool WINAPI SFileAddFileEx(
+// Adjusts the compressions given to SFileAddFileEx. Returns true if the next sectors
+// are to be compressed by ADPCM, which depends on the format of the WAVE file
+static bool AdjustAddFileCompression(LPDWORD pdwCompression, LPDWORD pdwCompressionNext)
+{
+    // When the compression for next blocks is set to default,
+    // we will copy the compression for the first sector
+    if(pdwCompressionNext[0] == MPQ_COMPRESSION_NEXT_SAME)
+        pdwCompressionNext[0] = pdwCompression[0];
+
+    // The automatic compression is never lossy
+    if(pdwCompression[0] == MPQ_COMPRESSION_AUTO || pdwCompressionNext[0] == MPQ_COMPRESSION_AUTO)
+        return false;
+
+    // If the caller wants ADPCM compression, we make sure
+    // that the first sector is not compressed with lossy compression
+    if(pdwCompressionNext[0] & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+    {
+        // The compression of the first file sector must not be ADPCM
+        // in order not to corrupt the headers
+        if(pdwCompression[0] & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+            pdwCompression[0] = MPQ_COMPRESSION_PKWARE;
+
+        // Remove both flag mono and stereo flags.
+        // They will be re-added according to WAVE type
+        pdwCompressionNext[0] &= ~(MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO);
+        return true;
+    }
+
+    return false;
+}
+
+// Determines the compression of next sectors from the header of the WAVE file
+static DWORD GetAdpcmCompressionNext(LPBYTE pbFileData, DWORD cbFileData, DWORD dwCompression, DWORD dwCompressionNext)
+{
+    DWORD dwChannels = 0;
+
+    // The file must really be a WAVE file with at least 16 bits per sample,
+    // otherwise the ADPCM compression will corrupt it
+    if(IsWaveFile_16BitsPerAdpcmSample(pbFileData, cbFileData, &dwChannels))
+    {
+        // Setup the compression of next sectors according to number of channels
+        return dwCompressionNext | ((dwChannels == 1) ? MPQ_COMPRESSION_ADPCM_MONO : MPQ_COMPRESSION_ADPCM_STEREO);
+    }
+
+    // Setup the compression of next sectors to a lossless compression
+    return (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? MPQ_COMPRESSION_PKWARE : dwCompression;
+}
+
+static bool AddLocalFile(
     HANDLE hMpq,
     const TCHAR * szFileName,
     const char * szArchivedName,
     DWORD dwFlags,
     DWORD dwCompression,            // Compression of the first sector
-    DWORD dwCompressionNext)        // Compression of next sectors
+    DWORD dwCompressionNext,        // Compression of next sectors
+    PSFILE_COMPRESSION_PARAMS pParams,  // Compression settings. NULL = settings of the archive
+    LPDWORD pdwCompressionUsed)     // Receives the compression of the last sectors (optional)
 {
     ULONGLONG FileSize = 0;
     ULONGLONG FileTime = 0;
+    ULONGLONG ByteOffset = 0;
     TFileStream * pStream = NULL;
     TMPQArchive * ha;
     HANDLE hMpqFile = NULL;
@@ -910,7 +1363,10 @@ bool WINAPI SFileAddFileEx(
     DWORD dwBytesRemaining = 0;
     DWORD dwBytesToRead;
     DWORD dwSectorSize = 0x1000;
-    DWORD dwChannels = 0;
+    DWORD dwBufferSize = 0x1000;
+    DWORD dwReadSize = 0x1000;
+    DWORD dwCompressionUsed = 0;
+    DWORD dwCompressionAuto = 0;
     bool bIsAdpcmCompression = false;
     bool bIsFirstSector = true;
     DWORD dwErrCode = ERROR_SUCCESS;
@@ -933,11 +1389,14 @@ bool WINAPI SFileAddFileEx(
     if(FileSize >> 32)
         dwErrCode = ERROR_DISK_FULL;
 
-    // Allocate data buffer for reading from the source file
+    // Allocate data buffer for reading from the source file.
+    // If we have worker threads, we read more sectors at once, so they can be compressed in parallel
     if(dwErrCode == ERROR_SUCCESS)
     {
+        if(ha->dwThreadCount > 1)
+            dwBufferSize = STORMLIB_MAX(dwSectorSize, (DWORD)STORMLIB_MIN((ULONGLONG)ha->dwSectorSize * ha->dwThreadCount * 4, MAX_SECTOR_BATCH_SIZE));
         dwBytesRemaining = (DWORD)FileSize;
-        pbFileData = STORM_ALLOC(BYTE, dwSectorSize);
+        pbFileData = STORM_ALLOC(BYTE, dwBufferSize);
         if(pbFileData == NULL)
             dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
     }
@@ -952,41 +1411,44 @@ bool WINAPI SFileAddFileEx(
     // Deal with various combination of compressions
     if(dwErrCode == ERROR_SUCCESS)
     {
-        // When the compression for next blocks is set to default,
-        // we will copy the compression for the first sector
-        if(dwCompressionNext == MPQ_COMPRESSION_NEXT_SAME)
-            dwCompressionNext = dwCompression;
+        bIsAdpcmCompression = AdjustAddFileCompression(&dwCompression, &dwCompressionNext);
 
-        // If the caller wants ADPCM compression, we make sure
-        // that the first sector is not compressed with lossy compression
-        if(dwCompressionNext & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+        // Choose the automatic compression from samples of the file
+        if(dwCompression == MPQ_COMPRESSION_AUTO || dwCompressionNext == MPQ_COMPRESSION_AUTO)
         {
-            // The compression of the first file sector must not be ADPCM
-            // in order not to corrupt the headers
-            if(dwCompression & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
-                dwCompression = MPQ_COMPRESSION_PKWARE;
-
-            // Remove both flag mono and stereo flags.
-            // They will be re-added according to WAVE type
-            dwCompressionNext &= ~(MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO);
-            bIsAdpcmCompression = true;
+            if(dwFlags & MPQ_FILE_COMPRESS)
+                dwErrCode = SelectAutoCompressionFromStream(ha, pStream, (DWORD)FileSize, (pParams != NULL) ? pParams : &ha->CompressionParams, &dwCompressionAuto);
+            dwCompression = (dwCompression == MPQ_COMPRESSION_AUTO) ? dwCompressionAuto : dwCompression;
+            dwCompressionNext = (dwCompressionNext == MPQ_COMPRESSION_AUTO) ? dwCompressionAuto : dwCompressionNext;
         }
+    }
 
-        // Initiate adding file to the MPQ
+    // Initiate adding file to the MPQ
+    if(dwErrCode == ERROR_SUCCESS)
+    {
         if(!SFileCreateFile(hMpq, szArchivedName, FileTime, (DWORD)FileSize, g_lcFileLocale, dwFlags, &hMpqFile))
             dwErrCode = GetLastError();
     }
 
+    // Apply the compression settings for this file
+    if(dwErrCode == ERROR_SUCCESS && pParams != NULL)
+    {
+        if(!SFileSetFileCompressionParams(hMpqFile, pParams))
+            dwErrCode = GetLastError();
+    }
+
     // Write the file data to the MPQ
     while(dwErrCode == ERROR_SUCCESS && dwBytesRemaining != 0)
     {
-        // Get the number of bytes remaining in the source file
+        // Get the number of bytes remaining in the source file.
+        // Note that the first read must not exceed 0x1000 bytes, because the compression
+        // passed to the first SFileWriteFile applies to all sectors it completes
         dwBytesToRead = dwBytesRemaining;
-        if(dwBytesToRead > dwSectorSize)
-            dwBytesToRead = dwSectorSize;
+        if(dwBytesToRead > dwReadSize)
+            dwBytesToRead = dwReadSize;
 
         // Read data from the local file
-        if(!FileStream_Read(pStream, NULL, pbFileData, dwBytesToRead))
+        if(!FileStream_Read(pStream, &ByteOffset, pbFileData, dwBytesToRead))
         {
             dwErrCode = GetLastError();
             break;
@@ -995,19 +1457,7 @@ bool WINAPI SFileAddFileEx(
         // If the file being added is a WAVE file, we check number of channels
         if(bIsFirstSector && bIsAdpcmCompression)
         {
-            // The file must really be a WAVE file with at least 16 bits per sample,
-            // otherwise the ADPCM compression will corrupt it
-            if(IsWaveFile_16BitsPerAdpcmSample(pbFileData, dwBytesToRead, &dwChannels))
-            {
-                // Setup the compression of next sectors according to number of channels
-                dwCompressionNext |= (dwChannels == 1) ? MPQ_COMPRESSION_ADPCM_MONO : MPQ_COMPRESSION_ADPCM_STEREO;
-            }
-            else
-            {
-                // Setup the compression of next sectors to a lossless compression
-                dwCompressionNext = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? MPQ_COMPRESSION_PKWARE : dwCompression;
-            }
-
+            dwCompressionNext = GetAdpcmCompressionNext(pbFileData, dwBytesToRead, dwCompression, dwCompressionNext);
             bIsFirstSector = false;
         }
 
@@ -1020,7 +1470,10 @@ bool WINAPI SFileAddFileEx(
 
         // Set the next data compression
         dwBytesRemaining -= dwBytesToRead;
+        ByteOffset += dwBytesToRead;
+        dwCompressionUsed = dwCompression;
         dwCompression = dwCompressionNext;
+        dwReadSize = dwBufferSize;
     }
 
     // Finish the file writing
@@ -1030,6 +1483,10 @@ bool WINAPI SFileAddFileEx(
             dwErrCode = GetLastError();
     }
 
+    // Give the caller the compression that was used
+    if(pdwCompressionUsed != NULL)
+        pdwCompressionUsed[0] = dwCompressionUsed;
+
     // Cleanup and exit
     if(pbFileData != NULL)
         STORM_FREE(pbFileData);
@@ -1040,6 +1497,17 @@ bool WINAPI SFileAddFileEx(
     return (dwErrCode == ERROR_SUCCESS);
 }
 
+bool WINAPI SFileAddFileEx(
+    HANDLE hMpq,
+    const TCHAR * szFileName,
+    const char * szArchivedName,
+    DWORD dwFlags,
+    DWORD dwCompression,            // Compression of the first sector
+    DWORD dwCompressionNext)        // Compression of next sectors
+{
+    return AddLocalFile(hMpq, szFileName, szArchivedName, dwFlags, dwCompression, dwCompressionNext, NULL, NULL);
+}
+
 // Adds a data file into the archive
 bool WINAPI SFileAddFile(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags)
 {
@@ -1095,6 +1563,666 @@ bool WINAPI SFileAddWave(HANDLE hMpq, const TCHAR * szFileName, const char * szA
                           dwCompression);           // Next sectors should be compressed as WAVE
 }
 
+//-----------------------------------------------------------------------------
+// Adds multiple files to the archive
+//
+// The files are loaded and compressed on worker threads, each file as one unit,
+// into staged buffers. Then they are appended to the archive one by one,
+// in the order given by the caller. The result is the same as if the files
+// were added by SFileAddFileEx one after another.
+//
+
+// Maximum amount of source data that is staged at once
+#define MAX_STAGED_DATA_SIZE    0x08000000
+#define MAX_STAGED_FILES        0x00000400
+
+// Files bigger than this are not staged. They are added by SFileAddFileEx,
+// which compresses their sectors on worker threads
+#define MAX_STAGED_FILE_SIZE    0x01000000
+
+// Staged file for SFileAddFiles
+typedef struct _TMPQStagedFile
+{
+    PSFILE_ADD_FILE_ENTRY pEntry;           // The caller's entry. Its szFileName is the source file
+    ULONGLONG FileTime;                     // Time of the source file
+    hash_state md5_state;                   // MD5 state after processing all file data
+    struct _TMPQStagedFile * pDuplicateOf;  // Earlier staged file of this round with identical data
+    LPBYTE pbFileData;                      // Content of the source file
+    LPBYTE pbStaged;                        // Compressed file sectors, one after another
+    LPDWORD SectorOffsets;                  // Offsets of the sectors in pbStaged (dwSectorCount + 1 items)
+    LPDWORD SectorChksums;                  // Checksums of the sectors (if MPQ_FILE_SECTOR_CRC)
+    BYTE md5[MD5_DIGEST_SIZE];              // MD5 of the file data
+    DWORD dwFileSize;                       // Size of the source file
+    DWORD dwFlags;                          // Normalized file flags
+    DWORD dwSectorSize;                     // Size of one file sector
+    DWORD dwSectorCount;                    // Number of file sectors
+    DWORD dwFileKey;                        // Key the sectors are encrypted with. 0 = not encrypted yet
+    DWORD dwCrc32;                          // CRC32 of the file data
+    DWORD dwDuplicateOf;                    // Index of a file entry with identical data, or HASH_ENTRY_FREE
+    DWORD dwFileIndex;                      // Index of the file entry after the file was added, or HASH_ENTRY_FREE
+    DWORD dwErrCode;                        // Result of the staging
+    bool bIsStaged;                         // If false, the file is added by SFileAddFileEx
+} TMPQStagedFile;
+
+typedef struct _TMPQStagedBatch
+{
+    TMPQArchive * ha;
+    TMPQStagedFile * pFiles;
+} TMPQStagedBatch;
+
+typedef struct _TMPQStagedSectors
+{
+    TMPQStagedFile * pStaged;
+    DWORD dwFileKey;
+} TMPQStagedSectors;
+
+// Lookup table of file entries whose data can be shared by identical files.
+// Open addressing; the table is at least twice as big as the number of inserted entries
+typedef struct _TMPQDedupTable
+{
+    LPDWORD FileIndexes;                    // File indexes, HASH_ENTRY_FREE = empty slot
+    DWORD dwTableMask;                      // Size of the table minus one. The size is a power of two
+} TMPQDedupTable;
+
+// Frees the buffers of the staged file. The rest of the structure stays valid,
+// because later files of the same round may refer to it
+static void FreeStagedFile(TMPQStagedFile * pStaged)
+{
+    if(pStaged->pbStaged != NULL && pStaged->pbStaged != pStaged->pbFileData)
+        STORM_FREE(pStaged->pbStaged);
+    if(pStaged->pbFileData != NULL)
+        STORM_FREE(pStaged->pbFileData);
+    if(pStaged->SectorOffsets != NULL)
+        STORM_FREE(pStaged->SectorOffsets);
+
+    pStaged->pbFileData = pStaged->pbStaged = NULL;
+    pStaged->SectorOffsets = pStaged->SectorChksums = NULL;
+}
+
+// Only plain files can share their data. Encrypted files can't, because their key
+// depends on the file name, and patch files carry their own patch info.
+static bool IsDedupCandidate(DWORD dwFlags, DWORD dwFileSize)
+{
+    return (dwFileSize != 0 && (dwFlags & (MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE | MPQ_FILE_DELETE_MARKER)) == 0);
+}
+
+// Checks whether the file entry currently holds the same data as the staged file
+static bool IsDuplicateEntry(TFileEntry * pFileEntry, TMPQStagedFile * pStaged)
+{
+    // The MD5 must be calculated from the current file data, not loaded from (attributes)
+    if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0 || (pFileEntry->dwCurrentAttrs & MPQ_ATTRIBUTE_MD5) == 0)
+        return false;
+    if((pFileEntry->dwFlags & ~MPQ_FILE_EXISTS) != pStaged->dwFlags || pFileEntry->dwFileSize != pStaged->dwFileSize || pFileEntry->dwCmpSize == 0)
+        return false;
+
+    // Internal files are rewritten when the archive is saved
+    if(pFileEntry->szFileName != NULL && IsInternalMpqFileName(pFileEntry->szFileName))
+        return false;
+    return (memcmp(pFileEntry->md5, pStaged->md5, MD5_DIGEST_SIZE) == 0);
+}
+
+static DWORD GetDedupHash(LPBYTE md5)
+{
+    DWORD dwHash;
+
+    memcpy(&dwHash, md5, sizeof(DWORD));
+    return dwHash;
+}
+
+static void InsertDedupEntry(TMPQDedupTable * pDedup, TMPQArchive * ha, DWORD dwFileIndex)
+{
+    DWORD dwIndex = GetDedupHash(ha->pFileTable[dwFileIndex].md5) & pDedup->dwTableMask;
+
+    while(pDedup->FileIndexes[dwIndex] != HASH_ENTRY_FREE)
+        dwIndex = (dwIndex + 1) & pDedup->dwTableMask;
+    pDedup->FileIndexes[dwIndex] = dwFileIndex;
+}
+
+static DWORD FindDedupEntry(TMPQDedupTable * pDedup, TMPQArchive * ha, TMPQStagedFile * pStaged)
+{
+    DWORD dwIndex = GetDedupHash(pStaged->md5) & pDedup->dwTableMask;
+    DWORD dwFileIndex;
+
+    while((dwFileIndex = pDedup->FileIndexes[dwIndex]) != HASH_ENTRY_FREE)
+    {
+        if(IsDuplicateEntry(ha->pFileTable + dwFileIndex, pStaged))
+            return dwFileIndex;
+        dwIndex = (dwIndex + 1) & pDedup->dwTableMask;
+    }
+    return HASH_ENTRY_FREE;
+}
+
+// Creates the lookup table and fills it with files that have been added to the archive
+// since it was open. Only for these we know that their MD5 matches their data.
+static DWORD CreateDedupTable(TMPQDedupTable * pDedup, TMPQArchive * ha, DWORD dwEntryCount)
+{
+    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TFileEntry * pFileEntry;
+    DWORD dwMaxEntries = dwEntryCount;
+    DWORD dwTableSize = 0x10;
+
+    // Count the files whose MD5 we can trust
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && (pFileEntry->dwCurrentAttrs & MPQ_ATTRIBUTE_MD5))
+            dwMaxEntries++;
+    }
+
+    // Allocate the table
+    while(dwTableSize < dwMaxEntries * 2)
+        dwTableSize <<= 1;
+    pDedup->FileIndexes = STORM_ALLOC(DWORD, dwTableSize);
+    if(pDedup->FileIndexes == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(pDedup->FileIndexes, 0xFF, dwTableSize * sizeof(DWORD));
+    pDedup->dwTableMask = dwTableSize - 1;
+
+    // Insert the files
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && (pFileEntry->dwCurrentAttrs & MPQ_ATTRIBUTE_MD5))
+        {
+            if(IsDedupCandidate(pFileEntry->dwFlags, pFileEntry->dwFileSize) && pFileEntry->dwCmpSize != 0)
+                InsertDedupEntry(pDedup, ha, (DWORD)(pFileEntry - ha->pFileTable));
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Finds the staged files whose data are already in the archive,
+// or which are identical to an earlier file of the same round
+static void FindDuplicateFiles(TMPQDedupTable * pDedup, TMPQArchive * ha, TMPQStagedFile * pFiles, DWORD dwStagedCount)
+{
+    for(DWORD i = 0; i < dwStagedCount; i++)
+    {
+        TMPQStagedFile * pStaged = pFiles + i;
+
+        // Only loaded files that can share their data
+        if(pStaged->bIsStaged == false || pStaged->dwErrCode != ERROR_SUCCESS)
+            continue;
+        if(!IsDedupCandidate(pStaged->dwFlags, pStaged->dwFileSize))
+            continue;
+
+        // Look in the archive first
+        if((pStaged->dwDuplicateOf = FindDedupEntry(pDedup, ha, pStaged)) != HASH_ENTRY_FREE)
+            continue;
+
+        // Look in the files staged before this one
+        for(DWORD j = 0; j < i; j++)
+        {
+            TMPQStagedFile * pOther = pFiles + j;
+
+            if(pOther->bIsStaged && pOther->dwErrCode == ERROR_SUCCESS && pOther->dwDuplicateOf == HASH_ENTRY_FREE && pOther->pDuplicateOf == NULL)
+            {
+                if(pOther->dwFlags == pStaged->dwFlags && pOther->dwFileSize == pStaged->dwFileSize && !memcmp(pOther->md5, pStaged->md5, MD5_DIGEST_SIZE))
+                {
+                    pStaged->pDuplicateOf = pOther;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Worker for loading one staged file and calculating its checksums
+static DWORD LoadStagedFile(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQStagedBatch * pBatch = (TMPQStagedBatch *)pvContext;
+    TMPQStagedFile * pStaged = pBatch->pFiles + dwItemIndex;
+    TFileStream * pStream;
+    hash_state md5_state;
+
+    // Files that are not staged, or files that already failed.
+    // Errors stay with the file, so that the other files are processed too
+    if(pStaged->bIsStaged == false || pStaged->dwErrCode != ERROR_SUCCESS)
+        return ERROR_SUCCESS;
+
+    // Load the entire source file. The file is only open while it is being read,
+    // so that a round of many files doesn't run out of file descriptors
+    pStaged->pbFileData = STORM_ALLOC(BYTE, pStaged->dwFileSize + 1);
+    if(pStaged->pbFileData == NULL)
+    {
+        pStaged->dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        return ERROR_SUCCESS;
+    }
+    pStream = FileStream_OpenFile(pStaged->pEntry->szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(pStream == NULL)
+    {
+        pStaged->dwErrCode = GetLastError();
+        return ERROR_SUCCESS;
+    }
+    if(!FileStream_Read(pStream, NULL, pStaged->pbFileData, pStaged->dwFileSize))
+        pStaged->dwErrCode = GetLastError();
+    FileStream_Close(pStream);
+    if(pStaged->dwErrCode != ERROR_SUCCESS)
+        return ERROR_SUCCESS;
+
+    // Calculate MD5 and CRC32 of the file
+    if(pStaged->dwFileSize != 0)
+    {
+        md5_init(&pStaged->md5_state);
+        md5_process(&pStaged->md5_state, pStaged->pbFileData, pStaged->dwFileSize);
+        pStaged->dwCrc32 = crc32(crc32(0, Z_NULL, 0), pStaged->pbFileData, pStaged->dwFileSize);
+
+        // The final MD5 is needed for finding identical files
+        memcpy(&md5_state, &pStaged->md5_state, sizeof(hash_state));
+        md5_done(&md5_state, pStaged->md5);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Compresses the sectors of a loaded file
+static DWORD CompressStagedFile(TMPQArchive * ha, TMPQStagedFile * pStaged)
+{
+    PSFILE_ADD_FILE_ENTRY pEntry = pStaged->pEntry;
+    LPBYTE pbToWrite;
+    PSFILE_COMPRESSION_PARAMS pCompressionParams = (pEntry->pCompressionParams != NULL) ? pEntry->pCompressionParams : &ha->CompressionParams;
+    DWORD dwCompression = pEntry->dwCompression;
+    DWORD dwCompressionNext = pEntry->dwCompressionNext;
+    DWORD dwStagedOffs = 0;
+    DWORD dwBytesInSector;
+
+    // Empty files don't need any staging
+    if(pStaged->dwFileSize == 0)
+        return ERROR_SUCCESS;
+
+    // Resolve the compressions the same way like SFileAddFileEx does
+    if(AdjustAddFileCompression(&dwCompression, &dwCompressionNext))
+        dwCompressionNext = GetAdpcmCompressionNext(pStaged->pbFileData, STORMLIB_MIN(pStaged->dwFileSize, 0x1000), dwCompression, dwCompressionNext);
+    if(dwCompression == MPQ_COMPRESSION_AUTO || dwCompressionNext == MPQ_COMPRESSION_AUTO)
+    {
+        DWORD dwCompressionAuto = 0;
+
+        if(pStaged->dwFlags & MPQ_FILE_COMPRESS)
+            dwCompressionAuto = SelectAutoCompressionFromData(ha, pStaged->pbFileData, pStaged->dwFileSize, pCompressionParams);
+        dwCompression = (dwCompression == MPQ_COMPRESSION_AUTO) ? dwCompressionAuto : dwCompression;
+        dwCompressionNext = (dwCompressionNext == MPQ_COMPRESSION_AUTO) ? dwCompressionAuto : dwCompressionNext;
+    }
+    if(pStaged->dwFileSize <= 0x1000)
+        dwCompressionNext = dwCompression;
+    pEntry->dwCompressionUsed = dwCompressionNext;
+
+    // Lossy compression is not allowed on single unit files
+    if((pStaged->dwFlags & MPQ_FILE_SINGLE_UNIT) && ((dwCompression | dwCompressionNext) & MPQ_LOSSY_COMPRESSION_MASK))
+        return ERROR_INVALID_PARAMETER;
+
+    // Determine the sector size and number of sectors
+    pStaged->dwSectorSize = (pStaged->dwFlags & MPQ_FILE_SINGLE_UNIT) ? pStaged->dwFileSize : ha->dwSectorSize;
+    pStaged->dwSectorCount = ((pStaged->dwFileSize - 1) / pStaged->dwSectorSize) + 1;
+
+    // Allocate the sector offsets and sector checksums
+    pStaged->SectorOffsets = STORM_ALLOC(DWORD, (pStaged->dwSectorCount + 1) * 2);
+    if(pStaged->SectorOffsets == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    pStaged->SectorChksums = pStaged->SectorOffsets + pStaged->dwSectorCount + 1;
+
+    // Allocate the buffer for compressed sectors. Compressed sector is never bigger
+    // than the plain one, so the buffer for the whole file is enough.
+    // Note that we allocate buffer that is a bit longer for case
+    // if the compression method performs a buffer overrun
+    pStaged->pbStaged = pStaged->pbFileData;
+    if(pStaged->dwFlags & (MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED))
+    {
+        pStaged->pbStaged = STORM_ALLOC(BYTE, pStaged->dwFileSize + 0x100);
+        if(pStaged->pbStaged == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // If the file key doesn't depend on the file position, we can encrypt the sectors now
+    if((pStaged->dwFlags & (MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2)) == MPQ_FILE_ENCRYPTED)
+    {
+        pStaged->dwFileKey = DecryptFileKey(pEntry->szArchivedName, 0, pStaged->dwFileSize, pStaged->dwFlags);
+        if(pStaged->dwFileKey == 0)
+            return ERROR_UNKNOWN_FILE_KEY;
+    }
+
+    // Compress all sectors. Note that SFileAddFileEx passes the first 0x1000 bytes
+    // with the first compression, so all sectors in them are compressed by it.
+    for(DWORD i = 0; i < pStaged->dwSectorCount; i++)
+    {
+        LPBYTE pbSector = pStaged->pbFileData + i * pStaged->dwSectorSize;
+
+        dwBytesInSector = STORMLIB_MIN(pStaged->dwFileSize - i * pStaged->dwSectorSize, pStaged->dwSectorSize);
+        pStaged->SectorOffsets[i] = dwStagedOffs;
+
+        // Compress the sector
+        dwBytesInSector = CompressFileSector(pStaged->dwFlags,
+                                             pStaged->pbStaged + dwStagedOffs,
+                                             pbSector,
+                                             dwBytesInSector,
+                                            (i * pStaged->dwSectorSize < 0x1000) ? dwCompression : dwCompressionNext,
+                                             pCompressionParams,
+                                            &pbToWrite);
+        if(pbToWrite != pStaged->pbStaged + dwStagedOffs)
+            memcpy(pStaged->pbStaged + dwStagedOffs, pbToWrite, dwBytesInSector);
+        pbToWrite = pStaged->pbStaged + dwStagedOffs;
+
+        // Calculate the sector checksum
+        if(pStaged->dwFlags & MPQ_FILE_SECTOR_CRC)
+            pStaged->SectorChksums[i] = adler32(0, pbToWrite, dwBytesInSector);
+
+        // Encrypt the sector, if we know the key
+        if(pStaged->dwFileKey != 0)
+            EncryptFileSector(pbToWrite, dwBytesInSector, pStaged->dwFileKey + i);
+        dwStagedOffs += dwBytesInSector;
+    }
+
+    pStaged->SectorOffsets[pStaged->dwSectorCount] = dwStagedOffs;
+    return ERROR_SUCCESS;
+}
+
+// Worker for compressing one staged file. Files that will share
+// the data of an identical file are not compressed at all
+static DWORD StageFile(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQStagedBatch * pBatch = (TMPQStagedBatch *)pvContext;
+    TMPQStagedFile * pStaged = pBatch->pFiles + dwItemIndex;
+
+    if(pStaged->bIsStaged && pStaged->dwErrCode == ERROR_SUCCESS)
+    {
+        if(pStaged->dwDuplicateOf == HASH_ENTRY_FREE && pStaged->pDuplicateOf == NULL)
+        {
+            pStaged->dwErrCode = CompressStagedFile(pBatch->ha, pStaged);
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Worker for encrypting a group of MPQ_CRYPT_LANES sectors of a staged file
+// whose key depends on the file position. The sectors are encrypted together
+static DWORD EncryptStagedSectors(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQStagedSectors * pSectors = (TMPQStagedSectors *)pvContext;
+    TMPQStagedFile * pStaged = pSectors->pStaged;
+    TMPQCryptBlock Blocks[MPQ_CRYPT_LANES];
+    LPDWORD SectorOffsets = pStaged->SectorOffsets;
+    DWORD dwFirstSector = dwItemIndex * MPQ_CRYPT_LANES;
+    DWORD dwBlockCount = STORMLIB_MIN(pStaged->dwSectorCount - dwFirstSector, MPQ_CRYPT_LANES);
+
+    for(DWORD i = 0; i < dwBlockCount; i++)
+    {
+        DWORD dwSector = dwFirstSector + i;
+
+        Blocks[i].pvDataBlock = pStaged->pbStaged + SectorOffsets[dwSector];
+        Blocks[i].dwLength = SectorOffsets[dwSector + 1] - SectorOffsets[dwSector];
+        Blocks[i].dwKey = pSectors->dwFileKey + dwSector;
+        BSWAP_ARRAY32_UNSIGNED(Blocks[i].pvDataBlock, Blocks[i].dwLength);
+    }
+
+    EncryptMpqBlocks(Blocks, dwBlockCount);
+
+    for(DWORD i = 0; i < dwBlockCount; i++)
+        BSWAP_ARRAY32_UNSIGNED(Blocks[i].pvDataBlock, Blocks[i].dwLength);
+    return ERROR_SUCCESS;
+}
+
+// Adds a staged file whose data are identical to the data of an existing file entry.
+// The new file entry points to the same data, nothing is written to the archive.
+static DWORD CommitDuplicateFile(TMPQArchive * ha, TMPQStagedFile * pStaged, TFileEntry * pSource)
+{
+    PSFILE_ADD_FILE_ENTRY pEntry = pStaged->pEntry;
+    TFileEntry * pFileEntry;
+    ULONGLONG ByteOffset = pSource->ByteOffset;
+    TMPQFile * hf = NULL;
+    DWORD dwCmpSize = pSource->dwCmpSize;
+    DWORD dwErrCode;
+
+    // Note that the source entry may be the one we are replacing,
+    // so we had to remember its position before creating the file
+    if(!SFileCreateFile((HANDLE)ha, pEntry->szArchivedName, pStaged->FileTime, pStaged->dwFileSize, g_lcFileLocale, pEntry->dwFlags, (HANDLE *)&hf))
+        return GetLastError();
+    pFileEntry = hf->pFileEntry;
+
+    // Share the data and the checksums of the source file
+    pFileEntry->ByteOffset = ByteOffset;
+    pFileEntry->dwCmpSize = dwCmpSize;
+    pFileEntry->dwCrc32 = pStaged->dwCrc32;
+    memcpy(pFileEntry->md5, pStaged->md5, MD5_DIGEST_SIZE);
+    pFileEntry->dwCurrentAttrs = MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5;
+
+    // Finish the file. This also frees the file handle
+    hf->dwFilePos = pStaged->dwFileSize;
+    if((dwErrCode = SFileAddFile_Finish(hf)) == ERROR_SUCCESS)
+        pStaged->dwFileIndex = (DWORD)(pFileEntry - ha->pFileTable);
+    return dwErrCode;
+}
+
+// Appends one staged file to the archive
+static DWORD CommitStagedFile(TMPQArchive * ha, TMPQStagedFile * pStaged)
+{
+    PSFILE_ADD_FILE_ENTRY pEntry = pStaged->pEntry;
+    TMPQFile * hf = NULL;
+    DWORD dwFileIndex;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Files that were not staged are added the usual way
+    if(pStaged->bIsStaged == false)
+    {
+        if(!AddLocalFile((HANDLE)ha, pEntry->szFileName, pEntry->szArchivedName, pEntry->dwFlags, pEntry->dwCompression, pEntry->dwCompressionNext, pEntry->pCompressionParams, &pEntry->dwCompressionUsed))
+            return GetLastError();
+        return ERROR_SUCCESS;
+    }
+
+    // Files identical to another file share its data. If the other file
+    // has failed or has been replaced meanwhile, we compress the file now
+    if(pStaged->dwDuplicateOf != HASH_ENTRY_FREE || pStaged->pDuplicateOf != NULL)
+    {
+        dwFileIndex = (pStaged->pDuplicateOf != NULL) ? pStaged->pDuplicateOf->dwFileIndex : pStaged->dwDuplicateOf;
+        if(dwFileIndex < ha->dwFileTableSize && IsDuplicateEntry(ha->pFileTable + dwFileIndex, pStaged))
+            return CommitDuplicateFile(ha, pStaged, ha->pFileTable + dwFileIndex);
+        if((dwErrCode = CompressStagedFile(ha, pStaged)) != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Initiate adding file to the MPQ. This reserves the file table and hash table entries
+    if(!SFileCreateFile((HANDLE)ha, pEntry->szArchivedName, pStaged->FileTime, pStaged->dwFileSize, g_lcFileLocale, pEntry->dwFlags, (HANDLE *)&hf))
+        return GetLastError();
+    dwFileIndex = (DWORD)(hf->pFileEntry - ha->pFileTable);
+
+    // The staged sectors can only be used if the file got the flags they were made for.
+    // Note that MPQ_FILE_REPLACEEXISTING is the same bit as MPQ_FILE_EXISTS
+    if((hf->pFileEntry->dwFlags & ~MPQ_FILE_EXISTS) != (pStaged->dwFlags & ~MPQ_FILE_EXISTS))
+        hf->dwAddFileError = ERROR_CAN_NOT_COMPLETE;
+
+    // Write the staged sectors
+    if(hf->dwAddFileError == ERROR_SUCCESS && pStaged->dwFileSize != 0)
+    {
+        // Prepare the file for writing
+        dwErrCode = PrepareFileWrite(ha, hf, pStaged->pbFileData, STORMLIB_MIN(pStaged->dwFileSize, 0x1000));
+
+        // Copy the checksums that we already calculated
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            if(hf->hctx != NULL)
+                memcpy(hf->hctx, &pStaged->md5_state, sizeof(hash_state));
+            if(hf->SectorChksums != NULL)
+                memcpy(hf->SectorChksums, pStaged->SectorChksums, pStaged->dwSectorCount * sizeof(DWORD));
+            hf->dwCrc32 = pStaged->dwCrc32;
+        }
+
+        // If the file key depends on the file position, we need to encrypt the sectors now
+        if(dwErrCode == ERROR_SUCCESS && (pStaged->dwFlags & MPQ_FILE_ENCRYPTED))
+        {
+            if(pStaged->dwFileKey == 0)
+            {
+                TMPQStagedSectors Sectors = {pStaged, hf->dwFileKey};
+
+                dwErrCode = ParallelForEach(ha, (pStaged->dwSectorCount + MPQ_CRYPT_LANES - 1) / MPQ_CRYPT_LANES, EncryptStagedSectors, &Sectors);
+                pStaged->dwFileKey = hf->dwFileKey;
+            }
+
+            // The sectors encrypted in advance must have the same key as the file
+            if(pStaged->dwFileKey != hf->dwFileKey)
+                dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        }
+
+        // Write all sectors in order
+        for(DWORD i = 0; i < pStaged->dwSectorCount && dwErrCode == ERROR_SUCCESS; i++)
+        {
+            hf->dwFilePos += STORMLIB_MIN(pStaged->dwFileSize - hf->dwFilePos, pStaged->dwSectorSize);
+            dwErrCode = WriteFileSector(ha, hf,
+                                        pStaged->pbStaged + pStaged->SectorOffsets[i],
+                                        pStaged->SectorOffsets[i + 1] - pStaged->SectorOffsets[i],
+                                        i);
+        }
+
+        // Save the sector tables
+        if(dwErrCode == ERROR_SUCCESS)
+            dwErrCode = CompleteFileWrite(ha, hf);
+
+        // Update the archive size
+        if((ha->MpqPos + hf->pFileEntry->ByteOffset + hf->pFileEntry->dwCmpSize) > ha->FileSize)
+            ha->FileSize = ha->MpqPos + hf->pFileEntry->ByteOffset + hf->pFileEntry->dwCmpSize;
+        UpdateFreeMpqSpace(ha, hf->pFileEntry);
+        hf->dwAddFileError = dwErrCode;
+    }
+
+    // Finish the file. This also frees the file handle
+    if((dwErrCode = SFileAddFile_Finish(hf)) == ERROR_SUCCESS)
+        pStaged->dwFileIndex = dwFileIndex;
+    return dwErrCode;
+}
+
+bool WINAPI SFileAddFiles(HANDLE hMpq, PSFILE_ADD_FILE_ENTRY pFileEntries, DWORD dwEntryCount)
+{
+    TMPQStagedBatch Batch;
+    TMPQDedupTable Dedup = {NULL, 0};
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TFileStream * pStream;
+    ULONGLONG FileSize;
+    DWORD dwStagedSize;
+    DWORD dwStagedCount;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Check parameters
+    if(ha == NULL || (pFileEntries == NULL && dwEntryCount != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Allocate the array of staged files
+    Batch.ha = ha;
+    Batch.pFiles = STORM_ALLOC(TMPQStagedFile, STORMLIB_MIN(dwEntryCount, MAX_STAGED_FILES));
+    if(Batch.pFiles == NULL && dwEntryCount != 0)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    // Prepare the lookup of identical files, if the caller asked for it
+    if((ha->dwFlags & MPQ_FLAG_DEDUPLICATE) && dwEntryCount != 0)
+    {
+        if((dwErrCode = CreateDedupTable(&Dedup, ha, dwEntryCount)) != ERROR_SUCCESS)
+        {
+            STORM_FREE(Batch.pFiles);
+            SetLastError(dwErrCode);
+            return false;
+        }
+    }
+
+    // Process the files in rounds, so we don't have too much data in memory
+    for(DWORD dwFirstEntry = 0; dwFirstEntry < dwEntryCount; dwFirstEntry += dwStagedCount)
+    {
+        // Open the source files of this round
+        for(dwStagedCount = dwStagedSize = 0; dwFirstEntry + dwStagedCount < dwEntryCount; dwStagedCount++)
+        {
+            PSFILE_ADD_FILE_ENTRY pEntry = pFileEntries + dwFirstEntry + dwStagedCount;
+            TMPQStagedFile * pStaged = Batch.pFiles + dwStagedCount;
+
+            // Stop if we have enough data or files
+            if(dwStagedCount >= MAX_STAGED_FILES || dwStagedSize >= MAX_STAGED_DATA_SIZE)
+                break;
+
+            // Open the source file, just to get its size and time.
+            // The file is loaded later, by LoadStagedFile
+            memset(pStaged, 0, sizeof(TMPQStagedFile));
+            pStaged->dwDuplicateOf = HASH_ENTRY_FREE;
+            pStaged->dwFileIndex = HASH_ENTRY_FREE;
+            pStaged->pEntry = pEntry;
+            pEntry->dwCompressionUsed = 0;
+            pStream = NULL;
+            if(pEntry->szFileName != NULL && pEntry->szFileName[0] != 0)
+                pStream = FileStream_OpenFile(pEntry->szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+            if(pStream == NULL)
+            {
+                pStaged->dwErrCode = (pEntry->szFileName != NULL) ? GetLastError() : ERROR_INVALID_PARAMETER;
+                continue;
+            }
+            FileStream_GetTime(pStream, &pStaged->FileTime);
+            FileStream_GetSize(pStream, &FileSize);
+            FileStream_Close(pStream);
+
+            // Files bigger than 4GB cannot be added to MPQ
+            if(FileSize >> 32)
+            {
+                pStaged->dwErrCode = ERROR_DISK_FULL;
+                continue;
+            }
+
+            // Big files are not staged. We let SFileAddFileEx do the job
+            if(FileSize > MAX_STAGED_FILE_SIZE)
+                continue;
+
+            // LZMA compression can only be present in MPQ version 2 or higher
+            if(pEntry->dwCompression == MPQ_COMPRESSION_LZMA && ha->pHeader->wFormatVersion == MPQ_FORMAT_VERSION_1)
+            {
+                pStaged->dwErrCode = ERROR_INVALID_PARAMETER;
+                continue;
+            }
+
+            // Remember the normalized file flags
+            pStaged->dwFlags = NormalizeAddFileFlags(pEntry->dwFlags & ha->dwValidFileFlags);
+            pStaged->dwFileSize = (DWORD)FileSize;
+            pStaged->bIsStaged = true;
+            dwStagedSize += pStaged->dwFileSize;
+        }
+
+        // Load all files of this round
+        ParallelForEach(ha, dwStagedCount, LoadStagedFile, &Batch);
+
+        // Find the files that don't need to be stored again
+        if(Dedup.FileIndexes != NULL)
+            FindDuplicateFiles(&Dedup, ha, Batch.pFiles, dwStagedCount);
+
+        // Compress the files
+        ParallelForEach(ha, dwStagedCount, StageFile, &Batch);
+
+        // Append the files to the archive in the caller's order
+        for(DWORD i = 0; i < dwStagedCount; i++)
+        {
+            TMPQStagedFile * pStaged = Batch.pFiles + i;
+            PSFILE_ADD_FILE_ENTRY pEntry = pStaged->pEntry;
+
+            // Add the file and free all its buffers
+            pEntry->dwErrCode = pStaged->dwErrCode;
+            if(pEntry->dwErrCode == ERROR_SUCCESS)
+                pEntry->dwErrCode = CommitStagedFile(ha, pStaged);
+            FreeStagedFile(pStaged);
+
+            // Files of the next rounds can share the data of this file
+            if(Dedup.FileIndexes != NULL && pStaged->dwFileIndex != HASH_ENTRY_FREE)
+            {
+                if(pStaged->dwDuplicateOf == HASH_ENTRY_FREE && IsDedupCandidate(pStaged->dwFlags, pStaged->dwFileSize))
+                    InsertDedupEntry(&Dedup, ha, pStaged->dwFileIndex);
+            }
+
+            // Remember the first error
+            if(dwErrCode == ERROR_SUCCESS)
+                dwErrCode = pEntry->dwErrCode;
+        }
+    }
+
+    // Free the staged file array
+    if(Dedup.FileIndexes != NULL)
+        STORM_FREE(Dedup.FileIndexes);
+    if(Batch.pFiles != NULL)
+        STORM_FREE(Batch.pFiles);
+    if(dwErrCode != ERROR_SUCCESS)
+        SetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
 //-----------------------------------------------------------------------------
 // bool SFileRemoveFile(HANDLE hMpq, char * szFileName)
 //
@@ -1257,6 +2385,72 @@ bool WINAPI SFileSetDataCompression(DWORD DataCompression)
     return true;
 }
 
+//-----------------------------------------------------------------------------
+// Sets compression settings for files added to the archive (SFileSetCompressionParams)
+// or for one file that is being added (SFileSetFileCompressionParams).
+// NULL restores the default settings.
+
+static bool IsValidCompressionParams(PSFILE_COMPRESSION_PARAMS pParams)
+{
+    if(pParams->nZlibLevel < 0 || pParams->nZlibLevel > 9)
+        return false;
+    if(pParams->nZlibStrategy < 0 || pParams->nZlibStrategy > Z_FIXED)
+        return false;
+    if(pParams->nBzip2BlockSize < 0 || pParams->nBzip2BlockSize > 9)
+        return false;
+    if(pParams->nLzmaLevel < 0 || pParams->nLzmaLevel > 9)
+        return false;
+    return true;
+}
+
+bool WINAPI SFileSetCompressionParams(HANDLE hMpq, PSFILE_COMPRESSION_PARAMS pParams)
+{
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+
+    // Check the parameters
+    if(ha == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    if(pParams != NULL && !IsValidCompressionParams(pParams))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Remember the settings
+    if(pParams != NULL)
+        ha->CompressionParams = pParams[0];
+    else
+        memset(&ha->CompressionParams, 0, sizeof(SFILE_COMPRESSION_PARAMS));
+    return true;
+}
+
+bool WINAPI SFileSetFileCompressionParams(HANDLE hFile, PSFILE_COMPRESSION_PARAMS pParams)
+{
+    TMPQFile * hf = IsValidFileHandle(hFile);
+
+    // The handle must be created by SFileCreateFile
+    if(hf == NULL || hf->bIsWriteHandle == false)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    if(pParams != NULL && !IsValidCompressionParams(pParams))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Remember the settings. They apply to sectors written from now on
+    if(pParams != NULL)
+        hf->CompressionParams = pParams[0];
+    else
+        memset(&hf->CompressionParams, 0, sizeof(SFILE_COMPRESSION_PARAMS));
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 // Changes locale ID of a file
 
@@ -1335,3 +2529,28 @@ bool WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALLBACK AddFileC
     ha->pfnAddFileCB = AddFileCB;
     return true;
 }
+
+//-----------------------------------------------------------------------------
+// Enables or disables sharing of data of identical files
+//
+// If enabled, SFileAddFiles stores a file whose data are identical to another
+// file added since the archive was open (or to another file of the same call)
+// only once; both file entries then point to the same data. Only files without
+// MPQ_FILE_ENCRYPTED and MPQ_FILE_PATCH_FILE can share their data.
+
+bool WINAPI SFileSetDeduplication(HANDLE hMpq, bool bDeduplicate)
+{
+    TMPQArchive * ha = (TMPQArchive *) hMpq;
+
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(bDeduplicate)
+        ha->dwFlags |= MPQ_FLAG_DEDUPLICATE;
+    else
+        ha->dwFlags &= ~MPQ_FLAG_DEDUPLICATE;
+    return true;
+}
@@ -538,8 +538,17 @@ bool WINAPI SFileUpdateFileAttributes(HANDLE hMpq, const char * szFileName)
     if(!SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_BASE_FILE, &hFile))
         return false;
 
-    // Get the file size
+    // If both checksums have been calculated when the file was written,
+    // they are still valid. Renaming and compacting only moves the data
     hf = (TMPQFile *)hFile;
+    if((hf->pFileEntry->dwCurrentAttrs & (MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5)) == (MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5))
+    {
+        InvalidateInternalFiles(ha);
+        SFileCloseFile(hFile);
+        return true;
+    }
+
+    // Get the file size
     dwTotalBytes = hf->pFileEntry->dwFileSize;
 
     // Initialize the CRC32 and MD5 contexts
@@ -565,6 +574,8 @@ bool WINAPI SFileUpdateFileAttributes(HANDLE hMpq, const char * szFileName)
     // Update both CRC32 and MD5
     hf->pFileEntry->dwCrc32 = dwCrc32;
     md5_done(&md5_state, hf->pFileEntry->md5);
+    if(dwTotalBytes == 0)
+        hf->pFileEntry->dwCurrentAttrs = MPQ_ATTRIBUTE_CRC32 | MPQ_ATTRIBUTE_MD5;
 
     // Remember that we need to save the MPQ tables
     InvalidateInternalFiles(ha);
@@ -18,6 +18,8 @@
 /* Local functions                                                           */
 /*****************************************************************************/
 
+#define COMPACT_COPY_BUFFER_SIZE    0x00400000  // Size of the buffer for copying the file data
+
 static DWORD CheckIfAllFilesKnown(TMPQArchive * ha)
 {
     TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
@@ -142,6 +144,166 @@ static DWORD CopyNonMpqData(
     return dwErrCode;
 }
 
+//-----------------------------------------------------------------------------
+// Re-encrypting files whose key depends on the file position
+
+// One block of data encrypted with its own key
+typedef struct _TMPQRekeyBlock
+{
+    DWORD dwOffset;                         // Offset of the block within the file data
+    DWORD dwLength;                         // Length of the block
+    DWORD dwOldKey;                         // Key the block is encrypted with
+    DWORD dwNewKey;                         // Key the block must be encrypted with
+} TMPQRekeyBlock;
+
+// Blocks that are re-encrypted at once by multiple threads
+typedef struct _TMPQRekeyBatch
+{
+    TMPQRekeyBlock * pBlocks;               // The first block of the batch
+    LPBYTE pbData;                          // Loaded data of the batch
+    DWORD dwDataOffset;                     // Offset of the loaded data within the file data
+    DWORD dwBlockCount;                     // Number of blocks in the batch
+} TMPQRekeyBatch;
+
+static void RekeyBlock(LPBYTE pbBlock, DWORD dwLength, DWORD dwOldKey, DWORD dwNewKey)
+{
+    BSWAP_ARRAY32_UNSIGNED(pbBlock, dwLength);
+    DecryptMpqBlock(pbBlock, dwLength, dwOldKey);
+    EncryptMpqBlock(pbBlock, dwLength, dwNewKey);
+    BSWAP_ARRAY32_UNSIGNED(pbBlock, dwLength);
+}
+
+// Worker for re-encrypting a group of MPQ_CRYPT_LANES blocks of the batch.
+// The blocks of the group are decrypted and encrypted together
+static DWORD RekeyBatchBlocks(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQRekeyBatch * pBatch = (TMPQRekeyBatch *)pvContext;
+    TMPQRekeyBlock * pBlock = pBatch->pBlocks + dwItemIndex * MPQ_CRYPT_LANES;
+    TMPQCryptBlock Blocks[MPQ_CRYPT_LANES];
+    DWORD dwBlockCount = STORMLIB_MIN(pBatch->dwBlockCount - dwItemIndex * MPQ_CRYPT_LANES, MPQ_CRYPT_LANES);
+
+    for(DWORD i = 0; i < dwBlockCount; i++)
+    {
+        Blocks[i].pvDataBlock = pBatch->pbData + (pBlock[i].dwOffset - pBatch->dwDataOffset);
+        Blocks[i].dwLength = pBlock[i].dwLength;
+        Blocks[i].dwKey = pBlock[i].dwOldKey;
+        BSWAP_ARRAY32_UNSIGNED(Blocks[i].pvDataBlock, Blocks[i].dwLength);
+    }
+
+    DecryptMpqBlocks(Blocks, dwBlockCount);
+    for(DWORD i = 0; i < dwBlockCount; i++)
+        Blocks[i].dwKey = pBlock[i].dwNewKey;
+    EncryptMpqBlocks(Blocks, dwBlockCount);
+
+    for(DWORD i = 0; i < dwBlockCount; i++)
+        BSWAP_ARRAY32_UNSIGNED(Blocks[i].pvDataBlock, Blocks[i].dwLength);
+    return ERROR_SUCCESS;
+}
+
+// Re-encrypts all blocks of the batch on the worker threads of the archive
+static void RekeyBatch(TMPQArchive * ha, TMPQRekeyBatch * pBatch)
+{
+    ParallelForEach(ha, (pBatch->dwBlockCount + MPQ_CRYPT_LANES - 1) / MPQ_CRYPT_LANES, RekeyBatchBlocks, pBatch);
+}
+
+// Copies the file sectors that need to be re-encrypted. The sectors are loaded
+// in batches of up to COMPACT_COPY_BUFFER_SIZE bytes, re-encrypted by all threads,
+// and written in order.
+static DWORD RekeyMpqFileSectors(
+    TMPQArchive * ha,
+    TMPQFile * hf,
+    TFileStream * pNewStream,
+    DWORD dwFileKey1,
+    DWORD dwFileKey2,
+    DWORD & dwBytesToCopy,
+    DWORD & dwCmpSize)
+{
+    TMPQRekeyBatch Batch;
+    TMPQRekeyBlock * pBlocks;
+    ULONGLONG RawFilePos;
+    LPBYTE pbBuffer;
+    DWORD cbBuffer = STORMLIB_MAX(hf->dwSectorSize, COMPACT_COPY_BUFFER_SIZE);
+    DWORD dwBytesRemaining = dwBytesToCopy;
+    DWORD dwBatchSize;
+    DWORD dwLast;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Allocate the sector array and the buffer
+    pBlocks = STORM_ALLOC(TMPQRekeyBlock, hf->dwSectorCount);
+    pbBuffer = STORM_ALLOC(BYTE, cbBuffer);
+    if(pBlocks == NULL || pbBuffer == NULL)
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Describe all sectors
+    for(DWORD dwSector = 0; dwErrCode == ERROR_SUCCESS && dwSector < hf->dwSectorCount; dwSector++)
+    {
+        TMPQRekeyBlock * pBlock = pBlocks + dwSector;
+
+        pBlock->dwOffset = dwSector * hf->dwSectorSize;
+        pBlock->dwLength = hf->dwSectorSize;
+        if(hf->SectorOffsets != NULL)
+        {
+            pBlock->dwOffset = hf->SectorOffsets[dwSector];
+            pBlock->dwLength = hf->SectorOffsets[dwSector+1] - hf->SectorOffsets[dwSector];
+        }
+
+        // Last sector: If there is not enough bytes remaining in the file, cut the raw size
+        pBlock->dwLength = STORMLIB_MIN(pBlock->dwLength, dwBytesRemaining);
+        pBlock->dwOldKey = dwFileKey1 + dwSector;
+        pBlock->dwNewKey = dwFileKey2 + dwSector;
+        dwBytesRemaining -= pBlock->dwLength;
+    }
+
+    // Process the sectors in batches
+    for(DWORD dwFirst = 0; dwErrCode == ERROR_SUCCESS && dwFirst < hf->dwSectorCount; dwFirst = dwLast)
+    {
+        // Take as many sectors as fits into the buffer
+        for(dwLast = dwFirst, dwBatchSize = 0; dwLast < hf->dwSectorCount; dwLast++)
+        {
+            if(dwBatchSize + pBlocks[dwLast].dwLength > cbBuffer)
+                break;
+            dwBatchSize += pBlocks[dwLast].dwLength;
+        }
+
+        // Read the sectors. They follow each other in the file
+        RawFilePos = CalculateRawSectorOffset(hf, pBlocks[dwFirst].dwOffset);
+        if(!FileStream_Read(ha->pStream, &RawFilePos, pbBuffer, dwBatchSize))
+        {
+            dwErrCode = GetLastError();
+            break;
+        }
+
+        // Re-encrypt the sectors and write them to the new archive
+        Batch.pBlocks = pBlocks + dwFirst;
+        Batch.pbData = pbBuffer;
+        Batch.dwDataOffset = pBlocks[dwFirst].dwOffset;
+        Batch.dwBlockCount = dwLast - dwFirst;
+        RekeyBatch(ha, &Batch);
+        if(!FileStream_Write(pNewStream, NULL, pbBuffer, dwBatchSize))
+        {
+            dwErrCode = GetLastError();
+            break;
+        }
+
+        // Update compact progress
+        if(ha->pfnCompactCB != NULL)
+        {
+            ha->CompactBytesProcessed += dwBatchSize;
+            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+        }
+
+        // Adjust byte counts
+        dwBytesToCopy -= dwBatchSize;
+        dwCmpSize += dwBatchSize;
+    }
+
+    if(pbBuffer != NULL)
+        STORM_FREE(pbBuffer);
+    if(pBlocks != NULL)
+        STORM_FREE(pBlocks);
+    return dwErrCode;
+}
+
 // Copies all file sectors into another archive.
 static DWORD CopyMpqFileSectors(
     TMPQArchive * ha,
@@ -218,9 +380,15 @@ static DWORD CopyMpqFileSectors(
         STORM_FREE(SectorOffsetsCopy);
     }
 
+    // Re-encrypting the sectors is the slow part. With more threads, many sectors are re-encrypted at once
+    if(dwErrCode == ERROR_SUCCESS && dwFileKey1 != dwFileKey2 && ha->dwThreadCount > 1 && hf->dwSectorCount > 1)
+    {
+        dwErrCode = RekeyMpqFileSectors(ha, hf, pNewStream, dwFileKey1, dwFileKey2, dwBytesToCopy, dwCmpSize);
+    }
+
     // Now we have to copy all file sectors. We do it without
     // recompression, because recompression is not necessary in this case
-    if(dwErrCode == ERROR_SUCCESS)
+    else if(dwErrCode == ERROR_SUCCESS)
     {
         for(DWORD dwSector = 0; dwSector < hf->dwSectorCount; dwSector++)
         {
@@ -252,12 +420,7 @@ static DWORD CopyMpqFileSectors(
             // Note: Recompression is not necessary here. Unlike encryption,
             // the compression does not depend on the position of the file in MPQ.
             if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && dwFileKey1 != dwFileKey2)
-            {
-                BSWAP_ARRAY32_UNSIGNED(hf->pbFileSector, dwRawDataInSector);
-                DecryptMpqBlock(hf->pbFileSector, dwRawDataInSector, dwFileKey1 + dwSector);
-                EncryptMpqBlock(hf->pbFileSector, dwRawDataInSector, dwFileKey2 + dwSector);
-                BSWAP_ARRAY32_UNSIGNED(hf->pbFileSector, dwRawDataInSector);
-            }
+                RekeyBlock(hf->pbFileSector, dwRawDataInSector, dwFileKey1 + dwSector, dwFileKey2 + dwSector);
 
             // Now write the sector back to the file
             if(!FileStream_Write(pNewStream, NULL, hf->pbFileSector, dwRawDataInSector))
@@ -288,7 +451,9 @@ static DWORD CopyMpqFileSectors(
         dwCrcLength = hf->SectorOffsets[hf->dwSectorCount + 1] - hf->SectorOffsets[hf->dwSectorCount];
         if(dwCrcLength != 0)
         {
-            if(!FileStream_Read(ha->pStream, NULL, hf->SectorChksums, dwCrcLength))
+            // The sector CRCs follow the data copied so far
+            RawFilePos = CalculateRawSectorOffset(hf, pFileEntry->dwCmpSize - dwBytesToCopy);
+            if(!FileStream_Read(ha->pStream, &RawFilePos, hf->SectorChksums, dwCrcLength))
                 dwErrCode = GetLastError();
 
             if(!FileStream_Write(pNewStream, NULL, hf->SectorChksums, dwCrcLength))
@@ -320,7 +485,8 @@ static DWORD CopyMpqFileSectors(
         pbExtraData = STORM_ALLOC(BYTE, dwBytesToCopy);
         if(pbExtraData != NULL)
         {
-            if(!FileStream_Read(ha->pStream, NULL, pbExtraData, dwBytesToCopy))
+            RawFilePos = CalculateRawSectorOffset(hf, pFileEntry->dwCmpSize - dwBytesToCopy);
+            if(!FileStream_Read(ha->pStream, &RawFilePos, pbExtraData, dwBytesToCopy))
                 dwErrCode = GetLastError();
 
             if(!FileStream_Write(pNewStream, NULL, pbExtraData, dwBytesToCopy))
@@ -370,79 +536,1032 @@ static DWORD CopyMpqFileSectors(
     return dwErrCode;
 }
 
-static DWORD CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewStream)
+// Unencrypted files with identical data may share the same data in the archive
+// (see SFileSetDeduplication). For each file entry, this finds the lowest file index
+// whose data are shared with it, so that the data are copied only once.
+static LPDWORD FindSharedFileData(TMPQArchive * ha)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQOffsetOrder * pOrder;
     TFileEntry * pFileEntry;
-    TMPQFile * hf = NULL;
-    ULONGLONG MpqFilePos;
+    LPDWORD pSharedWith;
+    DWORD dwOrderCount = 0;
+
+    // Allocate the arrays
+    pSharedWith = STORM_ALLOC(DWORD, ha->dwFileTableSize);
+    pOrder = STORM_ALLOC(TMPQOffsetOrder, ha->dwFileTableSize);
+    if(pSharedWith == NULL || pOrder == NULL)
+    {
+        if(pSharedWith != NULL)
+            STORM_FREE(pSharedWith);
+        if(pOrder != NULL)
+            STORM_FREE(pOrder);
+        return NULL;
+    }
+
+    // Each file owns its data by default. Only unencrypted files are candidates
+    for(DWORD i = 0; i < ha->dwFileTableSize; i++)
+    {
+        pFileEntry = ha->pFileTable + i;
+        pSharedWith[i] = i;
+
+        if((pFileEntry->dwFlags & (MPQ_FILE_EXISTS | MPQ_FILE_ENCRYPTED)) == MPQ_FILE_EXISTS && pFileEntry->dwCmpSize != 0)
+        {
+            pOrder[dwOrderCount].ByteOffset = pFileEntry->ByteOffset;
+            pOrder[dwOrderCount].pFileEntry = pFileEntry;
+            pOrder[dwOrderCount].dwIndex = i;
+            dwOrderCount++;
+        }
+    }
+
+    // Entries with identical position, sizes and flags share the data
+    SortByByteOffset(pOrder, dwOrderCount);
+    for(DWORD i = 1; i < dwOrderCount; i++)
+    {
+        TFileEntry * pPrevEntry = pOrder[i - 1].pFileEntry;
+
+        pFileEntry = pOrder[i].pFileEntry;
+        if(pFileEntry->ByteOffset == pPrevEntry->ByteOffset &&
+           pFileEntry->dwCmpSize  == pPrevEntry->dwCmpSize  &&
+           pFileEntry->dwFileSize == pPrevEntry->dwFileSize &&
+           pFileEntry->dwFlags    == pPrevEntry->dwFlags)
+        {
+            pSharedWith[pOrder[i].dwIndex] = pSharedWith[pOrder[i - 1].dwIndex];
+        }
+    }
+
+    STORM_FREE(pOrder);
+    return pSharedWith;
+}
+
+// Copies one file sector by sector. Used for files that need to be re-encrypted
+static DWORD CopyMpqFile(TMPQArchive * ha, TFileEntry * pFileEntry, DWORD dwFileKey, TFileStream * pNewStream, ULONGLONG MpqFilePos)
+{
+    TMPQFile * hf;
     DWORD dwErrCode = ERROR_SUCCESS;
 
-    // Walk through all files and write them to the destination MPQ archive
-    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    // Allocate structure for the MPQ file
+    hf = CreateFileHandle(ha, pFileEntry);
+    if(hf == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Set the file decryption key
+    hf->dwFileKey = dwFileKey;
+
+    // If the file is a patch file, load the patch header
+    if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
+        dwErrCode = AllocatePatchInfo(hf, true);
+
+    // Allocate buffers for file sector and sector offset table
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateSectorBuffer(hf);
+
+    // Also allocate sector offset table and sector checksum table
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateSectorOffsets(hf, true);
+
+    // Also load sector checksums, if any
+    if(dwErrCode == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+        dwErrCode = AllocateSectorChecksums(hf, false);
+
+    // Copy all file sectors
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CopyMpqFileSectors(ha, hf, pNewStream, MpqFilePos);
+
+    FreeFileHandle(hf);
+    return dwErrCode;
+}
+
+// Copies a continuous block of data of one or more files, as-is
+static DWORD CopyMpqFileData(TMPQArchive * ha, TFileStream * pNewStream, LPBYTE pbBuffer, ULONGLONG ByteOffset, ULONGLONG ByteCount)
+{
+    DWORD dwToCopy;
+
+    ByteOffset += ha->MpqPos;
+    while(ByteCount > 0)
     {
-        // Copy all the file sectors
-        // Only do that when the file has nonzero size
-        if((pFileEntry->dwFlags & MPQ_FILE_EXISTS))
+        dwToCopy = (DWORD)STORMLIB_MIN(ByteCount, COMPACT_COPY_BUFFER_SIZE);
+
+        // Read the data and write them to the new archive
+        if(!FileStream_Read(ha->pStream, &ByteOffset, pbBuffer, dwToCopy))
+            return GetLastError();
+        if(!FileStream_Write(pNewStream, NULL, pbBuffer, dwToCopy))
+            return GetLastError();
+
+        // Update compact progress
+        if(ha->pfnCompactCB != NULL)
         {
-            // Query the position where the destination file will be
-            FileStream_GetPos(pNewStream, &MpqFilePos);
-            MpqFilePos = MpqFilePos - ha->MpqPos;
+            ha->CompactBytesProcessed += dwToCopy;
+            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+        }
+
+        ByteOffset += dwToCopy;
+        ByteCount -= dwToCopy;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+// The files are copied in the order of their positions. Files that don't need
+// to be re-encrypted are copied as-is, together with the raw data MD5s.
+// Such files that follow each other in the old archive are copied in one go.
+static DWORD CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewStream)
+{
+    TMPQOffsetOrder * pOrder;
+    TFileEntry * pFileEntry;
+    ULONGLONG MpqFilePos = 0;           // Position of the next file in the new archive
+    ULONGLONG CopyOffset = 0;           // Position of the pending data in the old archive
+    ULONGLONG CopyLength = 0;           // Length of the pending data
+    ULONGLONG FileDataSize;
+    LPDWORD pSharedWith;
+    LPBYTE pbBuffer;
+    DWORD dwOrderCount = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
 
-            // Perform file copy ONLY if the file has nonzero size
-            if(pFileEntry->dwFileSize != 0)
+    // Find the files that share their data and allocate the buffers
+    pSharedWith = FindSharedFileData(ha);
+    pOrder = STORM_ALLOC(TMPQOffsetOrder, ha->dwFileTableSize + 1);
+    pbBuffer = STORM_ALLOC(BYTE, COMPACT_COPY_BUFFER_SIZE);
+    if(pSharedWith == NULL || pOrder == NULL || pbBuffer == NULL)
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Sort the existing files by their position in the old archive
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < ha->dwFileTableSize; i++)
+        {
+            if(ha->pFileTable[i].dwFlags & MPQ_FILE_EXISTS)
             {
-                // Allocate structure for the MPQ file
-                hf = CreateFileHandle(ha, pFileEntry);
-                if(hf == NULL)
-                    return ERROR_NOT_ENOUGH_MEMORY;
+                pOrder[dwOrderCount].ByteOffset = ha->pFileTable[i].ByteOffset;
+                pOrder[dwOrderCount].pFileEntry = ha->pFileTable + i;
+                pOrder[dwOrderCount].dwIndex = i;
+                dwOrderCount++;
+            }
+        }
+        SortByByteOffset(pOrder, dwOrderCount);
 
-                // Set the file decryption key
-                hf->dwFileKey = pFileKeys[pFileEntry - ha->pFileTable];
+        // Query the position where the first file will be
+        FileStream_GetPos(pNewStream, &MpqFilePos);
+        MpqFilePos = MpqFilePos - ha->MpqPos;
+    }
 
-                // If the file is a patch file, load the patch header
-                if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
-                {
-                    dwErrCode = AllocatePatchInfo(hf, true);
-                    if(dwErrCode != ERROR_SUCCESS)
-                        break;
-                }
+    // Walk through all files and write them to the destination MPQ archive
+    for(DWORD i = 0; dwErrCode == ERROR_SUCCESS && i < dwOrderCount; i++)
+    {
+        DWORD dwFileIndex = pOrder[i].dwIndex;
 
-                // Allocate buffers for file sector and sector offset table
-                dwErrCode = AllocateSectorBuffer(hf);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
+        // If the data are shared with a file that has already been copied,
+        // we just point the file to the new position of the data
+        pFileEntry = ha->pFileTable + dwFileIndex;
+        if(pSharedWith[dwFileIndex] != dwFileIndex)
+        {
+            pFileEntry->ByteOffset = ha->pFileTable[pSharedWith[dwFileIndex]].ByteOffset;
+            continue;
+        }
+
+        // Perform file copy ONLY if the file has nonzero size
+        if(pFileEntry->dwFileSize != 0)
+        {
+            // Files whose key depends on the position must be copied sector by sector.
+            // Also patch files, because some of them don't count the patch header into compressed size
+            if((pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE) ||
+              ((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && (pFileEntry->dwFlags & MPQ_FILE_KEY_V2) && pFileEntry->ByteOffset != MpqFilePos))
+            {
+                // Write the pending data first
+                dwErrCode = CopyMpqFileData(ha, pNewStream, pbBuffer, CopyOffset, CopyLength);
+                CopyLength = 0;
 
-                // Also allocate sector offset table and sector checksum table
-                dwErrCode = AllocateSectorOffsets(hf, true);
+                if(dwErrCode == ERROR_SUCCESS)
+                    dwErrCode = CopyMpqFile(ha, pFileEntry, pFileKeys[dwFileIndex], pNewStream, MpqFilePos);
                 if(dwErrCode != ERROR_SUCCESS)
                     break;
 
-                // Also load sector checksums, if any
-                if(pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC)
+                // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
+                pFileEntry->ByteOffset = MpqFilePos;
+                FileStream_GetPos(pNewStream, &MpqFilePos);
+                MpqFilePos = MpqFilePos - ha->MpqPos;
+                continue;
+            }
+
+            // Join the file to the pending data, if it follows them
+            FileDataSize = GetFileDataEnd(ha, pFileEntry) - pFileEntry->ByteOffset;
+            if(pFileEntry->ByteOffset != CopyOffset + CopyLength)
+            {
+                dwErrCode = CopyMpqFileData(ha, pNewStream, pbBuffer, CopyOffset, CopyLength);
+                CopyOffset = pFileEntry->ByteOffset;
+                CopyLength = 0;
+            }
+            CopyLength += FileDataSize;
+
+            // The file will be at the end of the pending data
+            pFileEntry->ByteOffset = MpqFilePos;
+            MpqFilePos += FileDataSize;
+        }
+        else
+        {
+            pFileEntry->ByteOffset = MpqFilePos;
+        }
+    }
+
+    // Write the rest of the pending data
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CopyMpqFileData(ha, pNewStream, pbBuffer, CopyOffset, CopyLength);
+
+    // Cleanup and exit
+    if(pbBuffer != NULL)
+        STORM_FREE(pbBuffer);
+    if(pOrder != NULL)
+        STORM_FREE(pOrder);
+    if(pSharedWith != NULL)
+        STORM_FREE(pSharedWith);
+    return dwErrCode;
+}
+
+//-----------------------------------------------------------------------------
+// Compacting the archive in place
+//
+// The file data are moved towards the begin of the archive in the order of their
+// positions, so a move never overwrites data that haven't been moved yet.
+// Only the moved bytes are read and written, the rest of the archive stays untouched.
+//
+// Before anything is moved, the list of moves is saved into a journal file next
+// to the archive. The journal also keeps the progress of the current move and,
+// when a piece of data overlaps its own old position, a copy of that piece.
+// Until the new tables are saved, the archive header points to the old tables.
+// If the compaction gets interrupted, the next SFileOpenArchive with write access
+// finishes the moves from the journal. Opening the archive read-only fails with
+// ERROR_COMPACT_INCOMPLETE until then. The journal is only meant to be read
+// on the machine that wrote it.
+//
+// The data and the journal are flushed to the disk before anything is overwritten,
+// so the journal never says that a piece has been moved before the piece is on the disk.
+//
+
+#define ID_COMPACT_JOURNAL      0x4A51504D      // Signature of the journal file ('MPQJ')
+#define COMPACT_JOURNAL_EXT     _T(".journal")  // Extension of the journal file name
+#define COMPACT_STALE_EXT       _T(".stale")    // Appended to the name of a journal that doesn't match the archive
+#define COMPACT_CHUNK_SIZE      0x00100000      // Size of one piece of the moved data
+#define COMPACT_BATCH_SIZE      0x01000000      // Maximum size of the re-encrypted data loaded at once
+
+typedef struct _TMPQJournalHeader
+{
+    DWORD dwSignature;                      // ID_COMPACT_JOURNAL
+    DWORD dwBlockTableSize;                 // Number of entries in the block table saved in the archive
+    DWORD dwMoveCount;                      // Number of moves
+    DWORD dwRegionCount;                    // Number of re-encrypted regions
+    ULONGLONG MpqPos;                       // Position of the MPQ header in the file
+    ULONGLONG CompactedEnd;                 // End of the file data after compacting, relative to the MPQ header
+} TMPQJournalHeader;
+
+typedef struct _TMPQJournalProgress
+{
+    ULONGLONG BytesDone;                    // Number of bytes of the current move that are at the new position
+    DWORD dwMoveIndex;                      // Index of the current move. dwMoveCount = all data have been moved
+    DWORD dwChunkSize;                      // If nonzero, the piece at BytesDone is stored in the journal
+} TMPQJournalProgress;
+
+// Position of one file entry before and after compacting, relative to the MPQ header.
+// The old position and the compressed size identify the entry when the archive is open again
+typedef struct _TMPQJournalEntry
+{
+    ULONGLONG OldOffset;                    // Position of the file data before compacting
+    ULONGLONG NewOffset;                    // Position of the file data after compacting
+    DWORD dwCmpSize;                        // Compressed size of the file
+    DWORD dwFlags;                          // MPQ_FILE_EXISTS if the entry is in use
+} TMPQJournalEntry;
+
+// One block of data to be moved, relative to the MPQ header
+typedef struct _TMPQJournalMove
+{
+    ULONGLONG OldOffset;                    // Position of the data before compacting
+    ULONGLONG NewOffset;                    // Position of the data after compacting
+    ULONGLONG Length;                       // Length of the moved data
+    DWORD dwFirstRegion;                    // Index of the first re-encrypted region of the move
+    DWORD dwRegionCount;                    // Number of re-encrypted regions. Nonzero for MPQ_FILE_KEY_V2 files
+} TMPQJournalMove;
+
+// Encrypted part of a MPQ_FILE_KEY_V2 file, whose key changes with the file position.
+// The offset is relative to the begin of the moved data
+typedef TMPQRekeyBlock TMPQJournalRegion;
+
+typedef struct _TMPQCompactJournal
+{
+    TFileStream * pStream;                  // Stream of the journal file
+    TMPQJournalHeader Header;
+    TMPQJournalProgress Progress;
+    TMPQJournalEntry * pEntries;            // Old and new positions of all entries of the block table
+    TMPQJournalMove * pMoves;
+    TMPQJournalRegion * pRegions;
+    LPBYTE pbChunk;                         // Buffer for one piece of the data
+    DWORD cbChunk;                          // Size of the buffer
+    DWORD dwMaxRegions;                     // Number of allocated regions
+} TMPQCompactJournal;
+
+static void GetJournalFileName(TMPQArchive * ha, TCHAR * szJournalFile, size_t cchJournalFile)
+{
+    StringCopy(szJournalFile, cchJournalFile, FileStream_GetFileName(ha->pStream));
+    StringCat(szJournalFile, cchJournalFile, COMPACT_JOURNAL_EXT);
+}
+
+static void FreeCompactJournal(TMPQCompactJournal * pJournal)
+{
+    if(pJournal->pStream != NULL)
+        FileStream_Close(pJournal->pStream);
+    if(pJournal->pEntries != NULL)
+        STORM_FREE(pJournal->pEntries);
+    if(pJournal->pMoves != NULL)
+        STORM_FREE(pJournal->pMoves);
+    if(pJournal->pRegions != NULL)
+        STORM_FREE(pJournal->pRegions);
+    if(pJournal->pbChunk != NULL)
+        STORM_FREE(pJournal->pbChunk);
+    memset(pJournal, 0, sizeof(TMPQCompactJournal));
+}
+
+// Journal layout: header, progress, file entries, moves, regions, saved piece of data
+static ULONGLONG GetJournalDataOffset(TMPQCompactJournal * pJournal, DWORD dwPart)
+{
+    ULONGLONG ByteOffset = sizeof(TMPQJournalHeader);
+
+    if(dwPart > 0)
+        ByteOffset += sizeof(TMPQJournalProgress);
+    if(dwPart > 1)
+        ByteOffset += pJournal->Header.dwBlockTableSize * sizeof(TMPQJournalEntry);
+    if(dwPart > 2)
+        ByteOffset += pJournal->Header.dwMoveCount * sizeof(TMPQJournalMove);
+    if(dwPart > 3)
+        ByteOffset += pJournal->Header.dwRegionCount * sizeof(TMPQJournalRegion);
+    return ByteOffset;
+}
+
+// Saves the progress. Everything written to the archive so far must be on the disk
+// before the journal says so, and the journal must be on the disk before a write
+// to the archive overwrites the old data
+static DWORD WriteJournalProgress(TMPQArchive * ha, TMPQCompactJournal * pJournal)
+{
+    ULONGLONG ByteOffset = GetJournalDataOffset(pJournal, 0);
+
+    if(!FileStream_Flush(ha->pStream))
+        return GetLastError();
+    if(!FileStream_Write(pJournal->pStream, &ByteOffset, &pJournal->Progress, sizeof(TMPQJournalProgress)))
+        return GetLastError();
+    if(!FileStream_Flush(pJournal->pStream))
+        return GetLastError();
+    return ERROR_SUCCESS;
+}
+
+// Allocates the buffer for the moved data. Files that need re-encrypting are loaded
+// in batches of up to COMPACT_BATCH_SIZE bytes. Encrypted regions are never split,
+// so the buffer must also hold the biggest of them
+static DWORD AllocateJournalChunk(TMPQCompactJournal * pJournal)
+{
+    pJournal->cbChunk = (pJournal->Header.dwRegionCount != 0) ? COMPACT_BATCH_SIZE : COMPACT_CHUNK_SIZE;
+    for(DWORD i = 0; i < pJournal->Header.dwRegionCount; i++)
+        pJournal->cbChunk = STORMLIB_MAX(pJournal->cbChunk, pJournal->pRegions[i].dwLength);
+
+    pJournal->pbChunk = STORM_ALLOC(BYTE, pJournal->cbChunk);
+    return (pJournal->pbChunk != NULL) ? ERROR_SUCCESS : ERROR_NOT_ENOUGH_MEMORY;
+}
+
+// Finds the encrypted regions of a MPQ_FILE_KEY_V2 file that is going to be moved
+static DWORD AddRekeyRegions(TMPQArchive * ha, TFileEntry * pFileEntry, TMPQCompactJournal * pJournal, TMPQJournalMove * pMove)
+{
+    TMPQJournalRegion * pRegion;
+    TMPQFile * hf;
+    DWORD dwOldKey;
+    DWORD dwNewKey;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // We need to know the file name in order to know the key
+    if(pFileEntry->szFileName == NULL || IsPseudoFileName(pFileEntry->szFileName, NULL))
+        return ERROR_UNKNOWN_FILE_NAMES;
+    dwOldKey = DecryptFileKey(pFileEntry->szFileName, pFileEntry->ByteOffset, pFileEntry->dwFileSize, pFileEntry->dwFlags);
+    dwNewKey = DecryptFileKey(pFileEntry->szFileName, pMove->NewOffset, pFileEntry->dwFileSize, pFileEntry->dwFlags);
+
+    // Load the patch info and the sector offsets
+    if((hf = CreateFileHandle(ha, pFileEntry)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    hf->dwFileKey = dwOldKey;
+    if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
+        dwErrCode = AllocatePatchInfo(hf, true);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateSectorBuffer(hf);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateSectorOffsets(hf, true);
+
+    // Make sure there is enough regions for the sector offset table and all sectors
+    if(dwErrCode == ERROR_SUCCESS && pJournal->Header.dwRegionCount + hf->dwSectorCount + 1 > pJournal->dwMaxRegions)
+    {
+        DWORD dwMaxRegions = STORMLIB_MAX(pJournal->dwMaxRegions * 2, pJournal->Header.dwRegionCount + hf->dwSectorCount + 1);
+
+        pRegion = STORM_REALLOC(TMPQJournalRegion, pJournal->pRegions, dwMaxRegions);
+        if(pRegion != NULL)
+        {
+            pJournal->pRegions = pRegion;
+            pJournal->dwMaxRegions = dwMaxRegions;
+        }
+        else
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // The sector offset table is encrypted with the key - 1
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        pMove->dwFirstRegion = pJournal->Header.dwRegionCount;
+        if(hf->SectorOffsets != NULL)
+        {
+            pRegion = pJournal->pRegions + pJournal->Header.dwRegionCount++;
+            pRegion->dwOffset = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->dwLength : 0;
+            pRegion->dwLength = hf->SectorOffsets[0];
+            pRegion->dwOldKey = dwOldKey - 1;
+            pRegion->dwNewKey = dwNewKey - 1;
+        }
+
+        // Each sector is encrypted with the key + sector index
+        for(DWORD i = 0; i < hf->dwSectorCount; i++)
+        {
+            DWORD dwRawByteOffset = i * hf->dwSectorSize;
+            DWORD dwRawDataInSector = hf->dwSectorSize;
+            DWORD dwRegionOffset;
+
+            if(hf->SectorOffsets != NULL)
+            {
+                dwRawByteOffset = hf->SectorOffsets[i];
+                dwRawDataInSector = hf->SectorOffsets[i + 1] - hf->SectorOffsets[i];
+            }
+
+            // Sector offset tables placed after the file data are not supported
+            dwRegionOffset = (DWORD)(CalculateRawSectorOffset(hf, dwRawByteOffset) - hf->RawFilePos);
+            if(dwRegionOffset >= pFileEntry->dwCmpSize)
+            {
+                dwErrCode = ERROR_NOT_SUPPORTED;
+                break;
+            }
+
+            pRegion = pJournal->pRegions + pJournal->Header.dwRegionCount++;
+            pRegion->dwOffset = dwRegionOffset;
+            pRegion->dwLength = STORMLIB_MIN(dwRawDataInSector, pFileEntry->dwCmpSize - dwRegionOffset);
+            pRegion->dwOldKey = dwOldKey + i;
+            pRegion->dwNewKey = dwNewKey + i;
+        }
+        pMove->dwRegionCount = pJournal->Header.dwRegionCount - pMove->dwFirstRegion;
+    }
+
+    FreeFileHandle(hf);
+    return dwErrCode;
+}
+
+// Calculates the new positions of all files. Returns ERROR_NOT_SUPPORTED
+// if the archive can't be compacted in place
+static DWORD PlanCompactInPlace(TMPQArchive * ha, TMPQCompactJournal * pJournal)
+{
+    TMPQOffsetOrder * pOrder;
+    TMPQHeader * pHeader = ha->pHeader;
+    TFileEntry * pFileEntry;
+    ULONGLONG DataEnd = pHeader->dwHeaderSize;
+    ULONGLONG NewOffset = pHeader->dwHeaderSize;
+    ULONGLONG FileEnd;
+    LPDWORD pSharedWith;
+    ULONGLONG StreamSize = 0;
+    DWORD dwOrderCount = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // The journal covers the block table as it is saved in the archive,
+    // because that's what the file table is built from when the archive is open again
+    FileStream_GetSize(ha->pStream, &StreamSize);
+    pJournal->Header.dwSignature = ID_COMPACT_JOURNAL;
+    pJournal->Header.dwBlockTableSize = STORMLIB_MIN(pHeader->dwBlockTableSize, ha->dwFileTableSize);
+    pJournal->Header.MpqPos = ha->MpqPos;
+
+    // Allocate the arrays
+    pJournal->pEntries = STORM_ALLOC(TMPQJournalEntry, ha->dwFileTableSize + 1);
+    pJournal->pMoves = STORM_ALLOC(TMPQJournalMove, ha->dwFileTableSize + 1);
+    pOrder = STORM_ALLOC(TMPQOffsetOrder, ha->dwFileTableSize + 1);
+    pSharedWith = FindSharedFileData(ha);
+    if(pJournal->pEntries == NULL || pJournal->pMoves == NULL || pOrder == NULL || pSharedWith == NULL)
+        dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+
+    // Sort the existing files by their position. Files that don't exist keep their position
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < ha->dwFileTableSize; i++)
+        {
+            pFileEntry = ha->pFileTable + i;
+            pJournal->pEntries[i].OldOffset = pJournal->pEntries[i].NewOffset = pFileEntry->ByteOffset;
+            pJournal->pEntries[i].dwCmpSize = pFileEntry->dwCmpSize;
+            pJournal->pEntries[i].dwFlags = pFileEntry->dwFlags & MPQ_FILE_EXISTS;
+
+            if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+            {
+                // Files that are not in the saved block table can't be found by the journal
+                if(i >= pJournal->Header.dwBlockTableSize)
                 {
-                    dwErrCode = AllocateSectorChecksums(hf, false);
-                    if(dwErrCode != ERROR_SUCCESS)
-                        break;
+                    dwErrCode = ERROR_NOT_SUPPORTED;
+                    break;
                 }
 
-                // Copy all file sectors
-                dwErrCode = CopyMpqFileSectors(ha, hf, pNewStream, MpqFilePos);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
+                pOrder[dwOrderCount].ByteOffset = pFileEntry->ByteOffset;
+                pOrder[dwOrderCount].pFileEntry = pFileEntry;
+                pOrder[dwOrderCount].dwIndex = i;
+                dwOrderCount++;
+            }
+        }
+        SortByByteOffset(pOrder, dwOrderCount);
+    }
+
+    // Move each file right after the previous one
+    for(DWORD i = 0; dwErrCode == ERROR_SUCCESS && i < dwOrderCount; i++)
+    {
+        DWORD dwFileIndex = pOrder[i].dwIndex;
+        TMPQJournalMove * pMove;
 
-                // Free buffers. This also sets "hf" to NULL.
-                FreeFileHandle(hf);
+        // Files sharing data with a previous file go to the same position
+        pFileEntry = ha->pFileTable + dwFileIndex;
+        if(pSharedWith[dwFileIndex] != dwFileIndex)
+        {
+            pJournal->pEntries[dwFileIndex].NewOffset = pJournal->pEntries[pSharedWith[dwFileIndex]].NewOffset;
+            continue;
+        }
+
+        // Files without data only get the position
+        pJournal->pEntries[dwFileIndex].NewOffset = NewOffset;
+        if(pFileEntry->dwCmpSize == 0)
+            continue;
+
+        // Files whose data overlap can't be moved
+        FileEnd = GetFileDataEnd(ha, pFileEntry);
+        if(pFileEntry->ByteOffset < DataEnd || FileEnd > StreamSize - ha->MpqPos)
+        {
+            dwErrCode = ERROR_NOT_SUPPORTED;
+            break;
+        }
+        DataEnd = FileEnd;
+
+        // Only remember files that really move
+        if(NewOffset != pFileEntry->ByteOffset)
+        {
+            pMove = pJournal->pMoves + pJournal->Header.dwMoveCount++;
+            pMove->OldOffset = pFileEntry->ByteOffset;
+            pMove->NewOffset = NewOffset;
+            pMove->Length = FileEnd - pFileEntry->ByteOffset;
+            pMove->dwFirstRegion = pMove->dwRegionCount = 0;
+
+            // Files whose key depends on the position must be re-encrypted.
+            // Their raw data MD5s are calculated again after the move
+            if((pFileEntry->dwFlags & (MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2)) == (MPQ_FILE_ENCRYPTED | MPQ_FILE_KEY_V2))
+            {
+                pMove->Length = pFileEntry->dwCmpSize;
+                dwErrCode = AddRekeyRegions(ha, pFileEntry, pJournal, pMove);
             }
+        }
+        NewOffset += FileEnd - pFileEntry->ByteOffset;
+    }
 
-            // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
-            pFileEntry->ByteOffset = MpqFilePos;
+    // All MPQ tables must be beyond the file data, because they stay there until we are done
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if((pHeader->HashTableSize64    && MAKE_OFFSET64(pHeader->wHashTablePosHi, pHeader->dwHashTablePos) < DataEnd) ||
+           (pHeader->BlockTableSize64   && MAKE_OFFSET64(pHeader->wBlockTablePosHi, pHeader->dwBlockTablePos) < DataEnd) ||
+           (pHeader->HiBlockTableSize64 && pHeader->HiBlockTablePos64 < DataEnd) ||
+           (pHeader->HetTableSize64     && pHeader->HetTablePos64 < DataEnd) ||
+           (pHeader->BetTableSize64     && pHeader->BetTablePos64 < DataEnd))
+            dwErrCode = ERROR_NOT_SUPPORTED;
+        pJournal->Header.CompactedEnd = NewOffset;
+    }
+
+    if(pSharedWith != NULL)
+        STORM_FREE(pSharedWith);
+    if(pOrder != NULL)
+        STORM_FREE(pOrder);
+    return dwErrCode;
+}
+
+static DWORD CreateCompactJournal(TMPQArchive * ha, TMPQCompactJournal * pJournal)
+{
+    ULONGLONG ByteOffset = 0;
+    TCHAR szJournalFile[MAX_PATH+1];
+
+    // Create the journal file
+    GetJournalFileName(ha, szJournalFile, _countof(szJournalFile));
+    pJournal->pStream = FileStream_CreateFile(szJournalFile, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(pJournal->pStream == NULL)
+        return GetLastError();
+
+    // Write all parts of the journal, one after another
+    if(!FileStream_Write(pJournal->pStream, &ByteOffset, &pJournal->Header, sizeof(TMPQJournalHeader)) ||
+       !FileStream_Write(pJournal->pStream, NULL, &pJournal->Progress, sizeof(TMPQJournalProgress)) ||
+       !FileStream_Write(pJournal->pStream, NULL, pJournal->pEntries, pJournal->Header.dwBlockTableSize * sizeof(TMPQJournalEntry)) ||
+       !FileStream_Write(pJournal->pStream, NULL, pJournal->pMoves, pJournal->Header.dwMoveCount * sizeof(TMPQJournalMove)) ||
+       !FileStream_Write(pJournal->pStream, NULL, pJournal->pRegions, pJournal->Header.dwRegionCount * sizeof(TMPQJournalRegion)))
+    {
+        return GetLastError();
+    }
+
+    // The journal must be complete on the disk before the first move
+    if(!FileStream_Flush(pJournal->pStream))
+        return GetLastError();
+    return ERROR_SUCCESS;
+}
+
+static DWORD LoadCompactJournal(TMPQArchive * ha, TMPQCompactJournal * pJournal)
+{
+    TMPQJournalHeader * pHeader = &pJournal->Header;
+    TMPQJournalEntry * pEntry;
+    TFileEntry * pFileEntry;
+
+    // Load and check the header. The journal is read from its beginning, one part after another
+    if(!FileStream_Read(pJournal->pStream, NULL, pHeader, sizeof(TMPQJournalHeader)))
+        return ERROR_FILE_CORRUPT;
+    if(pHeader->dwSignature != ID_COMPACT_JOURNAL || pHeader->MpqPos != ha->MpqPos)
+        return ERROR_FILE_CORRUPT;
+    if(pHeader->dwBlockTableSize != ha->pHeader->dwBlockTableSize || pHeader->dwBlockTableSize > ha->dwFileTableSize)
+        return ERROR_FILE_CORRUPT;
+    if(pHeader->dwMoveCount > pHeader->dwBlockTableSize)
+        return ERROR_FILE_CORRUPT;
+
+    // Allocate the arrays
+    pJournal->pEntries = STORM_ALLOC(TMPQJournalEntry, pHeader->dwBlockTableSize + 1);
+    pJournal->pMoves = STORM_ALLOC(TMPQJournalMove, pHeader->dwMoveCount + 1);
+    pJournal->pRegions = STORM_ALLOC(TMPQJournalRegion, pHeader->dwRegionCount + 1);
+    if(pJournal->pEntries == NULL || pJournal->pMoves == NULL || pJournal->pRegions == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Load the rest of the journal
+    if(!FileStream_Read(pJournal->pStream, NULL, &pJournal->Progress, sizeof(TMPQJournalProgress)) ||
+       !FileStream_Read(pJournal->pStream, NULL, pJournal->pEntries, pHeader->dwBlockTableSize * sizeof(TMPQJournalEntry)) ||
+       !FileStream_Read(pJournal->pStream, NULL, pJournal->pMoves, pHeader->dwMoveCount * sizeof(TMPQJournalMove)) ||
+       !FileStream_Read(pJournal->pStream, NULL, pJournal->pRegions, pHeader->dwRegionCount * sizeof(TMPQJournalRegion)))
+    {
+        return ERROR_FILE_CORRUPT;
+    }
+
+    // Verify the progress
+    if(pJournal->Progress.dwMoveIndex > pHeader->dwMoveCount)
+        return ERROR_FILE_CORRUPT;
+    if(pJournal->Progress.dwMoveIndex < pHeader->dwMoveCount && pJournal->Progress.BytesDone > pJournal->pMoves[pJournal->Progress.dwMoveIndex].Length)
+        return ERROR_FILE_CORRUPT;
+
+    // Each file must be the one the journal was made for. Once all data have been moved,
+    // the tables may have already been saved, so the files can be at their new positions
+    for(DWORD i = 0; i < pHeader->dwBlockTableSize; i++)
+    {
+        pEntry = pJournal->pEntries + i;
+        pFileEntry = ha->pFileTable + i;
+
+        if(pEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) == 0 || pFileEntry->dwCmpSize != pEntry->dwCmpSize)
+                return ERROR_FILE_CORRUPT;
+            if(pFileEntry->ByteOffset != pEntry->OldOffset && (pFileEntry->ByteOffset != pEntry->NewOffset || pJournal->Progress.dwMoveIndex < pHeader->dwMoveCount))
+                return ERROR_FILE_CORRUPT;
         }
     }
+    return ERROR_SUCCESS;
+}
 
-    // Cleanup and exit
-    if(hf != NULL)
-        FreeFileHandle(hf);
+// Determines the size of the next piece of the move, up to cbMaxSize bytes.
+// Encrypted regions can't be split, so the piece must end at a region boundary
+static DWORD GetMoveChunkSize(TMPQCompactJournal * pJournal, TMPQJournalMove * pMove, ULONGLONG BytesDone, DWORD cbMaxSize)
+{
+    TMPQJournalRegion * pRegion = pJournal->pRegions + pMove->dwFirstRegion;
+    ULONGLONG ChunkEnd = STORMLIB_MIN(BytesDone + cbMaxSize, pMove->Length);
+
+    for(DWORD i = 0; i < pMove->dwRegionCount && pRegion->dwOffset < ChunkEnd; i++, pRegion++)
+    {
+        ULONGLONG RegionEnd = (ULONGLONG)pRegion->dwOffset + pRegion->dwLength;
+
+        if(RegionEnd > ChunkEnd)
+        {
+            ChunkEnd = (pRegion->dwOffset > BytesDone) ? pRegion->dwOffset : RegionEnd;
+            break;
+        }
+    }
+    return (DWORD)(ChunkEnd - BytesDone);
+}
+
+// Re-encrypts all regions within the loaded batch of data at once
+static void RekeyMoveBatch(TMPQArchive * ha, TMPQCompactJournal * pJournal, TMPQJournalMove * pMove, LPBYTE pbBatch, ULONGLONG BatchStart, DWORD cbBatch)
+{
+    TMPQJournalRegion * pRegion = pJournal->pRegions + pMove->dwFirstRegion;
+    TMPQRekeyBatch Batch = {NULL, pbBatch, (DWORD)BatchStart, 0};
+
+    // Find the regions within the batch. They follow each other
+    for(DWORD i = 0; i < pMove->dwRegionCount; i++, pRegion++)
+    {
+        if(pRegion->dwOffset >= BatchStart && pRegion->dwOffset + pRegion->dwLength <= BatchStart + cbBatch)
+        {
+            Batch.pBlocks = (Batch.pBlocks != NULL) ? Batch.pBlocks : pRegion;
+            Batch.dwBlockCount++;
+        }
+    }
+
+    if(Batch.dwBlockCount != 0)
+        RekeyBatch(ha, &Batch);
+}
+
+// Makes sure that a write up to WriteEnd doesn't overwrite old data whose move isn't saved
+// in the journal. If it would, the progress is saved first. Saving the progress is expensive,
+// so it's only done when needed, i.e. once the moved data reach the not yet saved old data
+static DWORD SyncJournalProgress(TMPQArchive * ha, TMPQCompactJournal * pJournal, ULONGLONG WriteEnd, ULONGLONG * pSyncedPos)
+{
+    TMPQJournalProgress * pProgress = &pJournal->Progress;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    if(WriteEnd > *pSyncedPos)
+    {
+        if((dwErrCode = WriteJournalProgress(ha, pJournal)) == ERROR_SUCCESS)
+            *pSyncedPos = pJournal->pMoves[pProgress->dwMoveIndex].OldOffset + pProgress->BytesDone;
+    }
+    return dwErrCode;
+}
+
+// Performs all moves that have not been done yet
+static DWORD MoveFileData(TMPQArchive * ha, TMPQCompactJournal * pJournal)
+{
+    TMPQJournalProgress * pProgress = &pJournal->Progress;
+    TMPQJournalMove * pMove;
+    ULONGLONG ChunkDataPos = GetJournalDataOffset(pJournal, 4);
+    ULONGLONG SyncedPos = 0;                // Old position of the first byte not known to be moved by the journal on the disk
+    ULONGLONG BatchStart;
+    ULONGLONG BatchEnd;
+    ULONGLONG ByteOffset;
+    LPBYTE pbChunk;
+    DWORD dwChunkSize;
+    DWORD cbBatch;
+    DWORD cbMd5Size;
+    DWORD dwErrCode;
+
+    // Initialize the progress variables for compact callback
+    ha->CompactTotalBytes = ha->CompactBytesProcessed = 0;
+    for(DWORD i = pProgress->dwMoveIndex; i < pJournal->Header.dwMoveCount; i++)
+        ha->CompactTotalBytes += pJournal->pMoves[i].Length;
+
+    // Finish the piece that was being written when we got interrupted
+    if(pProgress->dwChunkSize != 0)
+    {
+        if(pProgress->dwMoveIndex >= pJournal->Header.dwMoveCount || pProgress->dwChunkSize > pJournal->cbChunk)
+            return ERROR_FILE_CORRUPT;
+        pMove = pJournal->pMoves + pProgress->dwMoveIndex;
+
+        ByteOffset = ChunkDataPos;
+        if(!FileStream_Read(pJournal->pStream, &ByteOffset, pJournal->pbChunk, pProgress->dwChunkSize))
+            return GetLastError();
+        ByteOffset = ha->MpqPos + pMove->NewOffset + pProgress->BytesDone;
+        if(!FileStream_Write(ha->pStream, &ByteOffset, pJournal->pbChunk, pProgress->dwChunkSize))
+            return GetLastError();
+
+        pProgress->BytesDone += pProgress->dwChunkSize;
+        pProgress->dwChunkSize = 0;
+        if((dwErrCode = WriteJournalProgress(ha, pJournal)) != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // The journal on the disk has the current progress
+    if(pProgress->dwMoveIndex < pJournal->Header.dwMoveCount)
+        SyncedPos = pJournal->pMoves[pProgress->dwMoveIndex].OldOffset + pProgress->BytesDone;
+
+    // Perform the remaining moves
+    while(pProgress->dwMoveIndex < pJournal->Header.dwMoveCount)
+    {
+        pMove = pJournal->pMoves + pProgress->dwMoveIndex;
+        BatchStart = BatchEnd = pProgress->BytesDone;
+
+        while(pProgress->BytesDone < pMove->Length)
+        {
+            // Load the next batch and re-encrypt it, if needed. Files that need re-encrypting
+            // are loaded in big batches, so the threads re-encrypt many regions at once
+            if(pProgress->BytesDone == BatchEnd)
+            {
+                cbBatch = (pMove->dwRegionCount != 0) ? pJournal->cbChunk : COMPACT_CHUNK_SIZE;
+                BatchStart = pProgress->BytesDone;
+                BatchEnd = BatchStart + GetMoveChunkSize(pJournal, pMove, BatchStart, cbBatch);
+
+                ByteOffset = ha->MpqPos + pMove->OldOffset + BatchStart;
+                if(!FileStream_Read(ha->pStream, &ByteOffset, pJournal->pbChunk, (DWORD)(BatchEnd - BatchStart)))
+                    return GetLastError();
+                if(pMove->dwRegionCount != 0)
+                    RekeyMoveBatch(ha, pJournal, pMove, pJournal->pbChunk, BatchStart, (DWORD)(BatchEnd - BatchStart));
+            }
+
+            // The batch is written in pieces, so that a piece fits into the journal
+            dwChunkSize = GetMoveChunkSize(pJournal, pMove, pProgress->BytesDone, COMPACT_CHUNK_SIZE);
+            dwChunkSize = (DWORD)STORMLIB_MIN(dwChunkSize, BatchEnd - pProgress->BytesDone);
+            pbChunk = pJournal->pbChunk + (size_t)(pProgress->BytesDone - BatchStart);
+
+            // Don't overwrite the old data that the journal doesn't know to be moved
+            dwErrCode = SyncJournalProgress(ha, pJournal, pMove->NewOffset + pProgress->BytesDone + dwChunkSize, &SyncedPos);
+            if(dwErrCode != ERROR_SUCCESS)
+                return dwErrCode;
+
+            // If the piece overlaps its own old position, an interrupted write would destroy
+            // the old data. Then we need to keep the piece in the journal until it's written
+            if(dwChunkSize > pMove->OldOffset - pMove->NewOffset)
+            {
+                ByteOffset = ChunkDataPos;
+                if(!FileStream_Write(pJournal->pStream, &ByteOffset, pbChunk, dwChunkSize))
+                    return GetLastError();
+                pProgress->dwChunkSize = dwChunkSize;
+                if((dwErrCode = WriteJournalProgress(ha, pJournal)) != ERROR_SUCCESS)
+                    return dwErrCode;
+            }
+
+            // Write the piece to the new position
+            ByteOffset = ha->MpqPos + pMove->NewOffset + pProgress->BytesDone;
+            if(!FileStream_Write(ha->pStream, &ByteOffset, pbChunk, dwChunkSize))
+                return GetLastError();
+
+            // Remember the progress. It's saved when it's needed
+            pProgress->BytesDone += dwChunkSize;
+            pProgress->dwChunkSize = 0;
+
+            // Update compact progress
+            if(ha->pfnCompactCB != NULL)
+            {
+                ha->CompactBytesProcessed += dwChunkSize;
+                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+            }
+        }
+
+        // Re-encrypted files have different raw data MD5s
+        if(pMove->dwRegionCount != 0 && ha->pHeader->dwRawChunkSize != 0)
+        {
+            cbMd5Size = (DWORD)(((pMove->Length - 1) / ha->pHeader->dwRawChunkSize) + 1) * MD5_DIGEST_SIZE;
+            dwErrCode = SyncJournalProgress(ha, pJournal, pMove->NewOffset + pMove->Length + cbMd5Size, &SyncedPos);
+            if(dwErrCode == ERROR_SUCCESS)
+                dwErrCode = WriteMpqDataMD5(ha->pStream, ha->MpqPos + pMove->NewOffset, (DWORD)pMove->Length, ha->pHeader->dwRawChunkSize);
+            if(dwErrCode != ERROR_SUCCESS)
+                return dwErrCode;
+        }
+
+        // Go to the next move
+        pProgress->dwMoveIndex++;
+        pProgress->BytesDone = 0;
+    }
+
+    // The journal must say that all data have been moved before the tables change
+    return WriteJournalProgress(ha, pJournal);
+}
+
+// Saves the MPQ tables at the given position, relative to the MPQ header
+static DWORD SaveTablesAt(TMPQArchive * ha, ULONGLONG TablePos)
+{
+    DWORD dwErrCode;
+
+    ha->dwFlags |= (MPQ_FLAG_CHANGED | MPQ_FLAG_SAVING_TABLES | MPQ_FLAG_FLUSH_TABLES);
+    ha->FreeSpacePosAll = TablePos;
+    dwErrCode = SaveMPQTables(ha);
+    ha->dwFlags &= ~(MPQ_FLAG_SAVING_TABLES | MPQ_FLAG_FLUSH_TABLES);
+    InvalidateFreeMpqSpace(ha);
+    return dwErrCode;
+}
+
+// Gives the files their new positions and saves the tables. The tables are first saved
+// beyond everything else in the file, and only then right after the file data.
+// This way, the header always points to complete tables.
+static DWORD FinishCompactInPlace(TMPQArchive * ha, TMPQCompactJournal * pJournal)
+{
+    ULONGLONG CompactedEnd = pJournal->Header.CompactedEnd;
+    ULONGLONG TablePos;
+    ULONGLONG FileSize = 0;
+    TCHAR szJournalFile[MAX_PATH+1];
+    DWORD dwErrCode;
+
+    // Update the file positions. This can be done repeatedly
+    for(DWORD i = 0; i < pJournal->Header.dwBlockTableSize; i++)
+    {
+        if(pJournal->pEntries[i].dwFlags & MPQ_FILE_EXISTS)
+            ha->pFileTable[i].ByteOffset = pJournal->pEntries[i].NewOffset;
+    }
+
+    // All files have moved, so the cached sectors are useless
+    InvalidateSectorCache(ha);
+
+    // Save the tables at the end of the file
+    FileStream_GetSize(ha->pStream, &FileSize);
+    TablePos = FileSize - ha->MpqPos;
+    if((dwErrCode = SaveTablesAt(ha, TablePos)) != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // If the final tables would overlap these, save them once more, even further
+    FileStream_GetSize(ha->pStream, &FileSize);
+    if(CompactedEnd + (FileSize - ha->MpqPos - TablePos) > TablePos)
+    {
+        if((dwErrCode = SaveTablesAt(ha, FileSize - ha->MpqPos)) != ERROR_SUCCESS)
+            return dwErrCode;
+    }
+
+    // Save the tables after the file data. This also cuts the file
+    if((dwErrCode = SaveTablesAt(ha, CompactedEnd)) != ERROR_SUCCESS)
+        return dwErrCode;
+    FileStream_GetSize(ha->pStream, &ha->FileSize);
+
+    // The archive is consistent now, we don't need the journal anymore
+    GetJournalFileName(ha, szJournalFile, _countof(szJournalFile));
+    FileStream_Close(pJournal->pStream);
+    pJournal->pStream = NULL;
+    _tremove(szJournalFile);
+
+    // Final user notification
+    if(ha->pfnCompactCB != NULL)
+        ha->pfnCompactCB(ha->pvCompactUserData, CCB_CLOSING_ARCHIVE, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+    return ERROR_SUCCESS;
+}
+
+static DWORD CompactArchiveInPlace(TMPQArchive * ha)
+{
+    TMPQCompactJournal Journal;
+    DWORD dwStreamFlags = 0;
+    DWORD dwErrCode;
+
+    // Only plain local files can be modified in place
+    FileStream_GetFlags(ha->pStream, &dwStreamFlags);
+    if((dwStreamFlags & STREAM_PROVIDERS_MASK) != (STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE))
+        return ERROR_NOT_SUPPORTED;
+
+    // Plan the moves and save them to the journal
+    memset(&Journal, 0, sizeof(TMPQCompactJournal));
+    dwErrCode = PlanCompactInPlace(ha, &Journal);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateJournalChunk(&Journal);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = CreateCompactJournal(ha, &Journal);
+
+    // Move the data and save the tables
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = MoveFileData(ha, &Journal);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = FinishCompactInPlace(ha, &Journal);
+
+    // If we haven't started, there is no need for the journal.
+    // Otherwise it stays, so the compaction can be finished later
+    if(dwErrCode != ERROR_SUCCESS && Journal.pStream != NULL && Journal.Progress.dwMoveIndex == 0 && Journal.Progress.BytesDone == 0)
+    {
+        TCHAR szJournalFile[MAX_PATH+1];
+
+        GetJournalFileName(ha, szJournalFile, _countof(szJournalFile));
+        FileStream_Close(Journal.pStream);
+        Journal.pStream = NULL;
+        _tremove(szJournalFile);
+    }
+
+    FreeCompactJournal(&Journal);
+    return dwErrCode;
+}
+
+// A journal that doesn't match the archive has been left behind by another archive
+// of the same name (e.g. when the archive was deleted and created again).
+// It is renamed, so that it doesn't get in the way of opening the archive again
+static void IgnoreStaleJournal(TMPQArchive * ha, TMPQCompactJournal * pJournal, const TCHAR * szJournalFile)
+{
+    TCHAR szStaleFile[MAX_PATH+1];
+
+    DumpStaleJournal(szJournalFile);
+    FreeCompactJournal(pJournal);
+
+    // Read-only archives leave the journal alone
+    if((ha->dwFlags & MPQ_FLAG_READ_ONLY) == 0)
+    {
+        StringCopy(szStaleFile, _countof(szStaleFile), szJournalFile);
+        StringCat(szStaleFile, _countof(szStaleFile), COMPACT_STALE_EXT);
+        _tremove(szStaleFile);
+        _trename(szJournalFile, szStaleFile);
+    }
+}
+
+// Called when the archive is being open. If there is a journal
+// of interrupted compaction, the compaction is finished.
+DWORD ResumeCompactArchive(TMPQArchive * ha)
+{
+    TMPQCompactJournal Journal;
+    TCHAR szJournalFile[MAX_PATH+1];
+    DWORD dwErrCode;
+
+    // Is there a journal?
+    memset(&Journal, 0, sizeof(TMPQCompactJournal));
+    GetJournalFileName(ha, szJournalFile, _countof(szJournalFile));
+    Journal.pStream = FileStream_OpenFile(szJournalFile, STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(Journal.pStream == NULL)
+        return ERROR_SUCCESS;
+
+    // A journal that doesn't belong to this archive is ignored
+    dwErrCode = LoadCompactJournal(ha, &Journal);
+    if(dwErrCode == ERROR_FILE_CORRUPT)
+    {
+        IgnoreStaleJournal(ha, &Journal, szJournalFile);
+        return ERROR_SUCCESS;
+    }
+
+    // The file table doesn't match the data until the compaction is finished,
+    // and finishing it needs write access
+    if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_READ_ONLY))
+        dwErrCode = ERROR_COMPACT_INCOMPLETE;
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = AllocateJournalChunk(&Journal);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = MoveFileData(ha, &Journal);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = FinishCompactInPlace(ha, &Journal);
+
+    FreeCompactJournal(&Journal);
     return dwErrCode;
 }
 
@@ -621,9 +1740,12 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         ha->CompactBytesProcessed += ha->pHeader->dwHeaderSize;
     }
 
-    // Now copy all files
+    // Now copy all files. This moves the file data, so the free space position must be found again
     if(dwErrCode == ERROR_SUCCESS)
+    {
         dwErrCode = CopyMpqFiles(ha, pFileKeys, pTempStream);
+        InvalidateFreeMpqSpace(ha);
+    }
 
     // If succeeded, switch the streams
     if(dwErrCode == ERROR_SUCCESS)
@@ -633,6 +1755,9 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
             pTempStream = NULL;
         else
             dwErrCode = ERROR_CAN_NOT_COMPLETE;
+
+        // All files have moved, so the cached sectors are useless
+        InvalidateSectorCache(ha);
     }
 
     // Final user notification
@@ -652,3 +1777,43 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         SetLastError(dwErrCode);
     return (dwErrCode == ERROR_SUCCESS);
 }
+
+bool WINAPI SFileCompactArchiveEx(HANDLE hMpq, const TCHAR * szListFile, DWORD dwCompactFlags)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Without SFILE_COMPACT_IN_PLACE, the archive is copied to a temporary file
+    if(!(dwCompactFlags & SFILE_COMPACT_IN_PLACE))
+        return SFileCompactArchive(hMpq, szListFile, false);
+
+    // Test the valid parameters
+    if(!IsValidMpqHandle(hMpq))
+        dwErrCode = ERROR_INVALID_HANDLE;
+    if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_READ_ONLY))
+        dwErrCode = ERROR_ACCESS_DENIED;
+
+    // If the MPQ is changed at this moment, we have to flush the archive
+    if(dwErrCode == ERROR_SUCCESS && (ha->dwFlags & MPQ_FLAG_CHANGED))
+    {
+        SFileFlushArchive(hMpq);
+    }
+
+    // Files with MPQ_FILE_KEY_V2 are re-encrypted, so we need their names
+    if(dwErrCode == ERROR_SUCCESS && szListFile != NULL)
+    {
+        SFileAddListFile(hMpq, szListFile);
+    }
+
+    // If the archive can't be compacted in place, we copy it
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = CompactArchiveInPlace(ha);
+        if(dwErrCode == ERROR_NOT_SUPPORTED)
+            return SFileCompactArchive(hMpq, szListFile, false);
+    }
+
+    if(dwErrCode != ERROR_SUCCESS)
+        SetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
@@ -12,10 +12,42 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
-bool WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR * szExtracted, DWORD dwSearchScope)
+#ifndef STORMLIB_WIIU
+#include <mutex>
+#endif
+
+//-----------------------------------------------------------------------------
+// Local defines
+
+#define EXTRACT_BUFFER_SIZE     0x00100000  // Maximum size of the transfer buffer for SFileExtractFiles
+
+//-----------------------------------------------------------------------------
+// Local structures
+
+struct TMPQExtractBatch
+{
+#ifndef STORMLIB_WIIU
+    std::mutex ProgressLock;                // Serializes calls to the extract callback
+#endif
+    TMPQArchive * ha;
+    PSFILE_EXTRACT_FILE_ENTRY pEntries;
+    TMPQOffsetOrder * pOrder;
+    DWORD dwEntryCount;
+    DWORD dwFilesDone;
+};
+
+//-----------------------------------------------------------------------------
+// Local functions
+
+// Copies one file from the archive to a local file. The transfer buffer
+// is not larger than the file, and is not allocated at all for empty files
+static DWORD ExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR * szExtracted, DWORD dwSearchScope, DWORD cbMaxBuffer)
 {
     TFileStream * pLocalFile = NULL;
+    ULONGLONG ByteOffset = 0;
     HANDLE hMpqFile = NULL;
+    LPBYTE pbBuffer = NULL;
+    DWORD cbBuffer = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
     // Open the MPQ file
@@ -25,6 +57,20 @@ bool WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR
             dwErrCode = GetLastError();
     }
 
+    // Allocate the transfer buffer
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        if((cbBuffer = SFileGetFileSize(hMpqFile, NULL)) == SFILE_INVALID_SIZE)
+            dwErrCode = GetLastError();
+        cbBuffer = STORMLIB_MIN(cbBuffer, cbMaxBuffer);
+
+        if(dwErrCode == ERROR_SUCCESS && cbBuffer != 0)
+        {
+            if((pbBuffer = STORM_ALLOC(BYTE, cbBuffer)) == NULL)
+                dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
     // Create the local file
     if(dwErrCode == ERROR_SUCCESS)
     {
@@ -34,14 +80,13 @@ bool WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR
     }
 
     // Copy the file's content
-    while(dwErrCode == ERROR_SUCCESS)
+    while(dwErrCode == ERROR_SUCCESS && cbBuffer != 0)
     {
-        char  szBuffer[0x1000];
         DWORD dwTransferred = 0;
 
         // dwTransferred is only set to nonzero if something has been read.
         // dwErrCode can be ERROR_SUCCESS or ERROR_HANDLE_EOF
-        if(!SFileReadFile(hMpqFile, szBuffer, sizeof(szBuffer), &dwTransferred, NULL))
+        if(!SFileReadFile(hMpqFile, pbBuffer, cbBuffer, &dwTransferred, NULL))
             dwErrCode = GetLastError();
         if(dwErrCode == ERROR_HANDLE_EOF)
             dwErrCode = ERROR_SUCCESS;
@@ -49,15 +94,140 @@ bool WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR
             break;
 
         // If something has been actually read, write it
-        if(!FileStream_Write(pLocalFile, NULL, szBuffer, dwTransferred))
+        if(!FileStream_Write(pLocalFile, &ByteOffset, pbBuffer, dwTransferred))
             dwErrCode = GetLastError();
+        ByteOffset += dwTransferred;
     }
 
     // Close the files
+    if(pbBuffer != NULL)
+        STORM_FREE(pbBuffer);
     if(hMpqFile != NULL)
         SFileCloseFile(hMpqFile);
     if(pLocalFile != NULL)
         FileStream_Close(pLocalFile);
+    return dwErrCode;
+}
+
+// Extracts one file of the batch. Called from multiple threads at once
+static DWORD ExtractBatchFile(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQExtractBatch * pBatch = (TMPQExtractBatch *)pvContext;
+    PSFILE_EXTRACT_FILE_ENTRY pEntry = pBatch->pEntries + pBatch->pOrder[dwItemIndex].dwIndex;
+    TMPQArchive * ha = pBatch->ha;
+
+    // Extract the file
+    if(pEntry->szArchivedName != NULL && pEntry->szFileName != NULL)
+        pEntry->dwErrCode = ExtractFile((HANDLE)ha, pEntry->szArchivedName, pEntry->szFileName, pEntry->dwSearchScope, EXTRACT_BUFFER_SIZE);
+    else
+        pEntry->dwErrCode = ERROR_INVALID_PARAMETER;
+
+    // Report the progress. Only one thread at a time calls the callback
+    if(ha->pfnExtractCB != NULL)
+    {
+#ifndef STORMLIB_WIIU
+        std::lock_guard<std::mutex> Lock(pBatch->ProgressLock);
+#endif
+        pBatch->dwFilesDone++;
+        ha->pfnExtractCB(ha->pvExtractUserData, pEntry->szArchivedName, pEntry->dwErrCode, pBatch->dwFilesDone, pBatch->dwEntryCount);
+    }
+
+    // Failure of one file doesn't stop the others
+    return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Public functions
+
+bool WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR * szExtracted, DWORD dwSearchScope)
+{
+    DWORD dwErrCode;
+
+    dwErrCode = ExtractFile(hMpq, szToExtract, szExtracted, dwSearchScope, EXTRACT_BUFFER_SIZE);
+    if(dwErrCode != ERROR_SUCCESS)
+        SetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
+bool WINAPI SFileSetExtractCallback(HANDLE hMpq, SFILE_EXTRACT_CALLBACK pfnExtractCB, void * pvUserData)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    ha->pfnExtractCB = pfnExtractCB;
+    ha->pvExtractUserData = pvUserData;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// bool SFileExtractFiles(HANDLE hMpq, PSFILE_EXTRACT_FILE_ENTRY pFileEntries, DWORD dwEntryCount)
+//
+// Extracts multiple files to local files. The files are processed in the order
+// of their data in the archive, using the number of threads set by SFileSetThreadCount.
+// The result of each file is stored in its entry. If any file fails,
+// the function returns false and GetLastError() returns the first error.
+//
+
+bool WINAPI SFileExtractFiles(HANDLE hMpq, PSFILE_EXTRACT_FILE_ENTRY pFileEntries, DWORD dwEntryCount)
+{
+    TMPQExtractBatch Batch;
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Check parameters
+    if(ha == NULL || (pFileEntries == NULL && dwEntryCount != 0))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Allocate the extraction order
+    Batch.pOrder = STORM_ALLOC(TMPQOffsetOrder, dwEntryCount);
+    if(Batch.pOrder == NULL && dwEntryCount != 0)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    // Sort the files by the position of their data, so that the archive is read sequentially.
+    // Files that are not found go last; they will just fail.
+    for(DWORD i = 0; i < dwEntryCount; i++)
+    {
+        TFileEntry * pFileEntry = NULL;
+
+        if(pFileEntries[i].szArchivedName != NULL)
+            pFileEntry = GetFileEntryLocale(ha, pFileEntries[i].szArchivedName, g_lcFileLocale);
+        Batch.pOrder[i].ByteOffset = (pFileEntry != NULL) ? pFileEntry->ByteOffset : (ULONGLONG)-1;
+        Batch.pOrder[i].pFileEntry = pFileEntry;
+        Batch.pOrder[i].dwIndex = i;
+        pFileEntries[i].dwErrCode = ERROR_SUCCESS;
+    }
+    SortByByteOffset(Batch.pOrder, dwEntryCount);
+
+    // Extract all files
+    Batch.ha = ha;
+    Batch.pEntries = pFileEntries;
+    Batch.dwEntryCount = dwEntryCount;
+    Batch.dwFilesDone = 0;
+    ParallelForEach(ha, dwEntryCount, ExtractBatchFile, &Batch);
+
+    // Find the first error
+    for(DWORD i = 0; i < dwEntryCount; i++)
+    {
+        if(pFileEntries[i].dwErrCode != ERROR_SUCCESS)
+        {
+            dwErrCode = pFileEntries[i].dwErrCode;
+            break;
+        }
+    }
+
+    if(Batch.pOrder != NULL)
+        STORM_FREE(Batch.pOrder);
     if(dwErrCode != ERROR_SUCCESS)
         SetLastError(dwErrCode);
     return (dwErrCode == ERROR_SUCCESS);
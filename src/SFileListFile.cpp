@@ -37,6 +37,23 @@ struct TListFileCache
 //  char szListFile[listfile_length];   // Followed by the listfile (if any)
 };
 
+// One valid hash table entry, as stored in the name index
+struct TNameHashEntry
+{
+    DWORD dwName1;                      // The first name hash
+    DWORD dwName2;                      // The second name hash
+    DWORD dwBlockIndex;                 // Index to the file table
+};
+
+// Hash table entries sorted by name hashes. Built once per loaded listfile
+// so that every name from the listfile is looked up in O(log n)
+struct TNameHashIndex
+{
+    DWORD dwEntryCount;                 // Number of entries in the index
+
+//  TNameHashEntry Entries[dwEntryCount];  // Followed by the sorted entries
+};
+
 typedef bool (*LOAD_LISTFILE)(TListFileHandle * pHandle, void * pvBuffer, DWORD cbBuffer, LPDWORD pdwBytesRead);
 
 //-----------------------------------------------------------------------------
@@ -400,19 +417,99 @@ static LPBYTE CreateListFile(TMPQArchive * ha, DWORD * pcbListFile)
     return (LPBYTE)szListFile;
 }
 
+//-----------------------------------------------------------------------------
+// Local functions (name index)
+
+static int STORMLIB_CDECL CompareNameHashEntries(const void * p1, const void * p2)
+{
+    TNameHashEntry * pEntry1 = (TNameHashEntry *)p1;
+    TNameHashEntry * pEntry2 = (TNameHashEntry *)p2;
+
+    if(pEntry1->dwName1 != pEntry2->dwName1)
+        return (pEntry1->dwName1 < pEntry2->dwName1) ? -1 : +1;
+    if(pEntry1->dwName2 != pEntry2->dwName2)
+        return (pEntry1->dwName2 < pEntry2->dwName2) ? -1 : +1;
+    return 0;
+}
+
+// Creates the index of all hash table entries that point to a file entry.
+// We don't probe the hash table by the name, because protected MPQs
+// may store hash entries where the probing would never find them.
+// Returns NULL if the archive has no classic hash table or if there is not enough memory.
+static TNameHashIndex * CreateNameHashIndex(TMPQArchive * ha)
+{
+    TNameHashIndex * pNameIndex;
+    TNameHashEntry * pEntries;
+    TMPQHash * pHashEnd;
+    TMPQHash * pHash;
+    DWORD dwEntryCount = 0;
+
+    // HET table lookups are fast on their own
+    if(ha->pHetTable != NULL || ha->pHashTable == NULL)
+        return NULL;
+
+    // Some protectors set very high hash table size (0x00400000 items or more)
+    // in order to make this process very slow. We will ignore items
+    // in the hash table that would be beyond the end of the file.
+    // Example MPQ: MPQ_2022_v1_Sniper.scx
+    pHashEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
+    if(ha->dwFlags & MPQ_FLAG_HASH_TABLE_CUT)
+        pHashEnd = ha->pHashTable + (ha->dwRealHashTableSize / sizeof(TMPQHash));
+
+    // Count the entries that point to a file entry
+    for(pHash = ha->pHashTable; pHash < pHashEnd; pHash++)
+    {
+        if(MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
+            dwEntryCount++;
+    }
+
+    // Allocate the index
+    pNameIndex = (TNameHashIndex *)STORM_ALLOC(BYTE, sizeof(TNameHashIndex) + dwEntryCount * sizeof(TNameHashEntry));
+    if(pNameIndex != NULL)
+    {
+        pEntries = (TNameHashEntry *)(pNameIndex + 1);
+        pNameIndex->dwEntryCount = dwEntryCount;
+
+        // Copy the entries and sort them by the name hashes
+        for(pHash = ha->pHashTable; pHash < pHashEnd; pHash++)
+        {
+            if(MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
+            {
+                pEntries->dwName1 = pHash->dwName1;
+                pEntries->dwName2 = pHash->dwName2;
+                pEntries->dwBlockIndex = MPQ_BLOCK_INDEX(pHash);
+                pEntries++;
+            }
+        }
+        qsort(pNameIndex + 1, dwEntryCount, sizeof(TNameHashEntry), CompareNameHashEntries);
+    }
+
+    return pNameIndex;
+}
+
+static void FreeNameHashIndex(TNameHashIndex * pNameIndex)
+{
+    if(pNameIndex != NULL)
+        STORM_FREE(pNameIndex);
+}
+
 //-----------------------------------------------------------------------------
 // Local functions (listfile nodes)
 
 // Adds a name into the list of all names. For each locale in the MPQ,
 // one entry will be created
 // If the file name is already there, does nothing.
-static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szFileName)
+static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, TNameHashIndex * pNameIndex, const char * szFileName)
 {
+    TNameHashEntry * pEntries;
+    TNameHashEntry NameEntry;
     TFileEntry * pFileEntry;
     TMPQHash * pHashEnd;
     TMPQHash * pHash;
     DWORD dwName1;
     DWORD dwName2;
+    DWORD dwLower;
+    DWORD dwUpper;
 
     // If we have HET table, use that one
     if(ha->pHetTable != NULL)
@@ -435,6 +532,36 @@ static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szF
         dwName1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
         dwName2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
 
+        // If we have the name index, find the first entry with the same name pair
+        // and put the name to all entries with the same name pair
+        if(pNameIndex != NULL)
+        {
+            pEntries = (TNameHashEntry *)(pNameIndex + 1);
+            NameEntry.dwName1 = dwName1;
+            NameEntry.dwName2 = dwName2;
+            dwLower = 0;
+            dwUpper = pNameIndex->dwEntryCount;
+
+            while(dwLower < dwUpper)
+            {
+                DWORD dwMiddle = dwLower + (dwUpper - dwLower) / 2;
+
+                if(CompareNameHashEntries(pEntries + dwMiddle, &NameEntry) < 0)
+                    dwLower = dwMiddle + 1;
+                else
+                    dwUpper = dwMiddle;
+            }
+
+            for(; dwLower < pNameIndex->dwEntryCount; dwLower++)
+            {
+                if(CompareNameHashEntries(pEntries + dwLower, &NameEntry) != 0)
+                    break;
+                AllocateFileName(ha, ha->pFileTable + pEntries[dwLower].dwBlockIndex, szFileName);
+            }
+
+            return ERROR_SUCCESS;
+        }
+
         // Some protectors set very high hash table size (0x00400000 items or more)
         // in order to make this process very slow. We will ignore items
         // in the hash table that would be beyond the end of the file.
@@ -452,17 +579,6 @@ static DWORD SListFileCreateNodeForAllLocales(TMPQArchive * ha, const char * szF
             }
         }
 
-        // Go while we found something
-        //pFirstHash = pHash = GetFirstHashEntry(ha, szFileName);
-        //while(pHash != NULL)
-        //{
-        //    // Allocate file name for the file entry
-        //    AllocateFileName(ha, ha->pFileTable + MPQ_BLOCK_INDEX(pHash), szFileName);
-
-        //    // Now find the next language version of the file
-        //    pHash = GetNextHashEntry(ha, pFirstHash, pHash);
-        //}
-
         return ERROR_SUCCESS;
     }
 
@@ -530,6 +646,7 @@ DWORD SListFileSaveToMpq(TMPQArchive * ha)
 
 static DWORD SFileAddArbitraryListFile(
     TMPQArchive * ha,
+    TNameHashIndex * pNameIndex,
     HANDLE hMpq,
     const TCHAR * szListFile,
     DWORD dwMaxSize)
@@ -548,7 +665,7 @@ static DWORD SFileAddArbitraryListFile(
         {
             // Add the line to the MPQ
             if(nLength != 0)
-                SListFileCreateNodeForAllLocales(ha, szFileName);
+                SListFileCreateNodeForAllLocales(ha, pNameIndex, szFileName);
         }
 
         // Delete the cache
@@ -560,6 +677,7 @@ static DWORD SFileAddArbitraryListFile(
 
 static DWORD SFileAddArbitraryListFile(
     TMPQArchive * ha,
+    TNameHashIndex * pNameIndex,
     const char ** listFileEntries,
     DWORD dwEntryCount)
 {
@@ -571,7 +689,7 @@ static DWORD SFileAddArbitraryListFile(
             const char * listFileEntry = listFileEntries[dwListFileNum];
             if(listFileEntry != NULL)
             {
-                SListFileCreateNodeForAllLocales(ha, listFileEntry);
+                SListFileCreateNodeForAllLocales(ha, pNameIndex, listFileEntry);
             }
         }
     }
@@ -581,6 +699,7 @@ static DWORD SFileAddArbitraryListFile(
 
 static DWORD SFileAddInternalListFile(
     TMPQArchive * ha,
+    TNameHashIndex * pNameIndex,
     HANDLE hMpq)
 {
     TMPQHash * pFirstHash;
@@ -604,7 +723,7 @@ static DWORD SFileAddInternalListFile(
             SFileSetLocale(SFILE_MAKE_LCID(pHash->Locale, pHash->Platform));
 
             // Add that listfile
-            dwErrCode = SFileAddArbitraryListFile(ha, hMpq, NULL, dwMaxSize);
+            dwErrCode = SFileAddArbitraryListFile(ha, pNameIndex, hMpq, NULL, dwMaxSize);
 
             // Move to the next hash
             pHash = GetNextHashEntry(ha, pFirstHash, pHash);
@@ -616,7 +735,7 @@ static DWORD SFileAddInternalListFile(
     else
     {
         // Add the single listfile
-        dwErrCode = SFileAddArbitraryListFile(ha, hMpq, NULL, dwMaxSize);
+        dwErrCode = SFileAddArbitraryListFile(ha, pNameIndex, hMpq, NULL, dwMaxSize);
     }
 
     // Return the result of the operation
@@ -660,21 +779,26 @@ static bool DoListFileSearch(TListFileCache * pCache, SFILE_FIND_DATA * lpFindFi
 DWORD WINAPI SFileAddListFile(HANDLE hMpq, const TCHAR * szListFile)
 {
     TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TNameHashIndex * pNameIndex;
     DWORD dwErrCode = ERROR_SUCCESS;
 
     // Add the listfile for each MPQ in the patch chain
     while(ha != NULL)
     {
+        // Index the hash table for fast name lookups
+        pNameIndex = CreateNameHashIndex(ha);
+
         if(szListFile != NULL)
-            dwErrCode = SFileAddArbitraryListFile(ha, NULL, szListFile, MAX_LISTFILE_SIZE);
+            dwErrCode = SFileAddArbitraryListFile(ha, pNameIndex, NULL, szListFile, MAX_LISTFILE_SIZE);
         else
-            dwErrCode = SFileAddInternalListFile(ha, hMpq);
+            dwErrCode = SFileAddInternalListFile(ha, pNameIndex, hMpq);
 
         // Also, add three special files to the listfile:
         // (listfile) itself, (attributes) and (signature)
-        SListFileCreateNodeForAllLocales(ha, LISTFILE_NAME);
-        SListFileCreateNodeForAllLocales(ha, SIGNATURE_NAME);
-        SListFileCreateNodeForAllLocales(ha, ATTRIBUTES_NAME);
+        SListFileCreateNodeForAllLocales(ha, pNameIndex, LISTFILE_NAME);
+        SListFileCreateNodeForAllLocales(ha, pNameIndex, SIGNATURE_NAME);
+        SListFileCreateNodeForAllLocales(ha, pNameIndex, ATTRIBUTES_NAME);
+        FreeNameHashIndex(pNameIndex);
 
         // Move to the next archive in the chain
         ha = ha->haPatch;
@@ -686,21 +810,26 @@ DWORD WINAPI SFileAddListFile(HANDLE hMpq, const TCHAR * szListFile)
 DWORD WINAPI SFileAddListFileEntries(HANDLE hMpq, const char ** listFileEntries, DWORD dwEntryCount)
 {
     TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TNameHashIndex * pNameIndex;
     DWORD dwErrCode = ERROR_SUCCESS;
 
     // Add the listfile for each MPQ in the patch chain
     while(ha != NULL)
     {
+        // Index the hash table for fast name lookups
+        pNameIndex = CreateNameHashIndex(ha);
+
         if(listFileEntries != NULL && dwEntryCount > 0)
-            dwErrCode = SFileAddArbitraryListFile(ha, listFileEntries, dwEntryCount);
+            dwErrCode = SFileAddArbitraryListFile(ha, pNameIndex, listFileEntries, dwEntryCount);
         else
-            dwErrCode = SFileAddInternalListFile(ha, hMpq);
+            dwErrCode = SFileAddInternalListFile(ha, pNameIndex, hMpq);
 
         // Also, add three special files to the listfile:
         // (listfile) itself, (attributes) and (signature)
-        SListFileCreateNodeForAllLocales(ha, LISTFILE_NAME);
-        SListFileCreateNodeForAllLocales(ha, SIGNATURE_NAME);
-        SListFileCreateNodeForAllLocales(ha, ATTRIBUTES_NAME);
+        SListFileCreateNodeForAllLocales(ha, pNameIndex, LISTFILE_NAME);
+        SListFileCreateNodeForAllLocales(ha, pNameIndex, SIGNATURE_NAME);
+        SListFileCreateNodeForAllLocales(ha, pNameIndex, ATTRIBUTES_NAME);
+        FreeNameHashIndex(pNameIndex);
 
         // Move to the next archive in the chain
         ha = ha->haPatch;
@@ -503,6 +503,13 @@ bool WINAPI SFileOpenArchive(
         dwErrCode = BuildFileTable(ha);
     }
 
+    // If a previous in-place compaction has been interrupted, finish it now.
+    // Until then, the file table doesn't match the positions of the file data
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = ResumeCompactArchive(ha);
+    }
+
     // Load the internal listfile and include it to the file table
     if(dwErrCode == ERROR_SUCCESS && (dwFlags & MPQ_OPEN_NO_LISTFILE) == 0)
     {
@@ -582,6 +589,30 @@ bool WINAPI SFileSetDownloadCallback(HANDLE hMpq, SFILE_DOWNLOAD_CALLBACK Downlo
     return FileStream_SetCallback(ha->pStream, DownloadCB, pvUserData);
 }
 
+//-----------------------------------------------------------------------------
+// bool WINAPI SFileSetThreadCount(HANDLE, DWORD);
+//
+// Sets the number of threads that StormLib may use for operations
+// on the archive. Values 0 and 1 mean that everything is done
+// on the calling thread. The count is limited to 64. The worker threads
+// are started here and live until the archive is closed.
+//
+
+bool WINAPI SFileSetThreadCount(HANDLE hMpq, DWORD dwThreadCount)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    SetArchiveThreadCount(ha, dwThreadCount);
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 // bool SFileFlushArchive(HANDLE hMpq)
 //
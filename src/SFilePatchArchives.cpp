@@ -12,6 +12,10 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+#ifndef STORMLIB_WIIU
+#include <mutex>
+#endif
+
 //-----------------------------------------------------------------------------
 // Local structures
 
@@ -62,6 +66,24 @@ typedef struct _BSDIFF_CTRL_BLOCK
 
 } BSDIFF_CTRL_BLOCK, *PBSDIFF_CTRL_BLOCK;
 
+// Sequential reader of the patch data. The data are read in pieces
+// and decompressed on the fly, so the whole patch is never in memory.
+typedef struct _TMPQPatchReader
+{
+    TMPQFile * hf;                          // The patch file
+    LPBYTE pbBuffer;                        // Buffer for the raw patch data
+    DWORD cbBuffer;                         // Number of loaded bytes in the buffer
+    DWORD dwBufferPos;                      // Position of the next byte in the buffer
+    DWORD dwRawPos;                         // Position of the next raw byte to load, relative to the patch data
+    DWORD dwRawSize;                        // Size of the raw patch data
+    DWORD dwDataPos;                        // Position in the decompressed patch data
+    DWORD dwDataSize;                       // Size of the decompressed patch data
+    DWORD dwRunLength;                      // Remaining length of the current RLE run
+    bool bLiteralRun;                       // true = the run contains bytes, false = the run contains zeros
+} TMPQPatchReader;
+
+#define PATCH_READ_BUFFER_SIZE  0x10000     // Size of the raw data buffer of the patch reader
+
 typedef struct _LOCALIZED_MPQ_INFO
 {
     const char * szNameTemplate;            // Name template
@@ -146,70 +168,165 @@ static void Decompress_RLE(LPBYTE pbDecompressed, DWORD cbDecompressed, LPBYTE p
     }
 }
 
-static DWORD LoadFilePatch_COPY(TMPQFile * hf, PMPQ_PATCH_HEADER pFullPatch)
+static DWORD PatchReader_Init(TMPQPatchReader * pReader, TMPQFile * hf, PMPQ_PATCH_HEADER pPatchHeader)
 {
-    DWORD cbBytesToRead = pFullPatch->dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER);
-    DWORD cbBytesRead = 0;
+    memset(pReader, 0, sizeof(TMPQPatchReader));
+    pReader->hf = hf;
+    pReader->dwDataSize = pPatchHeader->dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER);
+    pReader->dwRawSize = pPatchHeader->dwXfrmBlockSize - SIZE_OF_XFRM_HEADER;
+
+    // Is the patch compressed? If yes, the compressed data begin with a DWORD that we skip.
+    // If not, the whole patch is one run of bytes.
+    if(pReader->dwRawSize < pReader->dwDataSize)
+    {
+        pReader->dwRawPos = STORMLIB_MIN(pReader->dwRawSize, sizeof(DWORD));
+    }
+    else
+    {
+        pReader->dwRawSize = pReader->dwDataSize;
+        pReader->dwRunLength = pReader->dwDataSize;
+        pReader->bLiteralRun = true;
+    }
 
-    // Simply load the rest of the patch
-    SFileReadFile((HANDLE)hf, (pFullPatch + 1), cbBytesToRead, &cbBytesRead, NULL);
-    return (cbBytesRead == cbBytesToRead) ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
+    pReader->pbBuffer = STORM_ALLOC(BYTE, PATCH_READ_BUFFER_SIZE);
+    return (pReader->pbBuffer != NULL) ? ERROR_SUCCESS : ERROR_NOT_ENOUGH_MEMORY;
 }
 
-static DWORD LoadFilePatch_BSD0(TMPQFile * hf, PMPQ_PATCH_HEADER pFullPatch)
+static DWORD PatchReader_Clone(TMPQPatchReader * pTarget, TMPQPatchReader * pSource)
 {
-    LPBYTE pbDecompressed = (LPBYTE)(pFullPatch + 1);
-    LPBYTE pbCompressed = NULL;
-    DWORD cbDecompressed = 0;
-    DWORD cbCompressed = 0;
-    DWORD dwBytesRead = 0;
-    DWORD dwErrCode = ERROR_SUCCESS;
+    memcpy(pTarget, pSource, sizeof(TMPQPatchReader));
+    pTarget->pbBuffer = STORM_ALLOC(BYTE, PATCH_READ_BUFFER_SIZE);
+    if(pTarget->pbBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    memcpy(pTarget->pbBuffer, pSource->pbBuffer, pSource->cbBuffer);
+    return ERROR_SUCCESS;
+}
+
+static void PatchReader_Free(TMPQPatchReader * pReader)
+{
+    if(pReader->pbBuffer != NULL)
+        STORM_FREE(pReader->pbBuffer);
+    pReader->pbBuffer = NULL;
+}
 
-    // Calculate the size of compressed data
-    cbDecompressed = pFullPatch->dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER);
-    cbCompressed = pFullPatch->dwXfrmBlockSize - SIZE_OF_XFRM_HEADER;
+// Makes sure that the buffer contains raw data. Gives the number of bytes available in the buffer,
+// which is zero if there are no more raw data
+static DWORD PatchReader_Fill(TMPQPatchReader * pReader, LPDWORD pdwAvailable)
+{
+    DWORD dwBytesToRead;
+    DWORD dwBytesRead = 0;
 
-    // Is that file compressed?
-    if(cbCompressed < cbDecompressed)
+    if(pReader->dwBufferPos >= pReader->cbBuffer)
     {
-        pbCompressed = STORM_ALLOC(BYTE, cbCompressed);
-        if(pbCompressed == NULL)
-            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        dwBytesToRead = STORMLIB_MIN(pReader->dwRawSize - pReader->dwRawPos, PATCH_READ_BUFFER_SIZE);
+        pReader->dwBufferPos = pReader->cbBuffer = 0;
 
-        // Read the compressed patch data
-        if(dwErrCode == ERROR_SUCCESS)
+        // The patch data follow the patch header
+        if(dwBytesToRead != 0)
         {
-            SFileReadFile((HANDLE)hf, pbCompressed, cbCompressed, &dwBytesRead, NULL);
-            if(dwBytesRead != cbCompressed)
-                dwErrCode = ERROR_FILE_CORRUPT;
+            pReader->hf->dwFilePos = sizeof(MPQ_PATCH_HEADER) + pReader->dwRawPos;
+            SFileReadFile((HANDLE)pReader->hf, pReader->pbBuffer, dwBytesToRead, &dwBytesRead, NULL);
+            if(dwBytesRead != dwBytesToRead)
+                return ERROR_FILE_CORRUPT;
+
+            pReader->dwRawPos += dwBytesRead;
+            pReader->cbBuffer = dwBytesRead;
         }
+    }
 
-        // Decompress the data
-        if(dwErrCode == ERROR_SUCCESS)
-            Decompress_RLE(pbDecompressed, cbDecompressed, pbCompressed, cbCompressed);
+    pdwAvailable[0] = pReader->cbBuffer - pReader->dwBufferPos;
+    return ERROR_SUCCESS;
+}
 
-        if(pbCompressed != NULL)
-            STORM_FREE(pbCompressed);
-    }
-    else
+// Reads the next piece of the decompressed patch data. If pbBuffer is NULL, the data are skipped.
+// Compressed patches use RLE: A byte with 0x80 set is followed by ((byte & 0x7F) + 1) bytes of data,
+// any other byte means (byte + 1) zeros. If the compressed data end, the rest is zeros.
+static DWORD PatchReader_Read(TMPQPatchReader * pReader, void * pvBuffer, DWORD cbBytes)
+{
+    LPBYTE pbBuffer = (LPBYTE)pvBuffer;
+    DWORD dwAvailable;
+    DWORD dwToCopy;
+    DWORD dwErrCode;
+
+    // The data must be within the patch
+    if(cbBytes > pReader->dwDataSize - pReader->dwDataPos)
+        return ERROR_FILE_CORRUPT;
+    pReader->dwDataPos += cbBytes;
+
+    while(cbBytes > 0)
     {
-        SFileReadFile((HANDLE)hf, pbDecompressed, cbDecompressed, &dwBytesRead, NULL);
-        if(dwBytesRead != cbDecompressed)
-            dwErrCode = ERROR_FILE_CORRUPT;
+        // Start the next run, if needed
+        if(pReader->dwRunLength == 0)
+        {
+            if((dwErrCode = PatchReader_Fill(pReader, &dwAvailable)) != ERROR_SUCCESS)
+                return dwErrCode;
+
+            if(dwAvailable != 0)
+            {
+                BYTE OneByte = pReader->pbBuffer[pReader->dwBufferPos++];
+
+                pReader->bLiteralRun = (OneByte & 0x80) ? true : false;
+                pReader->dwRunLength = (OneByte & 0x7F) + 1;
+                if(pReader->bLiteralRun == false)
+                    pReader->dwRunLength = OneByte + 1;
+            }
+            else
+            {
+                pReader->bLiteralRun = false;
+                pReader->dwRunLength = 0xFFFFFFFF;
+            }
+        }
+
+        // Get the data of the run
+        dwToCopy = STORMLIB_MIN(cbBytes, pReader->dwRunLength);
+        if(pReader->bLiteralRun)
+        {
+            if((dwErrCode = PatchReader_Fill(pReader, &dwAvailable)) != ERROR_SUCCESS)
+                return dwErrCode;
+
+            // If the data end in the middle of the run, the rest is zeros
+            if(dwAvailable == 0)
+            {
+                pReader->bLiteralRun = false;
+                pReader->dwRunLength = 0xFFFFFFFF;
+                continue;
+            }
+
+            dwToCopy = STORMLIB_MIN(dwToCopy, dwAvailable);
+            if(pbBuffer != NULL)
+                memcpy(pbBuffer, pReader->pbBuffer + pReader->dwBufferPos, dwToCopy);
+            pReader->dwBufferPos += dwToCopy;
+        }
+        else
+        {
+            if(pbBuffer != NULL)
+                memset(pbBuffer, 0, dwToCopy);
+        }
+
+        // Move to the next piece
+        if(pbBuffer != NULL)
+            pbBuffer += dwToCopy;
+        pReader->dwRunLength -= dwToCopy;
+        cbBytes -= dwToCopy;
     }
 
-    return dwErrCode;
+    return ERROR_SUCCESS;
 }
 
 static DWORD ApplyFilePatch_COPY(
     TMPQPatcher * pPatcher,
-    PMPQ_PATCH_HEADER pFullPatch,
+    TMPQFile * hf,
+    PMPQ_PATCH_HEADER pPatchHeader,
     LPBYTE pbTarget,
     LPBYTE pbSource)
 {
     // Sanity checks
     assert(pPatcher->cbMaxFileData >= pPatcher->cbFileData);
-    pFullPatch = pFullPatch;
+
+    // The patch must be complete, even if we don't need its data
+    if(pPatchHeader->dwSizeOfPatchData > hf->dwDataSize)
+        return ERROR_FILE_CORRUPT;
 
     // Copy the patch data as-is
     memcpy(pbTarget, pbSource, pPatcher->cbFileData);
@@ -218,69 +335,96 @@ static DWORD ApplyFilePatch_COPY(
 
 static DWORD ApplyFilePatch_BSD0(
     TMPQPatcher * pPatcher,
-    PMPQ_PATCH_HEADER pFullPatch,
+    TMPQFile * hf,
+    PMPQ_PATCH_HEADER pPatchHeader,
     LPBYTE pbTarget,
     LPBYTE pbSource)
 {
-    PBLIZZARD_BSDIFF40_FILE pBsdiff;
-    PBSDIFF_CTRL_BLOCK pCtrlBlock;
-    LPBYTE pbPatchData = (LPBYTE)(pFullPatch + 1);
-    LPBYTE pDataBlock;
-    LPBYTE pExtraBlock;
+    BLIZZARD_BSDIFF40_FILE Bsdiff;
+    BSDIFF_CTRL_BLOCK CtrlBlock;
+    TMPQPatchReader CtrlReader;
+    TMPQPatchReader DataReader;
+    TMPQPatchReader ExtraReader;
+    ULONGLONG CtrlBlockSize;
+    ULONGLONG DataBlockSize;
     LPBYTE pbOldData = pbSource;
     LPBYTE pbNewData = pbTarget;
     DWORD dwCombineSize;
     DWORD dwNewOffset = 0;                          // Current position to patch
     DWORD dwOldOffset = 0;                          // Current source position
-    DWORD dwNewSize;                                // Patched file size
+    DWORD dwNewSize = 0;                            // Patched file size
     DWORD dwOldSize = pPatcher->cbFileData;         // File size before patch
+    DWORD dwErrCode;
 
-    // Get pointer to the patch header
+    // The patch is read by three readers at once: control block, data block and extra block
+    memset(&DataReader, 0, sizeof(TMPQPatchReader));
+    memset(&ExtraReader, 0, sizeof(TMPQPatchReader));
+    dwErrCode = PatchReader_Init(&CtrlReader, hf, pPatchHeader);
+
+    // Get the patch header
     // Format of BSDIFF header corresponds to original BSDIFF, which is:
     // 0000   8 bytes   signature "BSDIFF40"
     // 0008   8 bytes   size of the control block
     // 0010   8 bytes   size of the data block
     // 0018   8 bytes   new size of the patched file
-    pBsdiff = (PBLIZZARD_BSDIFF40_FILE)pbPatchData;
-    pbPatchData += sizeof(BLIZZARD_BSDIFF40_FILE);
-
-    // Get pointer to the 32-bit BSDIFF control block
-    // The control block follows immediately after the BSDIFF header
-    // and consists of three 32-bit integers
-    // 0000   4 bytes   Length to copy from the BSDIFF data block the new file
-    // 0004   4 bytes   Length to copy from the BSDIFF extra block
-    // 0008   4 bytes   Size to increment source file offset
-    pCtrlBlock = (PBSDIFF_CTRL_BLOCK)pbPatchData;
-    pbPatchData += (size_t)BSWAP_INT64_UNSIGNED(pBsdiff->CtrlBlockSize);
-
-    // Get the pointer to the data block
-    pDataBlock = (LPBYTE)pbPatchData;
-    pbPatchData += (size_t)BSWAP_INT64_UNSIGNED(pBsdiff->DataBlockSize);
-
-    // Get the pointer to the extra block
-    pExtraBlock = (LPBYTE)pbPatchData;
-    dwNewSize = (DWORD)BSWAP_INT64_UNSIGNED(pBsdiff->NewFileSize);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = PatchReader_Read(&CtrlReader, &Bsdiff, sizeof(BLIZZARD_BSDIFF40_FILE));
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        CtrlBlockSize = BSWAP_INT64_UNSIGNED(Bsdiff.CtrlBlockSize);
+        DataBlockSize = BSWAP_INT64_UNSIGNED(Bsdiff.DataBlockSize);
+        dwNewSize = (DWORD)BSWAP_INT64_UNSIGNED(Bsdiff.NewFileSize);
+        if(CtrlBlockSize > 0xFFFFFFFF || DataBlockSize > 0xFFFFFFFF || dwNewSize > pPatcher->cbMaxFileData)
+            dwErrCode = ERROR_FILE_CORRUPT;
+    }
+
+    // The data block follows the control block, the extra block follows the data block
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = PatchReader_Clone(&DataReader, &CtrlReader);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = PatchReader_Read(&DataReader, NULL, (DWORD)CtrlBlockSize);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = PatchReader_Clone(&ExtraReader, &DataReader);
+    if(dwErrCode == ERROR_SUCCESS)
+        dwErrCode = PatchReader_Read(&ExtraReader, NULL, (DWORD)DataBlockSize);
 
     // Now patch the file
-    while(dwNewOffset < dwNewSize)
+    while(dwErrCode == ERROR_SUCCESS && dwNewOffset < dwNewSize)
     {
-        DWORD dwAddDataLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwAddDataLength);
-        DWORD dwMovDataLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwMovDataLength);
-        DWORD dwOldMoveLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwOldMoveLength);
+        DWORD dwAddDataLength;
+        DWORD dwMovDataLength;
+        DWORD dwOldMoveLength;
         DWORD i;
 
+        // Get the next entry of the 32-bit BSDIFF control block
+        // It consists of three 32-bit integers
+        // 0000   4 bytes   Length to copy from the BSDIFF data block the new file
+        // 0004   4 bytes   Length to copy from the BSDIFF extra block
+        // 0008   4 bytes   Size to increment source file offset
+        if((dwErrCode = PatchReader_Read(&CtrlReader, &CtrlBlock, sizeof(BSDIFF_CTRL_BLOCK))) != ERROR_SUCCESS)
+            break;
+        dwAddDataLength = BSWAP_INT32_UNSIGNED(CtrlBlock.dwAddDataLength);
+        dwMovDataLength = BSWAP_INT32_UNSIGNED(CtrlBlock.dwMovDataLength);
+        dwOldMoveLength = BSWAP_INT32_UNSIGNED(CtrlBlock.dwOldMoveLength);
+
         // Sanity check
-        if((dwNewOffset + dwAddDataLength) > dwNewSize)
-            return ERROR_FILE_CORRUPT;
+        if((dwNewOffset + dwAddDataLength) > dwNewSize || (dwNewOffset + dwAddDataLength) < dwNewOffset)
+        {
+            dwErrCode = ERROR_FILE_CORRUPT;
+            break;
+        }
 
         // Read the diff string to the target buffer
-        memcpy(pbNewData + dwNewOffset, pDataBlock, dwAddDataLength);
-        pDataBlock += dwAddDataLength;
+        if((dwErrCode = PatchReader_Read(&DataReader, pbNewData + dwNewOffset, dwAddDataLength)) != ERROR_SUCCESS)
+            break;
 
         // Get the longest block that we can combine
         dwCombineSize = ((dwOldOffset + dwAddDataLength) >= dwOldSize) ? (dwOldSize - dwOldOffset) : dwAddDataLength;
         if((dwNewOffset + dwCombineSize) > dwNewSize || (dwNewOffset + dwCombineSize) < dwNewOffset)
-            return ERROR_FILE_CORRUPT;
+        {
+            dwErrCode = ERROR_FILE_CORRUPT;
+            break;
+        }
 
         // Now combine the patch data with the original file
         for(i = 0; i < dwCombineSize; i++)
@@ -291,34 +435,45 @@ static DWORD ApplyFilePatch_BSD0(
         dwOldOffset += dwAddDataLength;
 
         // Sanity check
-        if((dwNewOffset + dwMovDataLength) > dwNewSize)
-            return ERROR_FILE_CORRUPT;
+        if((dwNewOffset + dwMovDataLength) > dwNewSize || (dwNewOffset + dwMovDataLength) < dwNewOffset)
+        {
+            dwErrCode = ERROR_FILE_CORRUPT;
+            break;
+        }
 
         // Copy the data from the extra block in BSDIFF patch
-        memcpy(pbNewData + dwNewOffset, pExtraBlock, dwMovDataLength);
-        pExtraBlock += dwMovDataLength;
+        if((dwErrCode = PatchReader_Read(&ExtraReader, pbNewData + dwNewOffset, dwMovDataLength)) != ERROR_SUCCESS)
+            break;
         dwNewOffset += dwMovDataLength;
 
         // Move the old offset
         if(dwOldMoveLength & 0x80000000)
             dwOldMoveLength = 0x80000000 - dwOldMoveLength;
         dwOldOffset += dwOldMoveLength;
-        pCtrlBlock++;
     }
 
+    PatchReader_Free(&ExtraReader);
+    PatchReader_Free(&DataReader);
+    PatchReader_Free(&CtrlReader);
+
     // The size after patch must match
-    if(dwNewOffset != pFullPatch->dwSizeAfterPatch)
-        return ERROR_FILE_CORRUPT;
+    if(dwErrCode == ERROR_SUCCESS && dwNewOffset != pPatchHeader->dwSizeAfterPatch)
+        dwErrCode = ERROR_FILE_CORRUPT;
 
     // Update the new data size
-    pPatcher->cbFileData = dwNewOffset;
-    return ERROR_SUCCESS;
+    if(dwErrCode == ERROR_SUCCESS)
+        pPatcher->cbFileData = dwNewOffset;
+    return dwErrCode;
 }
 
-static PMPQ_PATCH_HEADER LoadFullFilePatch(TMPQFile * hf, MPQ_PATCH_HEADER & PatchHeader)
+static DWORD ApplyFilePatch(
+    TMPQPatcher * pPatcher,
+    TMPQFile * hf,
+    MPQ_PATCH_HEADER & PatchHeader)
 {
-    PMPQ_PATCH_HEADER pFullPatch;
-    DWORD dwErrCode = ERROR_SUCCESS;
+    LPBYTE pbSource = (pPatcher->nCounter & 0x1) ? pPatcher->pbFileData2 : pPatcher->pbFileData1;
+    LPBYTE pbTarget = (pPatcher->nCounter & 0x1) ? pPatcher->pbFileData1 : pPatcher->pbFileData2;
+    DWORD dwErrCode;
 
     // BSWAP the entire header, if needed
     BSWAP_ARRAY32_UNSIGNED(&PatchHeader, sizeof(DWORD) * 6);
@@ -326,66 +481,21 @@ static PMPQ_PATCH_HEADER LoadFullFilePatch(TMPQFile * hf, MPQ_PATCH_HEADER & Pat
 
     // Verify the signatures in the patch header
     if(PatchHeader.dwSignature != PATCH_SIGNATURE_HEADER || PatchHeader.dwMD5 != PATCH_SIGNATURE_MD5 || PatchHeader.dwXFRM != PATCH_SIGNATURE_XFRM)
-        return NULL;
-
-    // Allocate space for patch header and compressed data
-    pFullPatch = (PMPQ_PATCH_HEADER)STORM_ALLOC(BYTE, PatchHeader.dwSizeOfPatchData);
-    if(pFullPatch != NULL)
-    {
-        // Copy the patch header
-        memcpy(pFullPatch, &PatchHeader, sizeof(MPQ_PATCH_HEADER));
-
-        // Read the patch, depending on patch type
-        if(dwErrCode == ERROR_SUCCESS)
-        {
-            switch(PatchHeader.dwPatchType)
-            {
-                case 0x59504f43:    // 'COPY'
-                    dwErrCode = LoadFilePatch_COPY(hf, pFullPatch);
-                    break;
-
-                case 0x30445342:    // 'BSD0'
-                    dwErrCode = LoadFilePatch_BSD0(hf, pFullPatch);
-                    break;
-
-                default:
-                    dwErrCode = ERROR_FILE_CORRUPT;
-                    break;
-            }
-        }
-
-        // If something failed, free the patch buffer
-        if(dwErrCode != ERROR_SUCCESS)
-        {
-            STORM_FREE(pFullPatch);
-            pFullPatch = NULL;
-        }
-    }
-
-    // Give the result to the caller
-    return pFullPatch;
-}
-
-static DWORD ApplyFilePatch(
-    TMPQPatcher * pPatcher,
-    PMPQ_PATCH_HEADER pFullPatch)
-{
-    LPBYTE pbSource = (pPatcher->nCounter & 0x1) ? pPatcher->pbFileData2 : pPatcher->pbFileData1;
-    LPBYTE pbTarget = (pPatcher->nCounter & 0x1) ? pPatcher->pbFileData1 : pPatcher->pbFileData2;
-    DWORD dwErrCode;
-
-    // Sanity checks
-    assert(pFullPatch->dwSizeAfterPatch <= pPatcher->cbMaxFileData);
+        return ERROR_FILE_CORRUPT;
+    if(PatchHeader.dwSizeOfPatchData < sizeof(MPQ_PATCH_HEADER) || PatchHeader.dwXfrmBlockSize < SIZE_OF_XFRM_HEADER)
+        return ERROR_FILE_CORRUPT;
+    if(PatchHeader.dwSizeAfterPatch > pPatcher->cbMaxFileData)
+        return ERROR_FILE_CORRUPT;
 
     // Apply the patch according to the type
-    switch(pFullPatch->dwPatchType)
+    switch(PatchHeader.dwPatchType)
     {
         case 0x59504f43:    // 'COPY'
-            dwErrCode = ApplyFilePatch_COPY(pPatcher, pFullPatch, pbTarget, pbSource);
+            dwErrCode = ApplyFilePatch_COPY(pPatcher, hf, &PatchHeader, pbTarget, pbSource);
             break;
 
         case 0x30445342:    // 'BSD0'
-            dwErrCode = ApplyFilePatch_BSD0(pPatcher, pFullPatch, pbTarget, pbSource);
+            dwErrCode = ApplyFilePatch_BSD0(pPatcher, hf, &PatchHeader, pbTarget, pbSource);
             break;
 
         default:
@@ -394,14 +504,14 @@ static DWORD ApplyFilePatch(
     }
 
     // Verify MD5 after patch
-    if(dwErrCode == ERROR_SUCCESS && pFullPatch->dwSizeAfterPatch != 0)
+    if(dwErrCode == ERROR_SUCCESS && PatchHeader.dwSizeAfterPatch != 0)
     {
         // Verify the patched file
-        if(!VerifyDataBlockHash(pbTarget, pFullPatch->dwSizeAfterPatch, pFullPatch->md5_after_patch))
+        if(!VerifyDataBlockHash(pbTarget, PatchHeader.dwSizeAfterPatch, PatchHeader.md5_after_patch))
             dwErrCode = ERROR_FILE_CORRUPT;
 
         // Copy the MD5 of the new block
-        memcpy(pPatcher->this_md5, pFullPatch->md5_after_patch, MD5_DIGEST_SIZE);
+        memcpy(pPatcher->this_md5, PatchHeader.md5_after_patch, MD5_DIGEST_SIZE);
     }
 
     return dwErrCode;
@@ -985,11 +1095,12 @@ DWORD Patch_InitPatcher(TMPQPatcher * pPatcher, TMPQFile * hf)
 // memory usage during patching process. A prime example is the file
 // DBFilesClient\\Item-Sparse.db2 from locale-enGB.MPQ (WoW 16965), which has
 // 9 patches in a row, each requiring 70 MB memory (35 MB patch data + 35 MB work buffer)
+// The patch data are not loaded as a whole either. They are read and decompressed in pieces
+// as the patch is applied, so only the two versions of the file need to be in memory.
 //
 
 DWORD Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf)
 {
-    PMPQ_PATCH_HEADER pFullPatch;
     MPQ_PATCH_HEADER PatchHeader1;
     MPQ_PATCH_HEADER PatchHeader2 = {0};
     TMPQFile * hfBase = hf;
@@ -1027,18 +1138,8 @@ DWORD Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf)
             hf = hf->hfPatch;
         }
 
-        // Allocate memory for the patch data
-        pFullPatch = LoadFullFilePatch(hf, PatchHeader1);
-        if(pFullPatch != NULL)
-        {
-            // Apply the patch
-            dwErrCode = ApplyFilePatch(pPatcher, pFullPatch);
-            STORM_FREE(pFullPatch);
-        }
-        else
-        {
-            dwErrCode = ERROR_FILE_CORRUPT;
-        }
+        // Apply the patch. The patch data are read in pieces
+        dwErrCode = ApplyFilePatch(pPatcher, hf, PatchHeader1);
 
         // Move to the next patch
         PatchHeader1 = PatchHeader2;
@@ -1081,6 +1182,328 @@ void Patch_Finalize(TMPQPatcher * pPatcher)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Cache of patched file data
+//
+// Patching a file applies every patch in the chain, so it is the most expensive
+// way of reading a file. The cache keeps the final data of recently patched files.
+// It belongs to the main archive (the one without haBase), because that is where
+// the patch chain starts. The key is the chain itself: For each file in the chain,
+// the archive, the file index, the byte offset and the compressed size.
+// Patched archives are always read-only, so the chain can only change
+// when a new patch archive is added.
+
+#define PATCH_CACHE_BUCKETS     256         // Number of hash buckets
+
+// One member of the patch chain
+struct TPatchCacheLink
+{
+    TMPQArchive * ha;                       // Archive containing the file
+    ULONGLONG ByteOffset;                   // Byte offset of the file data
+    DWORD dwFileIndex;                      // Index of the file in the file table
+    DWORD dwCmpSize;                        // Compressed size of the file
+};
+
+struct TPatchCacheEntry
+{
+    TPatchCacheEntry * pNextHash;           // Next entry in the same hash bucket
+    TPatchCacheEntry * pPrev;               // Previous (more recently used) entry in the LRU list
+    TPatchCacheEntry * pNext;               // Next (less recently used) entry in the LRU list
+    DWORD dwHash;                           // Hash of the patch chain
+    DWORD dwLinks;                          // Number of files in the patch chain
+    DWORD cbData;                           // Size of the patched file data
+
+    // Followed by array of TPatchCacheLink[dwLinks] and by the patched file data
+};
+
+struct TPatchCache
+{
+#ifndef STORMLIB_WIIU
+    std::mutex Lock;                        // Protects everything in the cache
+#endif
+    TPatchCacheEntry * Buckets[PATCH_CACHE_BUCKETS];
+    TPatchCacheEntry LruList;               // List head. The most recently used entry is LruList.pNext
+    ULONGLONG cbBudget;                     // Maximum number of bytes in the cache
+    ULONGLONG cbUsed;                       // Number of bytes occupied by the entries
+    ULONGLONG Hits;
+    ULONGLONG Misses;
+    ULONGLONG Evictions;
+    DWORD dwEntries;
+};
+
+static void LockPatchCache(TPatchCache * pCache)
+{
+#ifndef STORMLIB_WIIU
+    pCache->Lock.lock();
+#else
+    STORMLIB_UNUSED(pCache);
+#endif
+}
+
+static void UnlockPatchCache(TPatchCache * pCache)
+{
+#ifndef STORMLIB_WIIU
+    pCache->Lock.unlock();
+#else
+    STORMLIB_UNUSED(pCache);
+#endif
+}
+
+static TPatchCache * GetPatchCache(TMPQArchive * ha)
+{
+    // The cache is owned by the main archive
+    while(ha->haBase != NULL)
+        ha = ha->haBase;
+    return ha->pPatchCache;
+}
+
+static size_t GetPatchCacheEntrySize(DWORD dwLinks, DWORD cbData)
+{
+    return sizeof(TPatchCacheEntry) + dwLinks * sizeof(TPatchCacheLink) + cbData;
+}
+
+static TPatchCacheLink * GetPatchCacheLinks(TPatchCacheEntry * pEntry)
+{
+    return (TPatchCacheLink *)(pEntry + 1);
+}
+
+static LPBYTE GetPatchCacheData(TPatchCacheEntry * pEntry)
+{
+    return (LPBYTE)(GetPatchCacheLinks(pEntry) + pEntry->dwLinks);
+}
+
+static void MakePatchCacheLink(TPatchCacheLink * pLink, TMPQFile * hf)
+{
+    pLink->ha = hf->ha;
+    pLink->ByteOffset = hf->pFileEntry->ByteOffset;
+    pLink->dwFileIndex = (DWORD)(hf->pFileEntry - hf->ha->pFileTable);
+    pLink->dwCmpSize = hf->pFileEntry->dwCmpSize;
+}
+
+// Calculates hash of the patch chain and gives the number of files in it
+static DWORD HashPatchChain(TMPQFile * hf, LPDWORD pdwLinks)
+{
+    TPatchCacheLink Link;
+    DWORD dwHash = 0x811C9DC5;
+    DWORD dwLinks = 0;
+
+    for(; hf != NULL; hf = hf->hfPatch, dwLinks++)
+    {
+        MakePatchCacheLink(&Link, hf);
+        dwHash = (dwHash ^ Link.dwFileIndex) * 0x9E3779B1;
+        dwHash = (dwHash ^ (DWORD)(Link.ByteOffset) ^ (DWORD)(Link.ByteOffset >> 32)) * 0x85EBCA6B;
+        dwHash = (dwHash ^ (DWORD)((size_t)Link.ha >> 4)) * 0xC2B2AE35;
+        dwHash = dwHash ^ (dwHash >> 15);
+    }
+
+    *pdwLinks = dwLinks;
+    return dwHash;
+}
+
+static bool IsSamePatchChain(TPatchCacheEntry * pEntry, TMPQFile * hf, DWORD dwHash, DWORD dwLinks)
+{
+    TPatchCacheLink * pLinks = GetPatchCacheLinks(pEntry);
+    TPatchCacheLink Link;
+
+    if(pEntry->dwHash != dwHash || pEntry->dwLinks != dwLinks)
+        return false;
+
+    for(DWORD i = 0; i < dwLinks; i++, hf = hf->hfPatch)
+    {
+        MakePatchCacheLink(&Link, hf);
+        if(pLinks[i].ha != Link.ha || pLinks[i].ByteOffset != Link.ByteOffset)
+            return false;
+        if(pLinks[i].dwFileIndex != Link.dwFileIndex || pLinks[i].dwCmpSize != Link.dwCmpSize)
+            return false;
+    }
+    return true;
+}
+
+static TPatchCacheEntry * FindPatchCacheEntry(TPatchCache * pCache, TMPQFile * hf, DWORD dwHash, DWORD dwLinks)
+{
+    TPatchCacheEntry * pEntry;
+
+    for(pEntry = pCache->Buckets[dwHash % PATCH_CACHE_BUCKETS]; pEntry != NULL; pEntry = pEntry->pNextHash)
+    {
+        if(IsSamePatchChain(pEntry, hf, dwHash, dwLinks))
+            return pEntry;
+    }
+    return NULL;
+}
+
+static void UnlinkPatchCacheEntry(TPatchCache * pCache, TPatchCacheEntry * pEntry)
+{
+    TPatchCacheEntry ** ppEntry = &pCache->Buckets[pEntry->dwHash % PATCH_CACHE_BUCKETS];
+
+    // Remove the entry from its hash bucket
+    while(ppEntry[0] != pEntry)
+        ppEntry = &ppEntry[0]->pNextHash;
+    ppEntry[0] = pEntry->pNextHash;
+
+    // Remove the entry from the LRU list
+    pEntry->pPrev->pNext = pEntry->pNext;
+    pEntry->pNext->pPrev = pEntry->pPrev;
+
+    pCache->cbUsed -= GetPatchCacheEntrySize(pEntry->dwLinks, pEntry->cbData);
+    pCache->dwEntries--;
+}
+
+static void LinkPatchCacheEntry(TPatchCache * pCache, TPatchCacheEntry * pEntry)
+{
+    pEntry->pPrev = &pCache->LruList;
+    pEntry->pNext = pCache->LruList.pNext;
+    pEntry->pNext->pPrev = pEntry;
+    pCache->LruList.pNext = pEntry;
+}
+
+// Evicts the least recently used entries until the cache fits into the budget
+static void TrimPatchCache(TPatchCache * pCache, ULONGLONG cbBudget)
+{
+    while(pCache->cbUsed > cbBudget && pCache->LruList.pPrev != &pCache->LruList)
+    {
+        TPatchCacheEntry * pEntry = pCache->LruList.pPrev;
+
+        UnlinkPatchCacheEntry(pCache, pEntry);
+        STORM_FREE(pEntry);
+        pCache->Evictions++;
+    }
+}
+
+static TPatchCache * AllocatePatchCache()
+{
+    TPatchCache * pCache;
+
+    // The cache contains a lock, so it needs to be constructed
+    pCache = new(std::nothrow) TPatchCache;
+    if(pCache != NULL)
+    {
+        memset(pCache->Buckets, 0, sizeof(pCache->Buckets));
+        pCache->LruList.pPrev = pCache->LruList.pNext = &pCache->LruList;
+        pCache->cbBudget = pCache->cbUsed = 0;
+        pCache->Hits = pCache->Misses = pCache->Evictions = 0;
+        pCache->dwEntries = 0;
+    }
+    return pCache;
+}
+
+// Loads the patched data of the file from the cache.
+// Returns false if the file is not cached.
+bool QueryPatchCache(TMPQFile * hf)
+{
+    TPatchCacheEntry * pEntry;
+    TPatchCache * pCache = GetPatchCache(hf->ha);
+    DWORD dwLinks;
+    DWORD dwHash;
+    bool bResult = false;
+
+    // Is the cache enabled?
+    if(pCache == NULL)
+        return false;
+    assert(hf->pbFileData == NULL);
+
+    dwHash = HashPatchChain(hf, &dwLinks);
+
+    LockPatchCache(pCache);
+    pEntry = FindPatchCacheEntry(pCache, hf, dwHash, dwLinks);
+    if(pEntry != NULL && (hf->pbFileData = STORM_ALLOC(BYTE, pEntry->cbData)) != NULL)
+    {
+        // Move the entry to the front of the LRU list
+        pEntry->pPrev->pNext = pEntry->pNext;
+        pEntry->pNext->pPrev = pEntry->pPrev;
+        LinkPatchCacheEntry(pCache, pEntry);
+
+        memcpy(hf->pbFileData, GetPatchCacheData(pEntry), pEntry->cbData);
+        hf->cbFileData = pEntry->cbData;
+        pCache->Hits++;
+        bResult = true;
+    }
+    else
+    {
+        pCache->Misses++;
+    }
+    UnlockPatchCache(pCache);
+    return bResult;
+}
+
+// Stores a copy of the patched file data into the cache
+void InsertPatchCache(TMPQFile * hf)
+{
+    TPatchCacheEntry * pOldEntry;
+    TPatchCacheEntry * pEntry;
+    TPatchCacheLink * pLinks;
+    TPatchCache * pCache = GetPatchCache(hf->ha);
+    TMPQFile * hfLink;
+    size_t cbEntry;
+    DWORD dwLinks;
+    DWORD dwHash;
+
+    // Is the cache enabled? Is there anything to cache?
+    if(pCache == NULL || hf->pbFileData == NULL || hf->cbFileData == 0)
+        return;
+
+    dwHash = HashPatchChain(hf, &dwLinks);
+    cbEntry = GetPatchCacheEntrySize(dwLinks, hf->cbFileData);
+
+    // Don't even allocate the entry if it can never fit
+    if(cbEntry > pCache->cbBudget)
+        return;
+
+    // Prepare the new entry outside of the lock
+    pEntry = (TPatchCacheEntry *)STORM_ALLOC(BYTE, cbEntry);
+    if(pEntry == NULL)
+        return;
+    pEntry->dwHash = dwHash;
+    pEntry->dwLinks = dwLinks;
+    pEntry->cbData = hf->cbFileData;
+
+    pLinks = GetPatchCacheLinks(pEntry);
+    for(hfLink = hf; hfLink != NULL; hfLink = hfLink->hfPatch)
+        MakePatchCacheLink(pLinks++, hfLink);
+    memcpy(GetPatchCacheData(pEntry), hf->pbFileData, hf->cbFileData);
+
+    LockPatchCache(pCache);
+    {
+        // Another thread may have cached the same file
+        pOldEntry = FindPatchCacheEntry(pCache, hf, dwHash, dwLinks);
+        if(pOldEntry != NULL)
+        {
+            UnlinkPatchCacheEntry(pCache, pOldEntry);
+            STORM_FREE(pOldEntry);
+        }
+
+        // Make space for the new entry and insert it
+        TrimPatchCache(pCache, pCache->cbBudget - cbEntry);
+        pEntry->pNextHash = pCache->Buckets[dwHash % PATCH_CACHE_BUCKETS];
+        pCache->Buckets[dwHash % PATCH_CACHE_BUCKETS] = pEntry;
+        LinkPatchCacheEntry(pCache, pEntry);
+        pCache->cbUsed += cbEntry;
+        pCache->dwEntries++;
+    }
+    UnlockPatchCache(pCache);
+}
+
+void InvalidatePatchCache(TMPQArchive * ha)
+{
+    TPatchCache * pCache = GetPatchCache(ha);
+
+    if(pCache != NULL)
+    {
+        LockPatchCache(pCache);
+        TrimPatchCache(pCache, 0);
+        UnlockPatchCache(pCache);
+    }
+}
+
+void FreePatchCache(TMPQArchive * ha)
+{
+    if(ha->pPatchCache != NULL)
+    {
+        TrimPatchCache(ha->pPatchCache, 0);
+        delete ha->pPatchCache;
+        ha->pPatchCache = NULL;
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Public functions
 
@@ -1141,6 +1564,9 @@ bool WINAPI SFileOpenPatchArchive(
                     {
                         haPatch->haBase = ha;
                         ha->haPatch = haPatch;
+
+                        // Patched files now have a longer patch chain
+                        InvalidatePatchCache(ha);
                         return true;
                     }
 
@@ -1173,3 +1599,86 @@ bool WINAPI SFileIsPatchedArchive(HANDLE hMpq)
 
     return (ha->haPatch != NULL);
 }
+
+//-----------------------------------------------------------------------------
+// bool WINAPI SFileSetPatchCacheSize(HANDLE, ULONGLONG);
+//
+// Enables the cache of patched file data. The cache is shared by all patch
+// archives of the main archive, so 'hMpq' must be the main archive.
+// Zero disables the cache and frees all cached files.
+// Must not be called while other threads read from the archive.
+//
+
+bool WINAPI SFileSetPatchCacheSize(HANDLE hMpq, ULONGLONG CacheSize)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Zero size means no cache at all
+    if(CacheSize == 0)
+    {
+        FreePatchCache(ha);
+        return true;
+    }
+
+    // Allocate the cache, if not there yet
+    if(ha->pPatchCache == NULL)
+    {
+        ha->pPatchCache = AllocatePatchCache();
+        if(ha->pPatchCache == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+    }
+
+    // Set the new budget and drop what doesn't fit anymore
+    ha->pPatchCache->cbBudget = CacheSize;
+    TrimPatchCache(ha->pPatchCache, CacheSize);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// bool WINAPI SFileGetPatchCacheStats(HANDLE, PSFILE_PATCH_CACHE_STATS);
+//
+// Retrieves the hit/miss counters and the occupancy of the patched file cache.
+//
+
+bool WINAPI SFileGetPatchCacheStats(HANDLE hMpq, PSFILE_PATCH_CACHE_STATS pStats)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TPatchCache * pCache;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(pStats == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    memset(pStats, 0, sizeof(SFILE_PATCH_CACHE_STATS));
+    if((pCache = ha->pPatchCache) != NULL)
+    {
+        LockPatchCache(pCache);
+        pStats->CacheSize = pCache->cbBudget;
+        pStats->BytesUsed = pCache->cbUsed;
+        pStats->Hits = pCache->Hits;
+        pStats->Misses = pCache->Misses;
+        pStats->Evictions = pCache->Evictions;
+        pStats->dwEntries = pCache->dwEntries;
+        UnlockPatchCache(pCache);
+    }
+    return true;
+}
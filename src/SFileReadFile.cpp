@@ -13,6 +13,15 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+#ifndef STORMLIB_WIIU
+#include <mutex>
+#endif
+
+//-----------------------------------------------------------------------------
+// Local defines
+
+#define READ_AHEAD_SIZE     0x00010000      // Amount of data loaded at once for sequential reads
+
 //-----------------------------------------------------------------------------
 // External references (not public functions)
 
@@ -21,12 +30,332 @@ int WINAPI SCompDecompressX(TMPQArchive * ha, void * pvOutBuffer, int * pcbOutBu
 //-----------------------------------------------------------------------------
 // Local functions
 
+// Decrypts the blocks and converts them back to the native byte order
+static void DecryptSectorBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount)
+{
+    DecryptMpqBlocks(pBlocks, dwBlockCount);
+    for(DWORD i = 0; i < dwBlockCount; i++)
+        BSWAP_ARRAY32_UNSIGNED(pBlocks[i].pvDataBlock, pBlocks[i].dwLength);
+}
+
+// Decrypts all sectors that have been loaded by ReadMpqSectors.
+// Multiple sectors are decrypted at once, which is faster than decrypting them one by one
+static DWORD DecryptMpqSectors(TMPQFile * hf, LPBYTE pbInSector, DWORD dwSectorIndex, DWORD dwSectorsToRead, DWORD dwBytesToRead)
+{
+    TMPQCryptBlock Blocks[MPQ_CRYPT_LANES * 4];
+    TMPQArchive * ha = hf->ha;
+    DWORD dwBlockCount = 0;
+
+    for(DWORD i = 0; i < dwSectorsToRead; i++)
+    {
+        DWORD dwRawBytesInThisSector = STORMLIB_MIN(ha->dwSectorSize, dwBytesToRead);
+        DWORD dwBytesInThisSector = dwRawBytesInThisSector;
+        DWORD dwIndex = dwSectorIndex + i;
+
+        // If the file is compressed, we have to adjust the raw sector size
+        if(hf->pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
+            dwRawBytesInThisSector = hf->SectorOffsets[dwIndex + 1] - hf->SectorOffsets[dwIndex];
+        BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
+
+        // If we don't know the key, try to detect it by file content
+        if(hf->dwFileKey == 0)
+        {
+            hf->dwFileKey = DetectFileKeyByContent(pbInSector, dwBytesInThisSector, hf->dwDataSize);
+            if(hf->dwFileKey == 0)
+                return ERROR_UNKNOWN_FILE_KEY;
+        }
+
+        // Add the sector to the list of blocks to decrypt
+        Blocks[dwBlockCount].pvDataBlock = pbInSector;
+        Blocks[dwBlockCount].dwLength = dwRawBytesInThisSector;
+        Blocks[dwBlockCount].dwKey = hf->dwFileKey + dwIndex;
+        dwBlockCount++;
+
+        // Decrypt the blocks when we have enough of them
+        if(dwBlockCount == _countof(Blocks))
+        {
+            DecryptSectorBlocks(Blocks, dwBlockCount);
+            dwBlockCount = 0;
+        }
+
+        // Move pointers
+        dwBytesToRead -= dwBytesInThisSector;
+        pbInSector += dwRawBytesInThisSector;
+    }
+
+    // Decrypt the remaining blocks
+    DecryptSectorBlocks(Blocks, dwBlockCount);
+    return ERROR_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Shared cache of decompressed file sectors
+//
+// The cache belongs to the archive, so it survives closing the file handles.
+// It is split into stripes, each of them with its own lock, hash table and
+// LRU list, so that threads reading different files rarely wait for each other.
+// Sectors are identified by file index and sector index. The byte offset
+// of the file is stored too, so a file entry with new data never gets a stale hit.
+
+#define SECTOR_CACHE_STRIPES    16          // Number of independently locked parts
+#define SECTOR_CACHE_BUCKETS    256         // Number of hash buckets in each part
+
+struct TSectorCacheEntry
+{
+    TSectorCacheEntry * pNextHash;          // Next entry in the same hash bucket
+    TSectorCacheEntry * pPrev;              // Previous (more recently used) entry in the LRU list
+    TSectorCacheEntry * pNext;              // Next (less recently used) entry in the LRU list
+    ULONGLONG ByteOffset;                   // Byte offset of the file data when the sector was cached
+    DWORD dwFileIndex;                      // Index of the file in the file table
+    DWORD dwSectorIndex;                    // Index of the sector in the file
+    DWORD dwCompression0;                   // Compression used for the sector
+    DWORD cbData;                           // Size of the decompressed sector data
+
+    // Followed by the decompressed sector data
+};
+
+struct TSectorCacheStripe
+{
+#ifndef STORMLIB_WIIU
+    std::mutex Lock;                        // Protects everything in the stripe
+#endif
+    TSectorCacheEntry * Buckets[SECTOR_CACHE_BUCKETS];
+    TSectorCacheEntry LruList;              // List head. The most recently used entry is LruList.pNext
+    ULONGLONG cbBudget;                     // Maximum number of bytes in this stripe
+    ULONGLONG cbUsed;                       // Number of bytes occupied by the entries
+    ULONGLONG Hits;
+    ULONGLONG Misses;
+    ULONGLONG Evictions;
+    DWORD dwEntries;
+};
+
+struct TSectorCache
+{
+    TSectorCacheStripe Stripes[SECTOR_CACHE_STRIPES];
+};
+
+static void LockStripe(TSectorCacheStripe * pStripe)
+{
+#ifndef STORMLIB_WIIU
+    pStripe->Lock.lock();
+#else
+    STORMLIB_UNUSED(pStripe);
+#endif
+}
+
+static void UnlockStripe(TSectorCacheStripe * pStripe)
+{
+#ifndef STORMLIB_WIIU
+    pStripe->Lock.unlock();
+#else
+    STORMLIB_UNUSED(pStripe);
+#endif
+}
+
+static DWORD HashSectorKey(DWORD dwFileIndex, DWORD dwSectorIndex)
+{
+    DWORD dwHash = (dwFileIndex * 0x9E3779B1) ^ (dwSectorIndex * 0x85EBCA6B);
+    return dwHash ^ (dwHash >> 15);
+}
+
+static void UnlinkCacheEntry(TSectorCacheStripe * pStripe, TSectorCacheEntry * pEntry, DWORD dwBucket)
+{
+    TSectorCacheEntry ** ppEntry = &pStripe->Buckets[dwBucket];
+
+    // Remove the entry from its hash bucket
+    while(ppEntry[0] != pEntry)
+        ppEntry = &ppEntry[0]->pNextHash;
+    ppEntry[0] = pEntry->pNextHash;
+
+    // Remove the entry from the LRU list
+    pEntry->pPrev->pNext = pEntry->pNext;
+    pEntry->pNext->pPrev = pEntry->pPrev;
+
+    pStripe->cbUsed -= sizeof(TSectorCacheEntry) + pEntry->cbData;
+    pStripe->dwEntries--;
+}
+
+static void LinkAsMostRecent(TSectorCacheStripe * pStripe, TSectorCacheEntry * pEntry)
+{
+    pEntry->pPrev = &pStripe->LruList;
+    pEntry->pNext = pStripe->LruList.pNext;
+    pEntry->pNext->pPrev = pEntry;
+    pStripe->LruList.pNext = pEntry;
+}
+
+// Evicts the least recently used entries until the stripe fits into its budget
+static void TrimCacheStripe(TSectorCacheStripe * pStripe, ULONGLONG cbBudget)
+{
+    while(pStripe->cbUsed > cbBudget && pStripe->LruList.pPrev != &pStripe->LruList)
+    {
+        TSectorCacheEntry * pEntry = pStripe->LruList.pPrev;
+
+        UnlinkCacheEntry(pStripe, pEntry, (HashSectorKey(pEntry->dwFileIndex, pEntry->dwSectorIndex) >> 4) % SECTOR_CACHE_BUCKETS);
+        STORM_FREE(pEntry);
+        pStripe->Evictions++;
+    }
+}
+
+static TSectorCacheEntry * FindCacheEntry(TSectorCacheStripe * pStripe, DWORD dwBucket, DWORD dwFileIndex, DWORD dwSectorIndex)
+{
+    TSectorCacheEntry * pEntry;
+
+    for(pEntry = pStripe->Buckets[dwBucket]; pEntry != NULL; pEntry = pEntry->pNextHash)
+    {
+        if(pEntry->dwFileIndex == dwFileIndex && pEntry->dwSectorIndex == dwSectorIndex)
+            return pEntry;
+    }
+    return NULL;
+}
+
+// Copies the sector from the cache to the buffer. Returns false if the sector is not cached.
+// The cached sectors were not necessarily checked against their CRC, so handles
+// that check sector CRCs always read from the archive.
+static bool QuerySectorCache(TMPQFile * hf, DWORD dwSectorIndex, LPBYTE pbBuffer, DWORD cbData)
+{
+    TSectorCacheStripe * pStripe;
+    TSectorCacheEntry * pEntry;
+    TSectorCache * pCache = hf->ha->pSectorCache;
+    DWORD dwFileIndex;
+    DWORD dwHash;
+    bool bResult = false;
+
+    // Is the cache enabled?
+    if(pCache == NULL || hf->bCheckSectorCRCs)
+        return false;
+
+    dwFileIndex = (DWORD)(hf->pFileEntry - hf->ha->pFileTable);
+    dwHash = HashSectorKey(dwFileIndex, dwSectorIndex);
+    pStripe = &pCache->Stripes[dwHash % SECTOR_CACHE_STRIPES];
+
+    LockStripe(pStripe);
+    pEntry = FindCacheEntry(pStripe, (dwHash >> 4) % SECTOR_CACHE_BUCKETS, dwFileIndex, dwSectorIndex);
+    if(pEntry != NULL && pEntry->ByteOffset == hf->pFileEntry->ByteOffset && pEntry->cbData == cbData)
+    {
+        // Move the entry to the front of the LRU list
+        pEntry->pPrev->pNext = pEntry->pNext;
+        pEntry->pNext->pPrev = pEntry->pPrev;
+        LinkAsMostRecent(pStripe, pEntry);
+
+        memcpy(pbBuffer, pEntry + 1, cbData);
+        hf->dwCompression0 = pEntry->dwCompression0;
+        pStripe->Hits++;
+        bResult = true;
+    }
+    else
+    {
+        pStripe->Misses++;
+    }
+    UnlockStripe(pStripe);
+    return bResult;
+}
+
+// Stores a copy of the decompressed sector into the cache
+static void InsertSectorCache(TMPQFile * hf, DWORD dwSectorIndex, LPBYTE pbData, DWORD cbData)
+{
+    TSectorCacheStripe * pStripe;
+    TSectorCacheEntry * pEntry;
+    TSectorCache * pCache = hf->ha->pSectorCache;
+    DWORD dwFileIndex;
+    DWORD dwBucket;
+    DWORD dwHash;
+
+    // Is the cache enabled? Handles that check sector CRCs don't use it.
+    if(pCache == NULL || hf->bCheckSectorCRCs)
+        return;
+
+    dwFileIndex = (DWORD)(hf->pFileEntry - hf->ha->pFileTable);
+    dwHash = HashSectorKey(dwFileIndex, dwSectorIndex);
+    dwBucket = (dwHash >> 4) % SECTOR_CACHE_BUCKETS;
+    pStripe = &pCache->Stripes[dwHash % SECTOR_CACHE_STRIPES];
+
+    // Don't even allocate the entry if it can never fit
+    if((sizeof(TSectorCacheEntry) + cbData) > pStripe->cbBudget)
+        return;
+
+    // Prepare the new entry outside of the lock
+    pEntry = (TSectorCacheEntry *)STORM_ALLOC(BYTE, sizeof(TSectorCacheEntry) + cbData);
+    if(pEntry == NULL)
+        return;
+    pEntry->ByteOffset = hf->pFileEntry->ByteOffset;
+    pEntry->dwFileIndex = dwFileIndex;
+    pEntry->dwSectorIndex = dwSectorIndex;
+    pEntry->dwCompression0 = hf->dwCompression0;
+    pEntry->cbData = cbData;
+    memcpy(pEntry + 1, pbData, cbData);
+
+    LockStripe(pStripe);
+    {
+        TSectorCacheEntry * pOldEntry;
+
+        // Another thread may have cached the same sector, or the sector may be stale
+        pOldEntry = FindCacheEntry(pStripe, dwBucket, dwFileIndex, dwSectorIndex);
+        if(pOldEntry != NULL)
+        {
+            UnlinkCacheEntry(pStripe, pOldEntry, dwBucket);
+            STORM_FREE(pOldEntry);
+        }
+
+        // Make space for the new entry and insert it
+        TrimCacheStripe(pStripe, pStripe->cbBudget - (sizeof(TSectorCacheEntry) + cbData));
+        pEntry->pNextHash = pStripe->Buckets[dwBucket];
+        pStripe->Buckets[dwBucket] = pEntry;
+        LinkAsMostRecent(pStripe, pEntry);
+        pStripe->cbUsed += sizeof(TSectorCacheEntry) + cbData;
+        pStripe->dwEntries++;
+    }
+    UnlockStripe(pStripe);
+}
+
+static TSectorCache * AllocateSectorCache()
+{
+    TSectorCache * pCache;
+
+    // The stripes contain locks, so they need to be constructed
+    pCache = new(std::nothrow) TSectorCache;
+    if(pCache != NULL)
+    {
+        for(size_t i = 0; i < SECTOR_CACHE_STRIPES; i++)
+        {
+            TSectorCacheStripe * pStripe = &pCache->Stripes[i];
+
+            memset(pStripe->Buckets, 0, sizeof(pStripe->Buckets));
+            pStripe->LruList.pPrev = pStripe->LruList.pNext = &pStripe->LruList;
+            pStripe->cbBudget = pStripe->cbUsed = 0;
+            pStripe->Hits = pStripe->Misses = pStripe->Evictions = 0;
+            pStripe->dwEntries = 0;
+        }
+    }
+    return pCache;
+}
+
+void InvalidateSectorCache(TMPQArchive * ha)
+{
+    if(ha->pSectorCache != NULL)
+    {
+        for(size_t i = 0; i < SECTOR_CACHE_STRIPES; i++)
+        {
+            TrimCacheStripe(&ha->pSectorCache->Stripes[i], 0);
+        }
+    }
+}
+
+void FreeSectorCache(TMPQArchive * ha)
+{
+    if(ha->pSectorCache != NULL)
+    {
+        InvalidateSectorCache(ha);
+        delete ha->pSectorCache;
+        ha->pSectorCache = NULL;
+    }
+}
+
 //  hf            - MPQ File handle.
 //  pbBuffer      - Pointer to target buffer to store sectors.
 //  dwByteOffset  - Position of sector in the file (relative to file begin)
 //  dwBytesToRead - Number of bytes to read. Must be multiplier of sector size.
 //  pdwBytesRead  - Stored number of bytes loaded
-static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+static DWORD ReadMpqSectorsFromStream(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
 {
     ULONGLONG RawFilePos;
     TMPQArchive * ha = hf->ha;
@@ -102,8 +431,12 @@ static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset,
     // Set file pointer and read all required sectors
     if(FileStream_Read(ha->pStream, &RawFilePos, pbInSector, dwRawBytesToRead))
     {
-        // Now we have to decrypt and decompress all file sectors that have been loaded
-        for(DWORD i = 0; i < dwSectorsToRead; i++)
+        // If the file is encrypted, we have to decrypt the sectors
+        if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
+            dwErrCode = DecryptMpqSectors(hf, pbInSector, dwSectorIndex, dwSectorsToRead, dwBytesToRead);
+
+        // Now we have to decompress all file sectors that have been loaded
+        for(DWORD i = 0; i < dwSectorsToRead && dwErrCode == ERROR_SUCCESS; i++)
         {
             DWORD dwRawBytesInThisSector = ha->dwSectorSize;
             DWORD dwBytesInThisSector = ha->dwSectorSize;
@@ -120,26 +453,6 @@ static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset,
             if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
                 dwRawBytesInThisSector = hf->SectorOffsets[dwIndex + 1] - hf->SectorOffsets[dwIndex];
 
-            // If the file is encrypted, we have to decrypt the sector
-            if(pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED)
-            {
-                BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
-
-                // If we don't know the key, try to detect it by file content
-                if(hf->dwFileKey == 0)
-                {
-                    hf->dwFileKey = DetectFileKeyByContent(pbInSector, dwBytesInThisSector, hf->dwDataSize);
-                    if(hf->dwFileKey == 0)
-                    {
-                        dwErrCode = ERROR_UNKNOWN_FILE_KEY;
-                        break;
-                    }
-                }
-
-                DecryptMpqBlock(pbInSector, dwRawBytesInThisSector, hf->dwFileKey + dwIndex);
-                BSWAP_ARRAY32_UNSIGNED(pbInSector, dwRawBytesInThisSector);
-            }
-
             // If the file has sector CRC check turned on, perform it
             if(hf->bCheckSectorCRCs && hf->SectorChksums != NULL)
             {
@@ -229,6 +542,79 @@ static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset,
     return dwErrCode;
 }
 
+// Same as ReadMpqSectorsFromStream, but serves the sectors from the sector cache
+// if possible. Runs of sectors that are not cached are read at once.
+static DWORD ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+{
+    TMPQArchive * ha = hf->ha;
+    DWORD dwSectorSize = ha->dwSectorSize;
+    DWORD dwBytesRead = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Without the cache, read the sectors directly
+    if(ha->pSectorCache == NULL)
+        return ReadMpqSectorsFromStream(hf, pbBuffer, dwByteOffset, dwBytesToRead, pdwBytesRead);
+
+    // If there is not enough bytes remaining, cut dwBytesToRead
+    if((dwByteOffset + dwBytesToRead) > hf->dwDataSize)
+        dwBytesToRead = hf->dwDataSize - dwByteOffset;
+
+    while(dwBytesToRead != 0 && dwErrCode == ERROR_SUCCESS)
+    {
+        DWORD dwSectorIndex = dwByteOffset / dwSectorSize;
+        DWORD dwBytesInSector = STORMLIB_MIN(dwSectorSize, dwBytesToRead);
+        DWORD dwRunBytes = dwBytesInSector;
+        DWORD dwRunRead = 0;
+        DWORD dwHitBytes = 0;
+
+        // Is the sector in the cache?
+        if(QuerySectorCache(hf, dwSectorIndex, pbBuffer, dwBytesInSector))
+        {
+            dwHitBytes = dwBytesInSector;
+            dwRunBytes = 0;
+        }
+        else
+        {
+            // Find the end of the run of sectors that are not cached.
+            // A cached sector ends the run, and it is already copied to the buffer.
+            while(dwRunBytes < dwBytesToRead)
+            {
+                DWORD dwNextBytes = STORMLIB_MIN(dwSectorSize, dwBytesToRead - dwRunBytes);
+
+                if(QuerySectorCache(hf, dwSectorIndex + (dwRunBytes / dwSectorSize), pbBuffer + dwRunBytes, dwNextBytes))
+                {
+                    dwHitBytes = dwNextBytes;
+                    break;
+                }
+                dwRunBytes += dwNextBytes;
+            }
+
+            // Read the run from the archive and put its sectors to the cache.
+            // The number of bytes must be sector-aligned; the last sector is cut by the file size.
+            dwErrCode = ReadMpqSectorsFromStream(hf, pbBuffer, dwByteOffset, (dwRunBytes + dwSectorSize - 1) & ~(dwSectorSize - 1), &dwRunRead);
+            for(DWORD i = 0; i < dwRunRead; i += dwSectorSize)
+                InsertSectorCache(hf, dwSectorIndex + (i / dwSectorSize), pbBuffer + i, STORMLIB_MIN(dwSectorSize, dwRunRead - i));
+
+            // The cached sector after the run only counts if the run was read completely
+            if(dwErrCode != ERROR_SUCCESS || dwRunRead != dwRunBytes)
+                dwHitBytes = 0;
+        }
+
+        // Move pointers
+        dwBytesToRead -= dwRunRead + dwHitBytes;
+        dwByteOffset += dwRunRead + dwHitBytes;
+        dwBytesRead += dwRunRead + dwHitBytes;
+        pbBuffer += dwRunRead + dwHitBytes;
+
+        // Stop if the stream gave less data than expected
+        if(dwRunRead != dwRunBytes)
+            break;
+    }
+
+    *pdwBytesRead = dwBytesRead;
+    return dwErrCode;
+}
+
 static DWORD ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos, DWORD dwToRead, LPDWORD pdwBytesRead)
 {
     ULONGLONG RawFilePos = hf->RawFilePos;
@@ -251,6 +637,10 @@ static DWORD ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         RawFilePos += hf->pPatchInfo->dwLength;
     pbRawData = hf->pbFileSector;
 
+    // If the file sector is not loaded yet, try the sector cache first
+    if(hf->dwSectorOffs != 0 && QuerySectorCache(hf, 0, hf->pbFileSector, hf->dwDataSize))
+        hf->dwSectorOffs = 0;
+
     // If the file sector is not loaded yet, do it
     if(hf->dwSectorOffs != 0)
     {
@@ -331,6 +721,10 @@ static DWORD ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         if(pbCompressed != NULL)
             STORM_FREE(pbCompressed);
 
+        // Share the loaded file with other handles
+        if(dwErrCode == ERROR_SUCCESS)
+            InsertSectorCache(hf, 0, hf->pbFileSector, hf->dwDataSize);
+
         // The file sector is now properly loaded
         hf->dwSectorOffs = 0;
     }
@@ -459,6 +853,70 @@ static DWORD ReadMpkFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
 }
 
 
+// Returns the size of the read-ahead window, in bytes. Zero if read-ahead makes no sense.
+static DWORD GetReadAheadSize(TMPQArchive * ha)
+{
+    DWORD dwReadAheadSize = READ_AHEAD_SIZE & ~(ha->dwSectorSize - 1);
+
+    return (dwReadAheadSize > ha->dwSectorSize) ? dwReadAheadSize : 0;
+}
+
+// Serves small sequential reads. Instead of loading one sector per call,
+// it loads multiple sectors at once and copies the data from there.
+static DWORD ReadMpqFileReadAhead(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwFilePos, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
+{
+    TMPQArchive * ha = hf->ha;
+    DWORD dwReadAheadSize = GetReadAheadSize(ha);
+    DWORD dwTotalBytesRead = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Allocate the read-ahead buffer, if not done yet
+    if(hf->pbReadAhead == NULL)
+    {
+        hf->pbReadAhead = STORM_ALLOC(BYTE, dwReadAheadSize);
+        if(hf->pbReadAhead == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        hf->dwReadAheadBytes = 0;
+    }
+
+    while(dwBytesToRead > 0)
+    {
+        DWORD dwBufferOffs;
+        DWORD dwToCopy;
+
+        // If the position is not in the read-ahead buffer, load the next window
+        if(dwFilePos < hf->dwReadAheadOffs || dwFilePos >= (hf->dwReadAheadOffs + hf->dwReadAheadBytes))
+        {
+            DWORD dwWindowSize = dwReadAheadSize;
+
+            hf->dwReadAheadOffs = dwFilePos & ~(ha->dwSectorSize - 1);
+            hf->dwReadAheadBytes = 0;
+
+            // Never ask for sectors beyond the end of the file
+            if(dwWindowSize > (hf->dwDataSize - hf->dwReadAheadOffs))
+                dwWindowSize = (hf->dwDataSize - hf->dwReadAheadOffs + ha->dwSectorSize - 1) & ~(ha->dwSectorSize - 1);
+
+            dwErrCode = ReadMpqSectors(hf, hf->pbReadAhead, hf->dwReadAheadOffs, dwWindowSize, &hf->dwReadAheadBytes);
+            if(dwErrCode != ERROR_SUCCESS || dwFilePos >= (hf->dwReadAheadOffs + hf->dwReadAheadBytes))
+                break;
+        }
+
+        // Copy as much as we can from the buffer
+        dwBufferOffs = dwFilePos - hf->dwReadAheadOffs;
+        dwToCopy = STORMLIB_MIN(hf->dwReadAheadBytes - dwBufferOffs, dwBytesToRead);
+        memcpy(pbBuffer, hf->pbReadAhead + dwBufferOffs, dwToCopy);
+
+        // Update pointers
+        dwTotalBytesRead += dwToCopy;
+        dwFilePos += dwToCopy;
+        pbBuffer += dwToCopy;
+        dwBytesToRead -= dwToCopy;
+    }
+
+    *pdwBytesRead = dwTotalBytesRead;
+    return dwErrCode;
+}
+
 static DWORD ReadMpqFileSectorFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos, DWORD dwBytesToRead, LPDWORD pdwBytesRead)
 {
     TMPQArchive * ha = hf->ha;
@@ -480,6 +938,16 @@ static DWORD ReadMpqFileSectorFile(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
     if(dwBytesToRead > (hf->dwDataSize - dwFilePos))
         dwBytesToRead = (hf->dwDataSize - dwFilePos);
 
+    // If this read continues where the previous one ended, and it's smaller than
+    // the read-ahead window, serve it from the read-ahead buffer. This saves
+    // one stream read per sector when the caller uses a small buffer.
+    if(hf->dwReadAheadNext != 0 && hf->dwReadAheadNext == dwFilePos && dwBytesToRead < GetReadAheadSize(ha))
+    {
+        dwErrCode = ReadMpqFileReadAhead(hf, pbBuffer, dwFilePos, dwBytesToRead, pdwBytesRead);
+        hf->dwReadAheadNext = dwFilePos + *pdwBytesRead;
+        return dwErrCode;
+    }
+
     // Compute sector position in the file
     dwFileSectorPos = dwFilePos & ~dwSectorSizeMask;  // Position in the block
 
@@ -575,6 +1043,9 @@ static DWORD ReadMpqFileSectorFile(TMPQFile * hf, void * pvBuffer, DWORD dwFileP
         dwTotalBytesRead += dwToCopy;
     }
 
+    // Remember where the next sequential read would start
+    hf->dwReadAheadNext = dwFilePos + dwTotalBytesRead;
+
     // Store total number of bytes read to the caller
     *pdwBytesRead = dwTotalBytesRead;
     return ERROR_SUCCESS;
@@ -588,7 +1059,7 @@ static DWORD ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePo
     DWORD dwErrCode = ERROR_SUCCESS;
 
     // Make sure that the patch file is loaded completely
-    if(dwErrCode == ERROR_SUCCESS && hf->pbFileData == NULL)
+    if(dwErrCode == ERROR_SUCCESS && hf->pbFileData == NULL && !QueryPatchCache(hf))
     {
         // Initialize patching process and allocate data
         dwErrCode = Patch_InitPatcher(&Patcher, hf);
@@ -608,6 +1079,10 @@ static DWORD ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePo
         if(dwErrCode == ERROR_SUCCESS)
             dwErrCode = Patch_Process(&Patcher, hf);
 
+        // Keep the patched data for the next time the file is open
+        if(dwErrCode == ERROR_SUCCESS)
+            InsertPatchCache(hf);
+
         // Finalize the patcher structure
         Patch_Finalize(&Patcher);
         dwBytesRead = 0;
@@ -639,25 +1114,25 @@ static DWORD ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePo
 
 static DWORD ReadMpqFileLocalFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos, DWORD dwToRead, LPDWORD pdwBytesRead)
 {
-    ULONGLONG FilePosition1 = dwFilePos;
-    ULONGLONG FilePosition2;
+    ULONGLONG FilePosition = dwFilePos;
+    ULONGLONG FileSize = 0;
     DWORD dwBytesRead = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
 
     assert(hf->pStream != NULL);
 
     // Because stream I/O functions are designed to read
-    // "all or nothing", we compare file position before and after,
-    // and if they differ, we assume that number of bytes read
-    // is the difference between them
+    // "all or nothing", we check the file size if the read fails
+    // with ERROR_HANDLE_EOF. The number of bytes read is the rest of the file.
 
-    if(!FileStream_Read(hf->pStream, &FilePosition1, pvBuffer, dwToRead))
+    if(!FileStream_Read(hf->pStream, &FilePosition, pvBuffer, dwToRead))
     {
         // If not all bytes have been read, then return the number of bytes read
         if((dwErrCode = GetLastError()) == ERROR_HANDLE_EOF)
         {
-            FileStream_GetPos(hf->pStream, &FilePosition2);
-            dwBytesRead = (DWORD)(FilePosition2 - FilePosition1);
+            FileStream_GetSize(hf->pStream, &FileSize);
+            if(FileSize > FilePosition)
+                dwBytesRead = (DWORD)STORMLIB_MIN(FileSize - FilePosition, dwToRead);
         }
     }
     else
@@ -760,6 +1235,64 @@ bool WINAPI SFileReadFile(HANDLE hFile, void * pvBuffer, DWORD dwToRead, LPDWORD
     return (dwErrCode == ERROR_SUCCESS);
 }
 
+//-----------------------------------------------------------------------------
+// SFileGetFileView
+//
+// Gives a pointer to the file data within the memory-mapped archive.
+// Only works for files that are stored as-is (not compressed, not encrypted,
+// not patched) in an archive opened with STREAM_PROVIDER_MAP. In other cases,
+// the function fails with ERROR_NOT_SUPPORTED and the caller should fall back
+// to SFileReadFile. The pointer stays valid until the archive is closed.
+
+bool WINAPI SFileGetFileView(HANDLE hFile, const void ** ppvFileData, LPDWORD pdwFileSize)
+{
+    TFileEntry * pFileEntry;
+    TMPQArchive * ha;
+    TMPQFile * hf;
+    DWORD dwFlagsToReject = MPQ_FILE_COMPRESS_MASK | MPQ_FILE_ENCRYPTED | MPQ_FILE_PATCH_FILE | MPQ_FILE_DELETE_MARKER;
+
+    // Check valid parameters
+    if((hf = IsValidFileHandle(hFile)) == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(ppvFileData == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Local files, patched files and MPK files are never mapped
+    if(hf->pStream != NULL || hf->hfPatch != NULL || hf->ha->dwSubType == MPQ_SUBTYPE_MPK)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    // Only files stored without any transformation can be given out directly.
+    // If the caller asked for sector CRC checks, let SFileReadFile do them.
+    pFileEntry = hf->pFileEntry;
+    ha = hf->ha;
+    if(hf->bCheckSectorCRCs && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+        dwFlagsToReject |= MPQ_FILE_SECTOR_CRC;
+    if((pFileEntry->dwFlags & dwFlagsToReject) || pFileEntry->dwCmpSize < pFileEntry->dwFileSize)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return false;
+    }
+
+    // Ask the stream for the pointer to the file data
+    if(!FileStream_GetView(ha->pStream, CalculateRawSectorOffset(hf, 0), pFileEntry->dwFileSize, ppvFileData))
+        return false;
+
+    // Give the file size to the caller
+    if(pdwFileSize != NULL)
+        pdwFileSize[0] = pFileEntry->dwFileSize;
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 // SFileGetFileSize
 
@@ -852,14 +1385,7 @@ DWORD WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHi
         case FILE_CURRENT:
 
             // Retrieve the current file position
-            if(hf->pStream != NULL)
-            {
-                FileStream_GetPos(hf->pStream, &OldPosition);
-            }
-            else
-            {
-                OldPosition = hf->dwFilePos;
-            }
+            OldPosition = hf->dwFilePos;
             break;
 
         case FILE_END:
@@ -893,14 +1419,8 @@ DWORD WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHi
             NewPosition = FileSize;
     }
 
-    // Now apply the file pointer to the file
-    if(hf->pStream != NULL)
-    {
-        if(!FileStream_Read(hf->pStream, &NewPosition, NULL, 0))
-            return SFILE_INVALID_POS;
-    }
-
-    // Also, store the new file position to the TMPQFile struct
+    // Store the new file position to the TMPQFile struct.
+    // Local files are read from this position as well.
     hf->dwFilePos = (DWORD)NewPosition;
 
     // Return the new file position
@@ -908,3 +1428,97 @@ DWORD WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHi
         *plFilePosHigh = (LONG)(NewPosition >> 32);
     return (DWORD)NewPosition;
 }
+
+//-----------------------------------------------------------------------------
+// bool WINAPI SFileSetSectorCacheSize(HANDLE, ULONGLONG);
+//
+// Enables the cache of decompressed file sectors, shared by all file handles
+// of the archive. Zero disables the cache and frees all cached sectors.
+// File handles that check sector CRCs bypass the cache, so that every sector
+// they get has passed the CRC check.
+// Must not be called while other threads read from the archive.
+//
+
+bool WINAPI SFileSetSectorCacheSize(HANDLE hMpq, ULONGLONG CacheSize)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Zero size means no cache at all
+    if(CacheSize == 0)
+    {
+        FreeSectorCache(ha);
+        return true;
+    }
+
+    // Allocate the cache, if not there yet
+    if(ha->pSectorCache == NULL)
+    {
+        ha->pSectorCache = AllocateSectorCache();
+        if(ha->pSectorCache == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+    }
+
+    // Divide the budget between the stripes and drop what doesn't fit anymore
+    for(size_t i = 0; i < SECTOR_CACHE_STRIPES; i++)
+    {
+        TSectorCacheStripe * pStripe = &ha->pSectorCache->Stripes[i];
+
+        pStripe->cbBudget = CacheSize / SECTOR_CACHE_STRIPES;
+        TrimCacheStripe(pStripe, pStripe->cbBudget);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// bool WINAPI SFileGetSectorCacheStats(HANDLE, PSFILE_SECTOR_CACHE_STATS);
+//
+// Retrieves the hit/miss counters and the occupancy of the sector cache.
+//
+
+bool WINAPI SFileGetSectorCacheStats(HANDLE hMpq, PSFILE_SECTOR_CACHE_STATS pStats)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+
+    // Do nothing if 'hMpq' is bad parameter
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(pStats == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Sum the counters of all stripes
+    memset(pStats, 0, sizeof(SFILE_SECTOR_CACHE_STATS));
+    if(ha->pSectorCache != NULL)
+    {
+        for(size_t i = 0; i < SECTOR_CACHE_STRIPES; i++)
+        {
+            TSectorCacheStripe * pStripe = &ha->pSectorCache->Stripes[i];
+
+            LockStripe(pStripe);
+            pStats->CacheSize += pStripe->cbBudget;
+            pStats->BytesUsed += pStripe->cbUsed;
+            pStats->Hits += pStripe->Hits;
+            pStats->Misses += pStripe->Misses;
+            pStats->Evictions += pStripe->Evictions;
+            pStats->dwEntries += pStripe->dwEntries;
+            UnlockStripe(pStripe);
+        }
+    }
+    return true;
+}
@@ -17,10 +17,34 @@
 #include "StormLib.h"
 #include "StormCommon.h"
 
+#ifndef STORMLIB_WIIU
+#include <mutex>
+#endif
+
 //-----------------------------------------------------------------------------
 // Local defines
 
 #define MPQ_DIGEST_UNIT_SIZE      0x10000
+#define MPQ_RAW_READ_SIZE         0x100000      // Size of one read when verifying raw MD5 chunks
+#define MPQ_VERIFY_BUFFER_SIZE    0x10000       // Size of the read buffer in VerifyFile
+
+//-----------------------------------------------------------------------------
+// Local structures
+
+struct TMPQVerifyBatch
+{
+#ifndef STORMLIB_WIIU
+    std::mutex ReportLock;                  // Serializes calls to the verify callback
+#endif
+    TMPQArchive * ha;
+    TMPQOffsetOrder * pOrder;
+    SFILE_VERIFY_CALLBACK pfnVerifyCB;
+    void * pvUserData;
+    DWORD dwFlags;
+    DWORD dwItemCount;                      // Number of reported items (tables + files)
+    DWORD dwItemsDone;                      // Number of items reported so far
+    DWORD dwFailedCount;                    // Number of items that failed the verification
+};
 
 //-----------------------------------------------------------------------------
 // Known Blizzard public keys
@@ -350,10 +374,12 @@ static DWORD VerifyRawMpqData(
     DWORD dwDataSize)
 {
     ULONGLONG DataOffset = ha->MpqPos + ByteOffset;
-    LPBYTE pbDataChunk;
+    LPBYTE pbDataBuffer;
     LPBYTE pbMD5Array1;                 // Calculated MD5 array
     LPBYTE pbMD5Array2;                 // MD5 array loaded from the MPQ
     DWORD dwBytesInChunk;
+    DWORD dwBytesToRead;
+    DWORD dwBufferSize;
     DWORD dwChunkCount;
     DWORD dwChunkSize = ha->pHeader->dwRawChunkSize;
     DWORD dwMD5Size;
@@ -368,9 +394,13 @@ static DWORD VerifyRawMpqData(
     dwChunkCount = ((dwDataSize - 1) / dwChunkSize) + 1;
     dwMD5Size = dwChunkCount * MD5_DIGEST_SIZE;
 
-    // Allocate space for data chunk and for the MD5 array
-    pbDataChunk = STORM_ALLOC(BYTE, dwChunkSize);
-    if(pbDataChunk == NULL)
+    // Read as many whole chunks at once as fit into the read buffer
+    dwBufferSize = STORMLIB_MAX(MPQ_RAW_READ_SIZE / dwChunkSize, 1) * dwChunkSize;
+    dwBufferSize = STORMLIB_MIN(dwBufferSize, dwDataSize);
+
+    // Allocate space for data buffer and for the MD5 array
+    pbDataBuffer = STORM_ALLOC(BYTE, dwBufferSize);
+    if(pbDataBuffer == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
     // Allocate space for MD5 array
@@ -384,25 +414,27 @@ static DWORD VerifyRawMpqData(
     {
         LPBYTE pbMD5 = pbMD5Array1;
 
-        for(DWORD i = 0; i < dwChunkCount; i++)
+        while(dwDataSize != 0)
         {
-            // Get the number of bytes in the chunk
-            dwBytesInChunk = STORMLIB_MIN(dwChunkSize, dwDataSize);
-
-            // Read the data chunk
-            if(!FileStream_Read(ha->pStream, &DataOffset, pbDataChunk, dwBytesInChunk))
+            // Read the next run of data chunks
+            dwBytesToRead = STORMLIB_MIN(dwBufferSize, dwDataSize);
+            if(!FileStream_Read(ha->pStream, &DataOffset, pbDataBuffer, dwBytesToRead))
             {
                 dwErrCode = ERROR_FILE_CORRUPT;
                 break;
             }
 
-            // Calculate MD5
-            CalculateDataBlockHash(pbDataChunk, dwBytesInChunk, pbMD5);
+            // Calculate MD5 of each chunk in the buffer
+            for(DWORD dwBufferPos = 0; dwBufferPos < dwBytesToRead; dwBufferPos += dwBytesInChunk)
+            {
+                dwBytesInChunk = STORMLIB_MIN(dwChunkSize, dwBytesToRead - dwBufferPos);
+                CalculateDataBlockHash(pbDataBuffer + dwBufferPos, dwBytesInChunk, pbMD5);
+                pbMD5 += MD5_DIGEST_SIZE;
+            }
 
-            // Move pointers and offsets
-            DataOffset += dwBytesInChunk;
-            dwDataSize -= dwBytesInChunk;
-            pbMD5 += MD5_DIGEST_SIZE;
+            // Move offsets
+            DataOffset += dwBytesToRead;
+            dwDataSize -= dwBytesToRead;
         }
     }
 
@@ -427,8 +459,8 @@ static DWORD VerifyRawMpqData(
         STORM_FREE(pbMD5Array2);
     if(pbMD5Array1 != NULL)
         STORM_FREE(pbMD5Array1);
-    if(pbDataChunk != NULL)
-        STORM_FREE(pbDataChunk);
+    if(pbDataBuffer != NULL)
+        STORM_FREE(pbDataBuffer);
     return dwErrCode;
 }
 
@@ -563,8 +595,9 @@ static DWORD VerifyFile(
     unsigned char md5[MD5_DIGEST_SIZE];
     TFileEntry * pFileEntry;
     TMPQFile * hf;
-    BYTE Buffer[0x1000];
+    LPBYTE pbBuffer;
     HANDLE hFile = NULL;
+    DWORD dwBufferSize = MPQ_VERIFY_BUFFER_SIZE;
     DWORD dwVerifyResult = 0;
     DWORD dwTotalBytes = 0;
     DWORD dwCrc32 = 0;
@@ -622,13 +655,18 @@ static DWORD VerifyFile(
         if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
             hf->bCheckSectorCRCs = true;
 
+        // Small files don't need the full read buffer
+        if(dwTotalBytes != 0 && dwTotalBytes < dwBufferSize)
+            dwBufferSize = dwTotalBytes;
+        pbBuffer = STORM_ALLOC(BYTE, dwBufferSize);
+
         // Go through entire file and update both CRC32 and MD5
-        for(;;)
+        while(pbBuffer != NULL)
         {
             DWORD dwBytesRead = 0;
 
             // Read data from file
-            SFileReadFile(hFile, Buffer, sizeof(Buffer), &dwBytesRead, NULL);
+            SFileReadFile(hFile, pbBuffer, dwBufferSize, &dwBytesRead, NULL);
             if(dwBytesRead == 0)
             {
                 if(GetLastError() == ERROR_CHECKSUM_ERROR)
@@ -638,16 +676,20 @@ static DWORD VerifyFile(
 
             // Update CRC32 value
             if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                dwCrc32 = crc32(dwCrc32, Buffer, dwBytesRead);
+                dwCrc32 = crc32(dwCrc32, pbBuffer, dwBytesRead);
 
             // Update MD5 value
             if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                md5_process(&md5_state, Buffer, dwBytesRead);
+                md5_process(&md5_state, pbBuffer, dwBytesRead);
 
             // Decrement the total size
             dwTotalBytes -= dwBytesRead;
         }
 
+        // Free the read buffer
+        if(pbBuffer != NULL)
+            STORM_FREE(pbBuffer);
+
         // If the file has sector checksums, indicate it in the flags
         if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
         {
@@ -719,6 +761,68 @@ static DWORD VerifyFile(
     return dwVerifyResult;
 }
 
+static void ReportVerifyResult(TMPQVerifyBatch * pBatch, const char * szFileName, DWORD dwFileIndex, DWORD dwVerifyResult)
+{
+#ifndef STORMLIB_WIIU
+    std::lock_guard<std::mutex> Lock(pBatch->ReportLock);
+#endif
+
+    if(dwVerifyResult & VERIFY_FILE_ERROR_MASK)
+        pBatch->dwFailedCount++;
+    pBatch->dwItemsDone++;
+
+    if(pBatch->pfnVerifyCB != NULL)
+        pBatch->pfnVerifyCB(pBatch->pvUserData, szFileName, dwFileIndex, dwVerifyResult, pBatch->dwItemsDone, pBatch->dwItemCount);
+}
+
+// Verifies raw MD5 of a HET/BET table or the MPQ header
+static void VerifyRawTable(TMPQVerifyBatch * pBatch, const char * szTableName, DWORD dwWhatToVerify)
+{
+    DWORD dwVerifyResult = VERIFY_FILE_HAS_RAW_MD5;
+
+    if(SFileVerifyRawData((HANDLE)pBatch->ha, dwWhatToVerify, NULL) != ERROR_SUCCESS)
+        dwVerifyResult |= VERIFY_FILE_RAW_MD5_ERROR;
+    ReportVerifyResult(pBatch, szTableName, HASH_ENTRY_FREE, dwVerifyResult);
+}
+
+// Verifies one file of the archive. Called from multiple threads at once
+static DWORD VerifyBatchFile(void * pvContext, DWORD dwItemIndex)
+{
+    TMPQVerifyBatch * pBatch = (TMPQVerifyBatch *)pvContext;
+    TMPQArchive * ha = pBatch->ha;
+    TFileEntry * pFileEntry;
+    const char * szFileName;
+    char szPseudoName[MAX_PATH];
+    DWORD dwFileIndex = pBatch->pOrder[dwItemIndex].dwIndex;
+    DWORD dwVerifyResult = 0;
+
+    // Use the file name if it's known and it opens this very file entry.
+    // Otherwise, open the file by its index
+    pFileEntry = pBatch->pOrder[dwItemIndex].pFileEntry;
+    szFileName = pFileEntry->szFileName;
+    if(szFileName == NULL || IsPseudoFileName(szFileName, NULL) || GetFileEntryLocale(ha, szFileName, g_lcFileLocale) != pFileEntry)
+    {
+        StringCreatePseudoFileName(szPseudoName, _countof(szPseudoName), dwFileIndex, "xxx");
+        szFileName = szPseudoName;
+    }
+
+    // Verify the raw data of the file entry. If they don't match, don't bother with more checks
+    if((pBatch->dwFlags & SFILE_VERIFY_RAW_MD5) && ha->pHeader->dwRawChunkSize != 0)
+    {
+        dwVerifyResult |= VERIFY_FILE_HAS_RAW_MD5;
+        if(VerifyRawMpqData(ha, pFileEntry->ByteOffset, pFileEntry->dwCmpSize) != ERROR_SUCCESS)
+            dwVerifyResult |= VERIFY_FILE_RAW_MD5_ERROR;
+    }
+
+    // Verify the file content
+    if((dwVerifyResult & VERIFY_FILE_RAW_MD5_ERROR) == 0)
+        dwVerifyResult |= VerifyFile((HANDLE)ha, szFileName, NULL, NULL, pBatch->dwFlags & ~SFILE_VERIFY_RAW_MD5);
+
+    // Failure of one file doesn't stop the others
+    ReportVerifyResult(pBatch, szFileName, dwFileIndex, dwVerifyResult);
+    return ERROR_SUCCESS;
+}
+
 // Used in SFileGetFileInfo
 bool QueryMpqSignatureInfo(
     TMPQArchive * ha,
@@ -912,6 +1016,94 @@ DWORD WINAPI SFileVerifyFile(HANDLE hMpq, const char * szFileName, DWORD dwFlags
                       dwFlags);
 }
 
+//-----------------------------------------------------------------------------
+// DWORD SFileVerifyAllFiles(HANDLE hMpq, DWORD dwFlags, SFILE_VERIFY_CALLBACK pfnVerifyCB, void * pvUserData)
+//
+// Verifies all files in the archive, using the number of threads set by SFileSetThreadCount.
+// The files are processed in the order of their data in the archive.
+// With SFILE_VERIFY_RAW_MD5, the raw MD5 of the MPQ header, HET and BET table is also verified.
+// The callback is called once for every verified item (one thread at a time);
+// the failed ones have some of the VERIFY_FILE_ERROR_MASK bits set.
+// Returns ERROR_FILE_CORRUPT if any item failed the verification.
+//
+
+DWORD WINAPI SFileVerifyAllFiles(HANDLE hMpq, DWORD dwFlags, SFILE_VERIFY_CALLBACK pfnVerifyCB, void * pvUserData)
+{
+    TMPQVerifyBatch Batch;
+    TMPQArchive * ha = IsValidMpqHandle(hMpq);
+    TMPQHeader * pHeader;
+    TFileEntry * pFileTableEnd;
+    TFileEntry * pFileEntry;
+    DWORD dwFileCount = 0;
+    bool bVerifyTables;
+
+    // Verify input parameters
+    if(ha == NULL)
+        return ERROR_INVALID_HANDLE;
+    pHeader = ha->pHeader;
+
+    // Allocate the verification order
+    Batch.pOrder = STORM_ALLOC(TMPQOffsetOrder, ha->dwFileTableSize);
+    if(Batch.pOrder == NULL && ha->dwFileTableSize != 0)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Collect all existing files and sort them by the position of their data,
+    // so that the archive is read sequentially
+    pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if((pFileEntry->dwFlags & MPQ_FILE_EXISTS) && (pFileEntry->dwFlags & MPQ_FILE_DELETE_MARKER) == 0)
+        {
+            Batch.pOrder[dwFileCount].ByteOffset = pFileEntry->ByteOffset;
+            Batch.pOrder[dwFileCount].pFileEntry = pFileEntry;
+            Batch.pOrder[dwFileCount].dwIndex = (DWORD)(pFileEntry - ha->pFileTable);
+            dwFileCount++;
+        }
+    }
+    SortByByteOffset(Batch.pOrder, dwFileCount);
+
+    // Prepare the batch
+    // If the archive has been changed, new files may have been written over the tables.
+    // They will be saved again when the archive is flushed, so there is nothing to verify yet
+    bVerifyTables = (dwFlags & SFILE_VERIFY_RAW_MD5) && pHeader->dwRawChunkSize != 0 && (ha->dwFlags & MPQ_FLAG_CHANGED) == 0;
+    Batch.ha = ha;
+    Batch.pfnVerifyCB = pfnVerifyCB;
+    Batch.pvUserData = pvUserData;
+    Batch.dwFlags = dwFlags;
+    Batch.dwItemCount = dwFileCount;
+    Batch.dwItemsDone = 0;
+    Batch.dwFailedCount = 0;
+
+    // Count the tables protected by raw MD5
+    if(bVerifyTables)
+    {
+        if(pHeader->dwHeaderSize >= (MPQ_HEADER_SIZE_V4 - MD5_DIGEST_SIZE))
+            Batch.dwItemCount++;
+        if(pHeader->HetTablePos64 && pHeader->HetTableSize64)
+            Batch.dwItemCount++;
+        if(pHeader->BetTablePos64 && pHeader->BetTableSize64)
+            Batch.dwItemCount++;
+    }
+
+    // Verify the MPQ header, HET and BET table
+    if(bVerifyTables)
+    {
+        if(pHeader->dwHeaderSize >= (MPQ_HEADER_SIZE_V4 - MD5_DIGEST_SIZE))
+            VerifyRawTable(&Batch, "(mpq header)", SFILE_VERIFY_MPQ_HEADER);
+        if(pHeader->HetTablePos64 && pHeader->HetTableSize64)
+            VerifyRawTable(&Batch, "(het table)", SFILE_VERIFY_HET_TABLE);
+        if(pHeader->BetTablePos64 && pHeader->BetTableSize64)
+            VerifyRawTable(&Batch, "(bet table)", SFILE_VERIFY_BET_TABLE);
+    }
+
+    // Verify all files
+    ParallelForEach(ha, dwFileCount, VerifyBatchFile, &Batch);
+
+    if(Batch.pOrder != NULL)
+        STORM_FREE(Batch.pOrder);
+    return (Batch.dwFailedCount != 0) ? ERROR_FILE_CORRUPT : ERROR_SUCCESS;
+}
+
 // Verifies raw data of the archive Only works for MPQs version 4 or newer
 DWORD WINAPI SFileVerifyRawData(HANDLE hMpq, DWORD dwWhatToVerify, const char * szFileName)
 {
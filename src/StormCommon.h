@@ -218,6 +218,17 @@ void StringCat(TCHAR * szTarget, size_t cchTargetMax, const char * szSource);
 #define MPQ_HASH_FILE_KEY       0x300
 #define MPQ_HASH_KEY2_MIX       0x400
 
+#define MPQ_CRYPT_LANES         4           // Number of data blocks that are encrypted/decrypted together
+
+// Describes one data block for EncryptMpqBlocks/DecryptMpqBlocks
+typedef struct _TMPQCryptBlock
+{
+    void * pvDataBlock;                     // Pointer to the data. Doesn't need to be aligned
+    DWORD dwLength;                         // Length of the data, in bytes
+    DWORD dwKey;                            // Encryption key of the block
+
+} TMPQCryptBlock;
+
 DWORD HashString(const char * szFileName, DWORD dwHashType);
 DWORD HashStringSlash(const char * szFileName, DWORD dwHashType);
 DWORD HashStringLower(const char * szFileName, DWORD dwHashType);
@@ -233,6 +244,8 @@ DWORD GetDefaultSpecialFileFlags(DWORD dwFileSize, USHORT wFormatVersion);
 
 void  EncryptMpqBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey);
 void  DecryptMpqBlock(void * pvDataBlock, DWORD dwLength, DWORD dwKey);
+void  EncryptMpqBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount);
+void  DecryptMpqBlocks(TMPQCryptBlock * pBlocks, DWORD dwBlockCount);
 
 DWORD DetectFileKeyBySectorSize(LPDWORD EncryptedData, DWORD dwSectorSize, DWORD dwSectorOffsLen);
 DWORD DetectFileKeyByContent(void * pvEncryptedData, DWORD dwSectorSize, DWORD dwFileSize);
@@ -272,7 +285,10 @@ TMPQBetTable * LoadBetTable(TMPQArchive * ha);
 TMPQBlock * LoadBlockTable(TMPQArchive * ha, bool bDontFixEntries = false);
 TMPQBlock * TranslateBlockTable(TMPQArchive * ha, ULONGLONG * pcbTableSize, bool * pbNeedHiBlockTable);
 
+ULONGLONG GetFileDataEnd(TMPQArchive * ha, TFileEntry * pFileEntry);
 ULONGLONG FindFreeMpqSpace(TMPQArchive * ha);
+void UpdateFreeMpqSpace(TMPQArchive * ha, TFileEntry * pFileEntry);
+void InvalidateFreeMpqSpace(TMPQArchive * ha);
 
 // Functions that load the HET and BET tables
 DWORD CreateHashTable(TMPQArchive * ha, DWORD dwHashTableSize);
@@ -337,6 +353,8 @@ DWORD WriteSectorOffsets(TMPQFile * hf);
 DWORD WriteSectorChecksums(TMPQFile * hf);
 DWORD WriteMemDataMD5(TFileStream * pStream, ULONGLONG RawDataOffs, void * pvRawData, DWORD dwRawDataSize, DWORD dwChunkSize, LPDWORD pcbTotalSize);
 DWORD WriteMpqDataMD5(TFileStream * pStream, ULONGLONG RawDataOffs, DWORD dwRawDataSize, DWORD dwChunkSize);
+void InvalidateSectorCache(TMPQArchive * ha);
+void FreeSectorCache(TMPQArchive * ha);
 void FreeFileHandle(TMPQFile *& hf);
 void FreeArchiveHandle(TMPQArchive *& ha);
 
@@ -359,12 +377,26 @@ bool IsIncrementalPatchFile(const void * pvData, DWORD cbData, LPDWORD pdwPatche
 DWORD Patch_InitPatcher(TMPQPatcher * pPatcher, TMPQFile * hf);
 DWORD Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf);
 void Patch_Finalize(TMPQPatcher * pPatcher);
+bool QueryPatchCache(TMPQFile * hf);
+void InsertPatchCache(TMPQFile * hf);
+void InvalidatePatchCache(TMPQArchive * ha);
+void FreePatchCache(TMPQArchive * ha);
 
 //-----------------------------------------------------------------------------
 // Utility functions
 
 bool IsInternalMpqFileName(const char * szFileName);
 
+// An item sorted by the position of its data in the archive
+typedef struct _TMPQOffsetOrder
+{
+    ULONGLONG ByteOffset;                       // Position of the item data in the archive
+    TFileEntry * pFileEntry;                    // File entry of the item (NULL if none)
+    DWORD dwIndex;                              // Index of the item in the file table or in the caller's array
+} TMPQOffsetOrder;
+
+void SortByByteOffset(TMPQOffsetOrder * pOrder, DWORD dwItemCount);
+
 template <typename XCHAR>
 const XCHAR * GetPlainFileName(const XCHAR * szFileName)
 {
@@ -380,6 +412,17 @@ const XCHAR * GetPlainFileName(const XCHAR * szFileName)
     return szPlainName;
 }
 
+//-----------------------------------------------------------------------------
+// Support for worker threads
+
+// Processes one item of the work. Called from multiple threads at once
+typedef DWORD (*PARALLEL_WORK)(void * pvContext, DWORD dwItemIndex);
+
+#define MAX_THREAD_COUNT 64                     // Maximum number of threads working on one archive
+
+void SetArchiveThreadCount(TMPQArchive * ha, DWORD dwThreadCount);
+DWORD ParallelForEach(TMPQArchive * ha, DWORD dwItemCount, PARALLEL_WORK pfnWork, void * pvContext);
+
 //-----------------------------------------------------------------------------
 // Internal support for MPQ modifications
 
@@ -410,6 +453,11 @@ DWORD SFileAddFile_Finish(
     TMPQFile * hf
     );
 
+//-----------------------------------------------------------------------------
+// Archive compacting
+
+DWORD ResumeCompactArchive(TMPQArchive * ha);
+
 //-----------------------------------------------------------------------------
 // Attributes support
 
@@ -436,6 +484,7 @@ void DumpMpqHeader(TMPQHeader * pHeader);
 void DumpHashTable(TMPQHash * pHashTable, DWORD dwHashTableSize);
 void DumpHetAndBetTable(TMPQHetTable * pHetTable, TMPQBetTable * pBetTable);
 void DumpFileTable(TFileEntry * pFileTable, DWORD dwFileTableSize);
+void DumpStaleJournal(const TCHAR * szJournalFile);
 
 #else
 
@@ -443,6 +492,7 @@ void DumpFileTable(TFileEntry * pFileTable, DWORD dwFileTableSize);
 #define DumpHashTable(t, s)         /* */
 #define DumpHetAndBetTable(t, s)    /* */
 #define DumpFileTable(t, s)         /* */
+#define DumpStaleJournal(f)         /* */
 
 #endif
 
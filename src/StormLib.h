@@ -162,6 +162,7 @@ extern "C" {
 #define ERROR_UNKNOWN_FILE_NAMES         10007  // A name of at least one file is unknown
 #define ERROR_CANT_FIND_PATCH_PREFIX     10008  // StormLib was unable to find patch prefix for the patches
 #define ERROR_FAKE_MPQ_HEADER            10009  // The header at this position is fake header
+#define ERROR_COMPACT_INCOMPLETE         10010  // The archive is being compacted in place. Open it with write access to finish it
 
 // Values for SFileCreateArchive
 #define HASH_TABLE_SIZE_MIN         0x00000004  // Verified: If there is 1 file, hash table size is 4
@@ -204,6 +205,8 @@ extern "C" {
 #define MPQ_FLAG_ATTRIBUTES_NEW     0x00008000  // Set when (attributes) invalidated by InvalidateInternalFiles
 #define MPQ_FLAG_SIGNATURE_NONE     0x00010000  // Set when no (signature) was found in InvalidateInternalFiles
 #define MPQ_FLAG_SIGNATURE_NEW      0x00020000  // Set when (signature) invalidated by InvalidateInternalFiles
+#define MPQ_FLAG_DEDUPLICATE        0x00040000  // SFileAddFiles stores identical unencrypted files only once
+#define MPQ_FLAG_FLUSH_TABLES       0x00080000  // SaveMPQTables flushes the tables to the disk before the header points to them
 
 // Values for TMPQArchive::dwSubType
 #define MPQ_SUBTYPE_MPQ             0x00000000  // The file is a MPQ file (Blizzard games)
@@ -281,6 +284,7 @@ extern "C" {
 #define MPQ_COMPRESSION_ADPCM_STEREO      0x80  // IMA ADPCM compression (stereo)
 #define MPQ_COMPRESSION_LZMA              0x12  // LZMA compression. Added in Starcraft 2. This value is NOT a combination of flags.
 #define MPQ_COMPRESSION_NEXT_SAME   0xFFFFFFFF  // Same compression
+#define MPQ_COMPRESSION_AUTO        0xFFFFFFFE  // Compression is chosen by trial compression of the file data
 
 // Constants for SFileAddWave
 #define MPQ_WAVE_QUALITY_HIGH                0  // Best quality, the worst compression
@@ -491,9 +495,14 @@ typedef enum _SFileInfoClass
 #define CCB_COMPACTING_FILES                4   // Compacting archive (dwParam1 = current, dwParam2 = total)
 #define CCB_CLOSING_ARCHIVE                 5   // Closing archive: No params used
 
+// Flags for SFileCompactArchiveEx
+#define SFILE_COMPACT_IN_PLACE     0x00000001   // Move the file data within the archive instead of copying it to a temporary file
+
 typedef void (WINAPI * SFILE_DOWNLOAD_CALLBACK)(void * pvUserData, ULONGLONG ByteOffset, DWORD dwTotalBytes);
 typedef void (WINAPI * SFILE_ADDFILE_CALLBACK)(void * pvUserData, DWORD dwBytesWritten, DWORD dwTotalBytes, bool bFinalCall);
 typedef void (WINAPI * SFILE_COMPACT_CALLBACK)(void * pvUserData, DWORD dwWorkType, ULONGLONG BytesProcessed, ULONGLONG TotalBytes);
+typedef void (WINAPI * SFILE_EXTRACT_CALLBACK)(void * pvUserData, const char * szArchivedName, DWORD dwErrCode, DWORD dwFilesDone, DWORD dwFileCount);
+typedef void (WINAPI * SFILE_VERIFY_CALLBACK)(void * pvUserData, const char * szFileName, DWORD dwFileIndex, DWORD dwVerifyResult, DWORD dwItemsDone, DWORD dwItemCount);
 
 typedef struct TFileStream TFileStream;
 typedef struct TMPQBits TMPQBits;
@@ -703,6 +712,7 @@ typedef struct _TFileEntry
     DWORD     dwFlags;                          // File flags (from block table)
     DWORD     dwCrc32;                          // CRC32 from (attributes) file. 0 if not present.
     BYTE      md5[MD5_DIGEST_SIZE];             // File MD5 from the (attributes) file. 0 if not present.
+    DWORD     dwCurrentAttrs;                   // MPQ_ATTRIBUTE_CRC32/MD5 calculated from the current file data. 0 if not known.
     char * szFileName;                          // File name. NULL if not known.
 } TFileEntry;
 
@@ -822,6 +832,42 @@ typedef struct _TMPQNameCache
 
 } TMPQNameCache;
 
+// Compression settings, see SFileSetCompressionParams and SCompCompressEx
+// Zero in any member means the default value
+typedef struct _SFILE_COMPRESSION_PARAMS
+{
+    int nZlibLevel;                             // zlib compression level (1-9). Default is 6
+    int nZlibStrategy;                          // zlib strategy (Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED). Default is Z_DEFAULT_STRATEGY
+    int nBzip2BlockSize;                        // bzip2 block size, in 100 KB units (1-9). Default is 9
+    int nLzmaLevel;                             // LZMA compression level (1-9). Default is 5
+    DWORD dwLzmaDictSize;                       // LZMA dictionary size, in bytes. Default depends on the LZMA level
+
+} SFILE_COMPRESSION_PARAMS, *PSFILE_COMPRESSION_PARAMS;
+
+// Statistics of the sector cache, see SFileGetSectorCacheStats
+typedef struct _SFILE_SECTOR_CACHE_STATS
+{
+    ULONGLONG CacheSize;                        // Maximum size of the cache, in bytes
+    ULONGLONG BytesUsed;                        // Number of bytes occupied by cached sectors
+    ULONGLONG Hits;                             // Number of sectors served from the cache
+    ULONGLONG Misses;                           // Number of sectors that had to be loaded from the archive
+    ULONGLONG Evictions;                        // Number of sectors removed to make space for new ones
+    DWORD dwEntries;                            // Number of sectors currently in the cache
+
+} SFILE_SECTOR_CACHE_STATS, *PSFILE_SECTOR_CACHE_STATS;
+
+// Statistics of the patched file cache, see SFileGetPatchCacheStats
+typedef struct _SFILE_PATCH_CACHE_STATS
+{
+    ULONGLONG CacheSize;                        // Maximum size of the cache, in bytes
+    ULONGLONG BytesUsed;                        // Number of bytes occupied by cached files
+    ULONGLONG Hits;                             // Number of patched files served from the cache
+    ULONGLONG Misses;                           // Number of patched files that had to be patched
+    ULONGLONG Evictions;                        // Number of files removed to make space for new ones
+    DWORD dwEntries;                            // Number of files currently in the cache
+
+} SFILE_PATCH_CACHE_STATS, *PSFILE_PATCH_CACHE_STATS;
+
 // Archive handle structure
 typedef struct _TMPQArchive
 {
@@ -831,6 +877,8 @@ typedef struct _TMPQArchive
     ULONGLONG      MpqPos;                      // MPQ header offset (relative to the begin of the file)
     ULONGLONG      FileSize;                    // Size of the file at the moment of file open
     ULONGLONG      FileOffsetMask;              // 0xFFFFFFFF for MPQ v 1, otherwise 0xFFFFFFFFFFFFFFFFull
+    ULONGLONG      FreeSpacePos;                // End of file data, internal files excluded (0 = not known yet)
+    ULONGLONG      FreeSpacePosAll;             // End of file data, internal files included (0 = not known yet)
 
     struct _TMPQArchive * haPatch;              // Pointer to patch archive, if any
     struct _TMPQArchive * haBase;               // Pointer to base ("previous version") archive, if any
@@ -851,6 +899,7 @@ typedef struct _TMPQArchive
     DWORD          dwMaxFileCount;              // Maximum number of files in the MPQ. Also total size of the file table.
     DWORD          dwFileTableSize;             // Current size of the file table, e.g. index of the entry past the last occupied one
     DWORD          dwReservedFiles;             // Number of entries reserved for internal MPQ files (listfile, attributes)
+    DWORD          dwFirstFreeFile;             // Lowest index of a file entry that may be free. All entries below it are in use
     DWORD          dwSectorSize;                // Default size of one file sector
     DWORD          dwFileFlags1;                // Flags for (listfile)
     DWORD          dwFileFlags2;                // Flags for (attributes)
@@ -860,6 +909,11 @@ typedef struct _TMPQArchive
     DWORD          dwRealHashTableSize;         // Real size of the hash table, if MPQ_FLAG_HASH_TABLE_CUT is zet in dwFlags
     DWORD          dwFlags;                     // See MPQ_FLAG_XXXXX
     DWORD          dwSubType;                   // See MPQ_SUBTYPE_XXX
+    DWORD          dwThreadCount;               // Number of threads used for compressing file sectors (0 or 1 = no worker threads)
+    struct TThreadPool * pThreadPool;           // Worker threads of the archive (NULL = no worker threads)
+    SFILE_COMPRESSION_PARAMS CompressionParams; // Compression settings for newly added files
+    struct TSectorCache * pSectorCache;         // Cache of decompressed file sectors (NULL = disabled)
+    struct TPatchCache * pPatchCache;           // Cache of patched file data (NULL = disabled)
 
     SFILE_ADDFILE_CALLBACK pfnAddFileCB;        // Callback function for adding files
     void         * pvAddFileUserData;           // User data thats passed to the callback
@@ -868,6 +922,9 @@ typedef struct _TMPQArchive
     ULONGLONG      CompactBytesProcessed;       // Amount of bytes that have been processed during a particular compact call
     ULONGLONG      CompactTotalBytes;           // Total amount of bytes to be compacted
     void         * pvCompactUserData;           // User data thats passed to the callback
+
+    SFILE_EXTRACT_CALLBACK pfnExtractCB;        // Callback function for extracting files
+    void         * pvExtractUserData;           // User data thats passed to the callback
 } TMPQArchive;
 
 // File handle structure
@@ -892,6 +949,7 @@ typedef struct _TMPQFile
     LPBYTE         pbFileData;                  // Data of the file (single unit files, patched files)
     DWORD          cbFileData;                  // Size of file data
     DWORD          dwCompression0;              // Compression that will be used on the first file sector
+    DWORD          dwCompressionAuto;           // Compression chosen for MPQ_COMPRESSION_AUTO (valid if bCompressionAutoChosen)
     DWORD          dwSectorCount;               // Number of sectors in the file
     DWORD          dwPatchedFileSize;           // Size of patched file. Used when saving patch file to the MPQ
     DWORD          dwDataSize;                  // Size of data in the file (on patch files, this differs from file size in block table entry)
@@ -900,14 +958,21 @@ typedef struct _TMPQFile
     DWORD          dwSectorOffs;                // File position of currently loaded file sector
     DWORD          dwSectorSize;                // Size of the file sector. For single unit files, this is equal to the file size
 
+    LPBYTE         pbReadAhead;                 // Sectors loaded ahead of the current position for sequential reads
+    DWORD          dwReadAheadOffs;             // File position of the data in pbReadAhead
+    DWORD          dwReadAheadBytes;            // Number of valid bytes in pbReadAhead
+    DWORD          dwReadAheadNext;             // File position where the previous read ended. Used to detect sequential reads
+
     void         * hctx;                        // Hash state for MD5. Used when saving file to MPQ
     DWORD          dwCrc32;                     // CRC32 value, used when saving file to MPQ
 
     DWORD          dwAddFileError;              // Result of the "Add File" operations
+    SFILE_COMPRESSION_PARAMS CompressionParams; // Compression settings, used when saving file to MPQ
 
     bool           bLoadedSectorCRCs;           // If true, we already tried to load sector CRCs
     bool           bCheckSectorCRCs;            // If true, then SFileReadFile will check sector CRCs when reading the file
     bool           bIsWriteHandle;              // If true, this handle has been created by SFileCreateFile
+    bool           bCompressionAutoChosen;      // If true, dwCompressionAuto has been chosen. Zero means no compression
 } TMPQFile;
 
 // Structure for SFileFindFirstFile and SFileFindNextFile
@@ -943,6 +1008,28 @@ typedef struct _SFILE_CREATE_MPQ
 
 } SFILE_CREATE_MPQ, *PSFILE_CREATE_MPQ;
 
+// Structure for SFileAddFiles
+typedef struct _SFILE_ADD_FILE_ENTRY
+{
+    const TCHAR * szFileName;                   // Name of the local file to be added
+    const char * szArchivedName;                // Name of the file in the archive
+    DWORD dwFlags;                              // File flags (MPQ_FILE_XXX)
+    DWORD dwCompression;                        // Compression of the first sector (MPQ_COMPRESSION_XXX)
+    DWORD dwCompressionNext;                    // Compression of next sectors, or MPQ_COMPRESSION_NEXT_SAME
+    PSFILE_COMPRESSION_PARAMS pCompressionParams;   // Compression settings for this file. NULL = settings of the archive
+    DWORD dwCompressionUsed;                    // Receives the compression of the file data (the chosen one for MPQ_COMPRESSION_AUTO)
+    DWORD dwErrCode;                            // Receives the result of adding the file
+} SFILE_ADD_FILE_ENTRY, *PSFILE_ADD_FILE_ENTRY;
+
+// Structure for SFileExtractFiles
+typedef struct _SFILE_EXTRACT_FILE_ENTRY
+{
+    const char * szArchivedName;                // Name of the file in the archive
+    const TCHAR * szFileName;                   // Name of the local file to be created
+    DWORD dwSearchScope;                        // Search scope for SFileOpenFileEx (SFILE_OPEN_XXX)
+    DWORD dwErrCode;                            // Receives the result of extracting the file
+} SFILE_EXTRACT_FILE_ENTRY, *PSFILE_EXTRACT_FILE_ENTRY;
+
 typedef struct _SFILE_MARKERS
 {
     DWORD dwSize;                               // Size of this structure, in bytes
@@ -981,8 +1068,10 @@ bool FileStream_SetCallback(TFileStream * pStream, SFILE_DOWNLOAD_CALLBACK pfnCa
 
 bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap, DWORD * pcbLengthNeeded);
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead);
+bool FileStream_GetView(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwLength, const void ** ppvData);
 bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite);
 bool FileStream_SetSize(TFileStream * pStream, ULONGLONG NewFileSize);
+bool FileStream_Flush(TFileStream * pStream);
 bool FileStream_GetSize(TFileStream * pStream, ULONGLONG * pFileSize);
 bool FileStream_GetPos(TFileStream * pStream, ULONGLONG * pByteOffset);
 bool FileStream_GetTime(TFileStream * pStream, ULONGLONG * pFT);
@@ -1027,6 +1116,9 @@ bool   WINAPI SFileCreateArchive(const TCHAR * szMpqName, DWORD dwCreateFlags, D
 bool   WINAPI SFileCreateArchive2(const TCHAR * szMpqName, PSFILE_CREATE_MPQ pCreateInfo, HANDLE * phMpq);
 
 bool   WINAPI SFileSetDownloadCallback(HANDLE hMpq, SFILE_DOWNLOAD_CALLBACK DownloadCB, void * pvUserData);
+bool   WINAPI SFileSetThreadCount(HANDLE hMpq, DWORD dwThreadCount);
+bool   WINAPI SFileSetSectorCacheSize(HANDLE hMpq, ULONGLONG CacheSize);
+bool   WINAPI SFileGetSectorCacheStats(HANDLE hMpq, PSFILE_SECTOR_CACHE_STATS pStats);
 bool   WINAPI SFileFlushArchive(HANDLE hMpq);
 bool   WINAPI SFileCloseArchive(HANDLE hMpq);
 
@@ -1039,6 +1131,7 @@ DWORD  WINAPI SFileAddListFileEntries(HANDLE hMpq, const char ** listFileEntries
 // Archive compacting
 bool   WINAPI SFileSetCompactCallback(HANDLE hMpq, SFILE_COMPACT_CALLBACK CompactCB, void * pvUserData);
 bool   WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool bReserved);
+bool   WINAPI SFileCompactArchiveEx(HANDLE hMpq, const TCHAR * szListFile, DWORD dwCompactFlags);
 
 // Changing the maximum file count
 DWORD  WINAPI SFileGetMaxFileCount(HANDLE hMpq);
@@ -1054,16 +1147,25 @@ bool   WINAPI SFileUpdateFileAttributes(HANDLE hMpq, const char * szFileName);
 
 bool   WINAPI SFileOpenPatchArchive(HANDLE hMpq, const TCHAR * szPatchMpqName, const char * szPatchPathPrefix, DWORD dwFlags);
 bool   WINAPI SFileIsPatchedArchive(HANDLE hMpq);
+bool   WINAPI SFileSetPatchCacheSize(HANDLE hMpq, ULONGLONG CacheSize);
+bool   WINAPI SFileGetPatchCacheStats(HANDLE hMpq, PSFILE_PATCH_CACHE_STATS pStats);
 
 //-----------------------------------------------------------------------------
 // Functions for file manipulation
 
 // Reading from MPQ file
+// Multiple threads may open, read and close files of the same archive handle
+// at once, as long as each file handle is only used by one thread. Do not call
+// SFileSetLocale or any function that modifies the archive at the same time.
+// Only local and memory-mapped archives are read in parallel. Reads from an archive
+// opened through the block, partial, encrypted or HTTP providers are serialized
+// within that archive; other archives are not blocked by them.
 bool   WINAPI SFileHasFile(HANDLE hMpq, const char * szFileName);
 bool   WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, DWORD dwSearchScope, HANDLE * phFile);
 DWORD  WINAPI SFileGetFileSize(HANDLE hFile, LPDWORD pdwFileSizeHigh);
 DWORD  WINAPI SFileSetFilePointer(HANDLE hFile, LONG lFilePos, LONG * plFilePosHigh, DWORD dwMoveMethod);
 bool   WINAPI SFileReadFile(HANDLE hFile, void * lpBuffer, DWORD dwToRead, LPDWORD pdwRead, LPOVERLAPPED lpOverlapped);
+bool   WINAPI SFileGetFileView(HANDLE hFile, const void ** ppvFileData, LPDWORD pdwFileSize);
 bool   WINAPI SFileCloseFile(HANDLE hFile);
 
 // Retrieving info about a file in the archive
@@ -1073,6 +1175,8 @@ bool   WINAPI SFileFreeFileInfo(void * pvFileInfo, SFileInfoClass InfoClass);
 
 // High-level extract function
 bool   WINAPI SFileExtractFile(HANDLE hMpq, const char * szToExtract, const TCHAR * szExtracted, DWORD dwSearchScope);
+bool   WINAPI SFileExtractFiles(HANDLE hMpq, PSFILE_EXTRACT_FILE_ENTRY pFileEntries, DWORD dwEntryCount);
+bool   WINAPI SFileSetExtractCallback(HANDLE hMpq, SFILE_EXTRACT_CALLBACK ExtractCB, void * pvUserData);
 
 //-----------------------------------------------------------------------------
 // Functions for file and archive verification
@@ -1084,6 +1188,9 @@ bool   WINAPI SFileGetFileChecksums(HANDLE hMpq, const char * szFileName, LPDWOR
 // For dwFlags, use one or more of MPQ_ATTRIBUTE_MD5
 DWORD  WINAPI SFileVerifyFile(HANDLE hMpq, const char * szFileName, DWORD dwFlags);
 
+// Verifies all files in the archive (SFILE_VERIFY_XXX flags), reporting each result to the callback
+DWORD  WINAPI SFileVerifyAllFiles(HANDLE hMpq, DWORD dwFlags, SFILE_VERIFY_CALLBACK pfnVerifyCB, void * pvUserData);
+
 // Verifies raw data of the archive. Only works for MPQs version 4 or newer
 DWORD  WINAPI SFileVerifyRawData(HANDLE hMpq, DWORD dwWhatToVerify, const char * szFileName);
 
@@ -1115,12 +1222,16 @@ bool   WINAPI SFileFinishFile(HANDLE hFile);
 bool   WINAPI SFileAddFileEx(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags, DWORD dwCompression, DWORD dwCompressionNext);
 bool   WINAPI SFileAddFile(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags);
 bool   WINAPI SFileAddWave(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags, DWORD dwQuality);
+bool   WINAPI SFileAddFiles(HANDLE hMpq, PSFILE_ADD_FILE_ENTRY pFileEntries, DWORD dwEntryCount);
 bool   WINAPI SFileRemoveFile(HANDLE hMpq, const char * szFileName, DWORD dwSearchScope);
 bool   WINAPI SFileRenameFile(HANDLE hMpq, const char * szOldFileName, const char * szNewFileName);
 bool   WINAPI SFileSetFileLocale(HANDLE hFile, LCID lcNewLocale);
 bool   WINAPI SFileSetDataCompression(DWORD DataCompression);
+bool   WINAPI SFileSetCompressionParams(HANDLE hMpq, PSFILE_COMPRESSION_PARAMS pParams);
+bool   WINAPI SFileSetFileCompressionParams(HANDLE hFile, PSFILE_COMPRESSION_PARAMS pParams);
 
 bool   WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALLBACK AddFileCB, void * pvUserData);
+bool   WINAPI SFileSetDeduplication(HANDLE hMpq, bool bDeduplicate);
 
 //-----------------------------------------------------------------------------
 // Compression and decompression
@@ -1128,6 +1239,7 @@ bool   WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALLBACK AddFil
 int    WINAPI SCompImplode    (void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer);
 int    WINAPI SCompExplode    (void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer);
 int    WINAPI SCompCompress   (void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, unsigned uCompressionMask, int nCmpType, int nCmpLevel);
+int    WINAPI SCompCompressEx (void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer, unsigned uCompressionMask, int nCmpType, int nCmpLevel, PSFILE_COMPRESSION_PARAMS pParams);
 int    WINAPI SCompDecompress (void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer);
 int    WINAPI SCompDecompress2(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer, int cbInBuffer);
 
@@ -377,6 +377,7 @@
   #define _tprintf  printf
   #define _stprintf sprintf
   #define _tremove  remove
+  #define _trename  rename
   #define _tmain    main
 
   #define _stricmp  strcasecmp
@@ -390,7 +391,8 @@
 #if defined(STORMLIB_MAC)
   #define stat64  stat
   #define fstat64 fstat
-  #define lseek64 lseek
+  #define pread64 pread
+  #define pwrite64 pwrite
   #define ftruncate64 ftruncate
   #define off64_t off_t
   #define O_LARGEFILE 0
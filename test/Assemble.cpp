@@ -14,7 +14,12 @@
 #include <format>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include <codecvt>
+#include <thread>
+#include <atomic>
 #include <Windows.h>
 
 #define _CRT_NON_CONFORMING_SWPRINTFS
@@ -44,15 +49,6 @@
 
 static TLogHelper logger("Assembler");
 
-std::streampos GetFileSize(std::ifstream& inputFile) 
-{
-    std::streampos currentPosition = inputFile.tellg();
-    inputFile.seekg(0, std::ios::end);
-    std::streampos fileSize = inputFile.tellg();
-    inputFile.seekg(currentPosition, std::ios::beg);
-    return fileSize;
-}
-
 void DeleteMPQFileIfExists(auto filePath)
 {
     if (std::filesystem::exists(filePath)) 
@@ -61,6 +57,11 @@ void DeleteMPQFileIfExists(auto filePath)
         {
             std::filesystem::remove(filePath);
             logger.PrintMessage(std::format("Deleted existing MPQ: {}", filePath).c_str());
+
+            // The journal of an interrupted compaction belongs to the deleted MPQ
+            std::filesystem::path journalPath(filePath);
+            journalPath += ".journal";
+            std::filesystem::remove(journalPath);
         }
         catch (const std::filesystem::filesystem_error& ex) {
             logger.PrintMessage(std::format("Error occured while deleting MPQ: {}", ex.what()).c_str());
@@ -96,46 +97,677 @@ auto GetCompressionFlags(std::filesystem::path const& filePath)
     return writeFileFlags;
 }
 
-void AddFileToMPQ(auto hMpq, auto& logger, std::filesystem::path const& filePath, std::filesystem::path const& internalPath, bool patch = true)
+std::string GetCompressionName(DWORD compression)
 {
-    std::string progressString("Adding file ");
-    progressString += internalPath.string();
-    logger.PrintMessage(progressString.c_str());
+    switch (compression)
+    {
+        case 0:                                             return "none";
+        case MPQ_COMPRESSION_ZLIB:                          return "zlib";
+        case MPQ_COMPRESSION_PKWARE:                        return "pkware";
+        case MPQ_COMPRESSION_BZIP2:                         return "bzip2";
+        case MPQ_COMPRESSION_LZMA:                          return "lzma";
+        case MPQ_COMPRESSION_SPARSE | MPQ_COMPRESSION_ZLIB: return "sparse+zlib";
+        default:                                            return std::format("0x{:02X}", compression);
+    }
+}
 
-    std::ifstream inputFile(filePath, std::ios::binary);
+// Prints how many files were stored with each compression
+void PrintCompressionReport(auto& logger, std::vector<SFILE_ADD_FILE_ENTRY> const& entries)
+{
+    std::map<DWORD, size_t> fileCounts;
 
-    if (!inputFile.is_open())
+    for (auto const& entry : entries)
     {
-        auto error = std::string("Failed to open file ") + filePath.string();
-        logger.PrintError(error.c_str());
-        exit(0);
+        if (entry.dwErrCode == ERROR_SUCCESS)
+            fileCounts[entry.dwCompressionUsed]++;
     }
 
-    auto fileSize = GetFileSize(inputFile);
+    for (auto const& fileCount : fileCounts)
+        logger.PrintMessage(std::format("Compression {}: {} files", GetCompressionName(fileCount.first), fileCount.second).c_str());
+}
 
+void AddFilesToMPQ(auto hMpq, auto& logger, auto const& fileList, bool patch = true, bool autoCompress = false, bool replaceExisting = false, bool dedup = false)
+{
+    // Encrypted files can't share their data, because the key depends on the file name
     auto createFileFlags = MPQ_FILE_COMPRESS | MPQ_FILE_ENCRYPTED;
+    if (dedup)
+    {
+        createFileFlags &= ~MPQ_FILE_ENCRYPTED;
+        SFileSetDeduplication(hMpq, true);
+    }
     if (patch)
         createFileFlags |= MPQ_FILE_PATCH_FILE;
+    if (replaceExisting)
+        createFileFlags |= MPQ_FILE_REPLACEEXISTING;
 
-    auto writeFileFlags = GetCompressionFlags(internalPath);
+    // The entries only point to the names, so keep them alive until the files are added
+    std::vector<std::string> internalNames;
+    std::vector<SFILE_ADD_FILE_ENTRY> entries;
+    internalNames.reserve(fileList.size());
+    entries.reserve(fileList.size());
 
-    HANDLE hFile = NULL;
-    if (!SFileCreateFile(hMpq, internalPath.string().c_str(), 0, DWORD(fileSize), 0, createFileFlags, &hFile))
+    for (auto const& file : fileList)
     {
-        logger.PrintError("Failed to create file");
-        exit(0);
+        internalNames.emplace_back(file.second.string());
+
+        SFILE_ADD_FILE_ENTRY entry = {};
+        entry.szFileName = file.first.c_str();
+        entry.szArchivedName = internalNames.back().c_str();
+        entry.dwFlags = createFileFlags;
+        entry.dwCompression = autoCompress ? MPQ_COMPRESSION_AUTO : GetCompressionFlags(file.second);
+        entry.dwCompressionNext = MPQ_COMPRESSION_NEXT_SAME;
+        entries.push_back(entry);
     }
 
-    std::vector<char> buffer(fileSize);
-    inputFile.read(buffer.data(), fileSize);
+    logger.PrintMessage(std::format("Adding {} files", entries.size()).c_str());
 
-    if (!SFileWriteFile(hFile, buffer.data(), DWORD(fileSize), writeFileFlags))
+    // Files are compressed in parallel and stored in the order of the list
+    if (!SFileAddFiles(hMpq, entries.data(), DWORD(entries.size())))
     {
-        logger.PrintError("Failed to write file");
+        for (auto const& entry : entries)
+        {
+            if (entry.dwErrCode != ERROR_SUCCESS)
+                logger.PrintError(std::format("Failed to add file {} (error {})", entry.szArchivedName, entry.dwErrCode).c_str());
+        }
         exit(0);
     }
+
+    if (autoCompress)
+        PrintCompressionReport(logger, entries);
+}
+
+// Prints errors of the failed files and the progress every 1000 files
+void WINAPI ExtractCallback(void * pvUserData, const char * szArchivedName, DWORD dwErrCode, DWORD dwFilesDone, DWORD dwFileCount)
+{
+    auto& logger = *static_cast<TLogHelper *>(pvUserData);
+
+    if (dwErrCode != ERROR_SUCCESS)
+        logger.PrintError(std::format("Failed to extract file {} (error {})", szArchivedName, dwErrCode).c_str());
+    if ((dwFilesDone % 1000) == 0 || dwFilesDone == dwFileCount)
+        logger.PrintMessage(std::format("Extracted {} of {} files", dwFilesDone, dwFileCount).c_str());
+}
+
+// Extracts all files of the MPQ into the directory. The inverse of AddFilesToMPQ
+int ExtractFilesFromMPQ(std::filesystem::path const& mpqPath, std::filesystem::path const& directoryPath)
+{
+    HANDLE hMpq = nullptr;
+    if (!SFileOpenArchive(mpqPath.c_str(), 0, STREAM_FLAG_READ_ONLY, &hMpq))
+    {
+        logger.PrintError(std::format("Failed to open archive: {}", mpqPath.string()).c_str());
+        return 1;
+    }
+
+    // The entries only point to the names, so keep them alive until the files are extracted
+    std::vector<std::string> internalNames;
+    std::vector<std::filesystem::path> localPaths;
+    SFILE_FIND_DATA findData;
+
+    HANDLE hFind = SFileFindFirstFile(hMpq, "*", &findData, nullptr);
+    if (hFind != nullptr)
+    {
+        do
+        {
+            // The internal files are created by the archive itself
+            if (IsInternalMpqFileName(findData.cFileName))
+                continue;
+
+            std::string localName = findData.cFileName;
+            std::replace(localName.begin(), localName.end(), '\\', '/');
+
+            internalNames.emplace_back(findData.cFileName);
+            localPaths.emplace_back(directoryPath / localName);
+            std::filesystem::create_directories(localPaths.back().parent_path());
+        }
+        while (SFileFindNextFile(hFind, &findData));
+        SFileFindClose(hFind);
+    }
+
+    std::vector<SFILE_EXTRACT_FILE_ENTRY> entries(internalNames.size());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        entries[i].szArchivedName = internalNames[i].c_str();
+        entries[i].szFileName = localPaths[i].c_str();
+        entries[i].dwSearchScope = SFILE_OPEN_FROM_MPQ;
+    }
+
+    logger.PrintMessage(std::format("Extracting {} files", entries.size()).c_str());
+
+    // Files are read in the order of their data and decompressed in parallel
+    SFileSetThreadCount(hMpq, std::thread::hardware_concurrency());
+    SFileSetExtractCallback(hMpq, ExtractCallback, &logger);
+    bool result = SFileExtractFiles(hMpq, entries.data(), DWORD(entries.size()));
+
+    SFileCloseArchive(hMpq);
+    return result ? 0 : 1;
+}
+
+// Prints the files that failed the verification and the progress every 1000 files
+void WINAPI VerifyCallback(void * pvUserData, const char * szFileName, DWORD dwFileIndex, DWORD dwVerifyResult, DWORD dwItemsDone, DWORD dwItemCount)
+{
+    auto& logger = *static_cast<TLogHelper *>(pvUserData);
+
+    if (dwVerifyResult & VERIFY_FILE_ERROR_MASK)
+        logger.PrintError(std::format("Verification failed: {} (result 0x{:04X})", szFileName, dwVerifyResult).c_str());
+    if ((dwItemsDone % 1000) == 0 || dwItemsDone == dwItemCount)
+        logger.PrintMessage(std::format("Verified {} of {} files", dwItemsDone, dwItemCount).c_str());
+}
+
+// Verifies checksums of all files in the MPQ
+int VerifyMPQ(std::filesystem::path const& mpqPath)
+{
+    HANDLE hMpq = nullptr;
+    if (!SFileOpenArchive(mpqPath.c_str(), 0, STREAM_FLAG_READ_ONLY, &hMpq))
+    {
+        logger.PrintError(std::format("Failed to open archive: {}", mpqPath.string()).c_str());
+        return 1;
+    }
+
+    // Files are read in the order of their data and verified in parallel
+    SFileSetThreadCount(hMpq, std::thread::hardware_concurrency());
+    DWORD dwErrCode = SFileVerifyAllFiles(hMpq, SFILE_VERIFY_ALL, VerifyCallback, &logger);
+
+    SFileCloseArchive(hMpq);
+    return (dwErrCode == ERROR_SUCCESS) ? 0 : 1;
 }
 
+// Reads the whole file from the MPQ. Returns false if the file can't be opened or read
+bool ReadArchivedFile(HANDLE hMpq, const char * fileName, std::vector<BYTE>& fileData)
+{
+    HANDLE hFile = nullptr;
+    if (!SFileOpenFileEx(hMpq, fileName, SFILE_OPEN_FROM_MPQ, &hFile))
+        return false;
+
+    DWORD bytesRead = 0;
+    fileData.resize(SFileGetFileSize(hFile, nullptr));
+    bool result = SFileReadFile(hFile, fileData.data(), DWORD(fileData.size()), &bytesRead, nullptr) && bytesRead == fileData.size();
+    SFileCloseFile(hFile);
+    return result;
+}
+
+// Reads all files of the MPQ from many threads at once, all through the same archive handle,
+// and compares the data with the data read by a single thread
+int StressReadMPQ(std::filesystem::path const& mpqPath, unsigned threadCount, unsigned roundCount)
+{
+    HANDLE hMpq = nullptr;
+    if (!SFileOpenArchive(mpqPath.c_str(), 0, STREAM_FLAG_READ_ONLY, &hMpq))
+    {
+        logger.PrintError(std::format("Failed to open archive: {}", mpqPath.string()).c_str());
+        return 1;
+    }
+
+    std::vector<std::string> fileNames;
+    std::vector<std::vector<BYTE>> fileData;
+    SFILE_FIND_DATA findData;
+
+    HANDLE hFind = SFileFindFirstFile(hMpq, "*", &findData, nullptr);
+    if (hFind != nullptr)
+    {
+        do
+        {
+            fileNames.emplace_back(findData.cFileName);
+        }
+        while (SFileFindNextFile(hFind, &findData));
+        SFileFindClose(hFind);
+    }
+
+    // The reference data are read by one thread
+    fileData.resize(fileNames.size());
+    for (size_t i = 0; i < fileNames.size(); i++)
+    {
+        if (!ReadArchivedFile(hMpq, fileNames[i].c_str(), fileData[i]))
+        {
+            logger.PrintError(std::format("Failed to read file: {}", fileNames[i]).c_str());
+            SFileCloseArchive(hMpq);
+            return 1;
+        }
+    }
+
+    logger.PrintMessage(std::format("Reading {} files from {} threads, {} rounds", fileNames.size(), threadCount, roundCount).c_str());
+
+    // Each thread starts at a different file, so that they read different parts of the archive at once
+    std::atomic<unsigned> failedCount = 0;
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < threadCount; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::vector<BYTE> data;
+            for (size_t n = 0; n < fileNames.size() * roundCount; n++)
+            {
+                size_t i = (n + t * fileNames.size() / threadCount) % fileNames.size();
+                if (!ReadArchivedFile(hMpq, fileNames[i].c_str(), data) || data != fileData[i])
+                {
+                    logger.PrintError(std::format("Data mismatch in thread {}: {}", t, fileNames[i]).c_str());
+                    failedCount++;
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    SFileCloseArchive(hMpq);
+    logger.PrintMessage(std::format("Stress test done, {} failed reads", failedCount.load()).c_str());
+    return (failedCount == 0) ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Self tests of the library. The archives are created in the temporary directory
+
+// Reads the whole local file
+std::vector<BYTE> ReadLocalFile(std::filesystem::path const& filePath)
+{
+    std::ifstream file(filePath, std::ios::binary);
+    return std::vector<BYTE>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Writes a file with data that compress well, but not too well
+void WriteTestFile(std::filesystem::path const& filePath, size_t fileSize)
+{
+    std::ofstream file(filePath, std::ios::binary);
+    unsigned seed = 1;
+    for (size_t i = 0; i < fileSize; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        file.put(static_cast<char>((i % 3) ? 'a' + (seed >> 16) % 5 : (seed >> 8) & 0xFF));
+    }
+}
+
+// Adds a file with different compressions of the first and the next sectors,
+// once by one thread and once by four threads. The archives must be byte-identical
+bool TestThreadedAddIsIdentical(std::filesystem::path const& tempPath)
+{
+    auto sourcePath = tempPath / "StormTest_Source.bin";
+    std::vector<BYTE> archiveData[2];
+
+    WriteTestFile(sourcePath, 400000);
+    for (int i = 0; i < 2; i++)
+    {
+        auto mpqPath = tempPath / std::format("StormTest_Threads{}.mpq", i);
+        SFILE_CREATE_MPQ createInfo = {};
+        HANDLE hMpq = nullptr;
+
+        DeleteMPQFileIfExists(mpqPath);
+        createInfo.cbSize = sizeof(SFILE_CREATE_MPQ);
+        createInfo.dwMpqVersion = MPQ_FORMAT_VERSION_1;
+        createInfo.dwStreamFlags = STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE;
+        createInfo.dwSectorSize = 0x4000;
+        createInfo.dwMaxFileCount = 16;
+        if (!SFileCreateArchive2(mpqPath.c_str(), &createInfo, &hMpq))
+            return false;
+
+        SFileSetThreadCount(hMpq, (i == 0) ? 1 : 4);
+        bool added = SFileAddFileEx(hMpq, sourcePath.c_str(), "Source.bin", MPQ_FILE_COMPRESS, MPQ_COMPRESSION_PKWARE, MPQ_COMPRESSION_ZLIB);
+        SFileCloseArchive(hMpq);
+        if (!added)
+            return false;
+
+        archiveData[i] = ReadLocalFile(mpqPath);
+        std::filesystem::remove(mpqPath);
+    }
+
+    std::filesystem::remove(sourcePath);
+    return !archiveData[0].empty() && archiveData[0] == archiveData[1];
+}
+
+// Checks that EncryptMpqBlocks and DecryptMpqBlocks (which process several blocks
+// interleaved) give the same result as EncryptMpqBlock and DecryptMpqBlock.
+// The blocks have different lengths (including those not divisible by 4) and are unaligned
+bool TestCryptBlocksBitExact(std::filesystem::path const&)
+{
+    const DWORD lengths[] = {0x1003, 0x40, 7, 0x1000, 0, 4, 0x333};
+    const DWORD blockCount = sizeof(lengths) / sizeof(lengths[0]);
+    TMPQCryptBlock blocks[blockCount];
+    std::vector<BYTE> data1(0x3000);
+    std::vector<BYTE> data2;
+    unsigned seed = 0x12345678;
+    size_t offset = 1;
+
+    // The second copy is processed by the single-block functions
+    for (auto& oneByte : data1)
+        oneByte = static_cast<BYTE>((seed = seed * 1103515245 + 12345) >> 16);
+    data2 = data1;
+
+    for (DWORD i = 0; i < blockCount; i++)
+    {
+        blocks[i].pvDataBlock = data1.data() + offset;
+        blocks[i].dwLength = lengths[i];
+        blocks[i].dwKey = 0x9E3779B9 * (i + 1);
+        offset += lengths[i] + 1;
+    }
+
+    // Compare encryption, then decryption of the encrypted data
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 0)
+            EncryptMpqBlocks(blocks, blockCount);
+        else
+            DecryptMpqBlocks(blocks, blockCount);
+
+        for (DWORD i = 0; i < blockCount; i++)
+        {
+            LPBYTE block2 = data2.data() + (static_cast<LPBYTE>(blocks[i].pvDataBlock) - data1.data());
+
+            if (pass == 0)
+                EncryptMpqBlock(block2, blocks[i].dwLength, blocks[i].dwKey);
+            else
+                DecryptMpqBlock(block2, blocks[i].dwLength, blocks[i].dwKey);
+        }
+
+        if (data1 != data2)
+            return false;
+    }
+    return true;
+}
+
+// Puts a journal that belongs to another archive next to the MPQ.
+// The MPQ must still open, both for writing and read-only
+bool TestStaleJournalIsIgnored(std::filesystem::path const& tempPath)
+{
+    auto sourcePath = tempPath / "StormTest_Source.bin";
+    auto mpqPath = tempPath / "StormTest_StaleJournal.mpq";
+    auto journalPath = tempPath / "StormTest_StaleJournal.mpq.journal";
+    auto stalePath = tempPath / "StormTest_StaleJournal.mpq.journal.stale";
+    HANDLE hMpq = nullptr;
+    bool passed = true;
+
+    DeleteMPQFileIfExists(mpqPath);
+    std::filesystem::remove(stalePath);
+    WriteTestFile(sourcePath, 100000);
+    if (!SFileCreateArchive(mpqPath.c_str(), MPQ_CREATE_ARCHIVE_V1, 16, &hMpq))
+        return false;
+    passed = SFileAddFileEx(hMpq, sourcePath.c_str(), "Source.bin", MPQ_FILE_COMPRESS, MPQ_COMPRESSION_ZLIB, MPQ_COMPRESSION_NEXT_SAME);
+    SFileCloseArchive(hMpq);
+
+    for (int i = 0; i < 2 && passed; i++)
+    {
+        // The journal of an archive with other files: valid signature, other tables
+        WriteTestFile(journalPath, 200);
+        {
+            std::fstream journal(journalPath, std::ios::binary | std::ios::in | std::ios::out);
+            DWORD signature = 0x4A51504D;
+            journal.write(reinterpret_cast<const char*>(&signature), sizeof(signature));
+        }
+
+        passed = SFileOpenArchive(mpqPath.c_str(), 0, (i == 0) ? 0 : STREAM_FLAG_READ_ONLY, &hMpq);
+        if (passed)
+        {
+            passed = SFileHasFile(hMpq, "Source.bin");
+            SFileCloseArchive(hMpq);
+        }
+
+        // A writable open renames the journal, a read-only one leaves it
+        if (i == 0)
+            passed = passed && !std::filesystem::exists(journalPath) && std::filesystem::exists(stalePath);
+        else
+            passed = passed && std::filesystem::exists(journalPath);
+    }
+
+    DeleteMPQFileIfExists(mpqPath);
+    std::filesystem::remove(stalePath);
+    std::filesystem::remove(sourcePath);
+    return passed && !std::filesystem::exists(journalPath);
+}
+
+int RunSelfTests()
+{
+    auto tempPath = std::filesystem::temp_directory_path();
+    std::pair<const char *, bool (*)(std::filesystem::path const&)> tests[] =
+    {
+        {"Threaded add is identical to serial add", TestThreadedAddIsIdentical},
+        {"Multi-block encryption is identical to single-block", TestCryptBlocksBitExact},
+        {"Stale compaction journal is ignored", TestStaleJournalIsIgnored},
+    };
+    int failedCount = 0;
+
+    for (auto const& test : tests)
+    {
+        bool passed = test.second(tempPath);
+        if (passed)
+            logger.PrintMessage(std::format("Passed: {}", test.first).c_str());
+        else
+            logger.PrintError(std::format("Failed: {}", test.first).c_str());
+        failedCount += passed ? 0 : 1;
+    }
+
+    logger.PrintMessage(std::format("Self tests done, {} failed", failedCount).c_str());
+    return (failedCount == 0) ? 0 : 1;
+}
+
+// Archived names are case insensitive and both slashes are the same
+std::string GetArchivedNameKey(std::string name)
+{
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+        return static_cast<char>(c == '/' ? '\\' : std::toupper(c));
+    });
+    return name;
+}
+
+// Calculates CRC32 and MD5 of a local file
+bool GetLocalFileChecksums(std::filesystem::path const& filePath, DWORD& crc, BYTE (&md5)[MD5_DIGEST_SIZE])
+{
+    std::ifstream file(filePath, std::ios::binary);
+    if (!file)
+        return false;
+
+    std::vector<char> buffer(0x100000);
+    hash_state md5State;
+    md5_init(&md5State);
+    crc = crc32(0, Z_NULL, 0);
+
+    while (file)
+    {
+        file.read(buffer.data(), buffer.size());
+        auto bytesRead = static_cast<unsigned long>(file.gcount());
+        if (bytesRead == 0)
+            break;
+
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(buffer.data()), bytesRead);
+        md5_process(&md5State, reinterpret_cast<const unsigned char *>(buffer.data()), bytesRead);
+    }
+
+    md5_done(&md5State, md5);
+    return !file.bad();
+}
+
+// Checks whether the local file differs from the file in the MPQ.
+// The file time comes from (attributes); if it differs, the content is compared by CRC32 and MD5
+bool IsFileChanged(HANDLE hMpq, std::filesystem::path const& filePath, SFILE_FIND_DATA const& findData)
+{
+    std::error_code ec;
+    auto fileSize = std::filesystem::file_size(filePath, ec);
+    if (ec || fileSize != findData.dwFileSize)
+        return true;
+
+    // Same size and time as when the file was added
+    ULONGLONG archivedTime = (ULONGLONG(findData.dwFileTimeHi) << 32) | findData.dwFileTimeLo;
+    ULONGLONG localTime = 0;
+    if (TFileStream * pStream = FileStream_OpenFile(filePath.c_str(), STREAM_FLAG_READ_ONLY))
+    {
+        FileStream_GetTime(pStream, &localTime);
+        FileStream_Close(pStream);
+    }
+    if (archivedTime != 0 && archivedTime == localTime)
+        return false;
+
+    // Get the checksums stored in the MPQ. The entry is followed by the file name
+    std::vector<BYTE> entryBuffer(sizeof(TFileEntry) + MAX_PATH);
+    HANDLE hFile = nullptr;
+    bool hasEntry = false;
+    if (SFileOpenFileEx(hMpq, findData.cFileName, SFILE_OPEN_FROM_MPQ, &hFile))
+    {
+        hasEntry = SFileGetFileInfo(hFile, SFileInfoFileEntry, entryBuffer.data(), DWORD(entryBuffer.size()), nullptr);
+        SFileCloseFile(hFile);
+    }
+
+    auto& fileEntry = *reinterpret_cast<TFileEntry *>(entryBuffer.data());
+    if (!hasEntry || (fileEntry.dwCrc32 == 0 && !IsValidMD5(fileEntry.md5)))
+        return true;
+
+    DWORD crc = 0;
+    BYTE md5[MD5_DIGEST_SIZE];
+    if (!GetLocalFileChecksums(filePath, crc, md5))
+        return true;
+
+    if (fileEntry.dwCrc32 != 0 && fileEntry.dwCrc32 != crc)
+        return true;
+    if (IsValidMD5(fileEntry.md5) && memcmp(fileEntry.md5, md5, MD5_DIGEST_SIZE))
+        return true;
+    return false;
+}
+
+// Returns the percentage of the archive that is not used by any file
+ULONGLONG GetWastedSpacePercent(HANDLE hMpq)
+{
+    ULONGLONG archiveSize = 0;
+    ULONGLONG usedSize = 0;
+    DWORD hashTableSize = 0;
+    DWORD blockTableSize = 0;
+    SFILE_FIND_DATA findData;
+
+    SFileGetFileInfo(hMpq, SFileMpqArchiveSize64, &archiveSize, sizeof(archiveSize), nullptr);
+    SFileGetFileInfo(hMpq, SFileMpqHashTableSize, &hashTableSize, sizeof(hashTableSize), nullptr);
+    SFileGetFileInfo(hMpq, SFileMpqBlockTableSize, &blockTableSize, sizeof(blockTableSize), nullptr);
+    usedSize = ULONGLONG(hashTableSize) * sizeof(TMPQHash) + ULONGLONG(blockTableSize) * sizeof(TMPQBlock);
+
+    // Deduplicated files share their data, so each byte offset is only counted once
+    std::set<ULONGLONG> countedOffsets;
+    HANDLE hFind = SFileFindFirstFile(hMpq, "*", &findData, nullptr);
+    if (hFind != nullptr)
+    {
+        do
+        {
+            ULONGLONG byteOffset = 0;
+            HANDLE hFile = nullptr;
+            bool knownOffset = false;
+
+            if (SFileOpenFileEx(hMpq, findData.cFileName, SFILE_OPEN_FROM_MPQ, &hFile))
+            {
+                knownOffset = SFileGetFileInfo(hFile, SFileInfoByteOffset, &byteOffset, sizeof(byteOffset), nullptr);
+                SFileCloseFile(hFile);
+            }
+
+            if (!knownOffset || countedOffsets.insert(byteOffset).second)
+                usedSize += findData.dwCompSize;
+        }
+        while (SFileFindNextFile(hFind, &findData));
+        SFileFindClose(hFind);
+    }
+
+    if (archiveSize == 0 || usedSize >= archiveSize)
+        return 0;
+    return (archiveSize - usedSize) * 100 / archiveSize;
+}
+
+// Returned by UpdateMPQ when the MPQ can't be updated and has to be built again
+constexpr int UPDATE_NEEDS_REBUILD = -1;
+
+// Updates an existing MPQ from the directory: adds new and changed files, removes the deleted ones.
+// If compactThreshold is nonzero, the MPQ is compacted when at least that percentage of it is wasted
+int UpdateMPQ(std::filesystem::path const& mpqPath, auto const& fileList, int compressionLevel, bool autoCompress, int compactThreshold, bool dedup)
+{
+    HANDLE hMpq = nullptr;
+    if (!SFileOpenArchive(mpqPath.c_str(), 0, 0, &hMpq))
+    {
+        logger.PrintError(std::format("Failed to open archive: {}", mpqPath.string()).c_str());
+        return 1;
+    }
+
+    SFileSetThreadCount(hMpq, std::thread::hardware_concurrency());
+
+    if (compressionLevel != 0)
+    {
+        SFILE_COMPRESSION_PARAMS compressionParams = {};
+        compressionParams.nZlibLevel = compressionLevel;
+        SFileSetCompressionParams(hMpq, &compressionParams);
+    }
+
+    // Collect the files that are already in the MPQ
+    std::map<std::string, SFILE_FIND_DATA> archivedFiles;
+    SFILE_FIND_DATA findData;
+    size_t unknownCount = 0;
+
+    HANDLE hFind = SFileFindFirstFile(hMpq, "*", &findData, nullptr);
+    if (hFind != nullptr)
+    {
+        do
+        {
+            if (IsPseudoFileName(findData.cFileName, nullptr))
+                unknownCount++;
+            else if (!IsInternalMpqFileName(findData.cFileName))
+                archivedFiles[GetArchivedNameKey(findData.cFileName)] = findData;
+        }
+        while (SFileFindNextFile(hFind, &findData));
+        SFileFindClose(hFind);
+    }
+
+    // Without a (listfile), the files can't be matched with the directory
+    if (unknownCount != 0)
+    {
+        logger.PrintMessage(std::format("{} files in the MPQ have no known name, building the MPQ again", unknownCount).c_str());
+        SFileCloseArchive(hMpq);
+        return UPDATE_NEEDS_REBUILD;
+    }
+
+    // Find out what has been added or changed
+    std::remove_cvref_t<decltype(fileList)> changedFiles;
+    size_t unchangedCount = 0;
+
+    for (auto const& file : fileList)
+    {
+        auto archivedFile = archivedFiles.find(GetArchivedNameKey(file.second.string()));
+        if (archivedFile == archivedFiles.end())
+        {
+            changedFiles.push_back(file);
+            continue;
+        }
+
+        if (IsFileChanged(hMpq, file.first, archivedFile->second))
+            changedFiles.push_back(file);
+        else
+            unchangedCount++;
+        archivedFiles.erase(archivedFile);
+    }
+
+    logger.PrintMessage(std::format("{} files unchanged, {} added or changed, {} removed", unchangedCount, changedFiles.size(), archivedFiles.size()).c_str());
+
+    // What is left in the map is no longer in the directory
+    for (auto const& archivedFile : archivedFiles)
+    {
+        if (!SFileRemoveFile(hMpq, archivedFile.second.cFileName, 0))
+            logger.PrintError(std::format("Failed to remove file {} (error {})", archivedFile.second.cFileName, GetLastError()).c_str());
+    }
+
+    // Make sure there is space for the new files. Replaced files need a new block before the old one is freed
+    DWORD maxFileCount = SFileGetMaxFileCount(hMpq);
+    DWORD neededFileCount = DWORD(unchangedCount + changedFiles.size() * 2 + 16);
+    if (neededFileCount > maxFileCount && !SFileSetMaxFileCount(hMpq, neededFileCount))
+    {
+        logger.PrintError(std::format("Failed to increase the maximum file count to {}", neededFileCount).c_str());
+        SFileCloseArchive(hMpq);
+        return 1;
+    }
+
+    if (!changedFiles.empty())
+        AddFilesToMPQ(hMpq, logger, changedFiles, false, autoCompress, true, dedup);
+
+    // Replaced and removed files leave holes in the archive. They are closed in place,
+    // so large archives don't need to be copied
+    if (compactThreshold != 0 && SFileFlushArchive(hMpq))
+    {
+        auto wastedPercent = GetWastedSpacePercent(hMpq);
+        if (wastedPercent >= ULONGLONG(compactThreshold))
+        {
+            logger.PrintMessage(std::format("Compacting the archive ({}% wasted)", wastedPercent).c_str());
+            if (!SFileCompactArchiveEx(hMpq, nullptr, SFILE_COMPACT_IN_PLACE))
+                logger.PrintError(std::format("Failed to compact the archive (error {})", GetLastError()).c_str());
+        }
+    }
+
+    SFileCloseArchive(hMpq);
+    return 0;
+}
 
 std::wstring utf8_to_utf16(const std::string& utf8str) 
 {
@@ -202,12 +834,35 @@ int main(int argc, char* argv[])
     std::string directoryPath;
     std::string mpqFileName = "Patch-X.MPQ";
     bool buildListFile = true;
+    int compressionLevel = 0;
+    bool autoCompress = false;
+    bool extract = false;
+    bool verify = false;
+    unsigned stressThreads = 0;
+    bool selfTest = false;
+    bool update = false;
+    bool dedup = false;
+    int compactThreshold = 0;
 
     // Help text for command line syntax
     std::string helpText = "AssembleMPQ 1.01 \n"
-                           "Usage: program_name [--nolistfile] directory_path [mpq_file_name] \n"
+                           "Usage: program_name [--nolistfile] [--level N] [--autocompress] [--dedup] directory_path [mpq_file_name] \n"
+                           "       program_name --update [--compact N] [--level N] [--autocompress] [--dedup] directory_path [mpq_file_name] \n"
+                           "       program_name --extract directory_path [mpq_file_name] \n"
+                           "       program_name --verify mpq_file_name \n"
+                           "       program_name --stress N mpq_file_name \n"
+                           "       program_name --selftest \n"
                            "Arguments:\n"
                            "  --nolistfile       : (Optional) Prevent generating listfile\n"
+                           "  --level N          : (Optional) Compression level 1 (fastest) - 9 (smallest)\n"
+                           "  --autocompress     : (Optional) Choose the best compression for each file\n"
+                           "  --dedup            : (Optional) Store identical files only once (the files are not encrypted)\n"
+                           "  --extract          : (Optional) Extract all files of the MPQ into the directory\n"
+                           "  --verify           : (Optional) Verify checksums of all files in the MPQ\n"
+                           "  --stress N         : (Optional) Read all files of the MPQ from N threads at once and compare the data\n"
+                           "  --selftest         : (Optional) Run the self tests of the library in the temporary directory\n"
+                           "  --update           : (Optional) Only add the changed files to an existing MPQ and remove the deleted ones\n"
+                           "  --compact N        : (Optional) With --update, compact the MPQ if at least N percent of it is unused\n"
                            "  --help             : (Optional) Print this help text\n"
                            "  directory_path     : Path to the directory\n"
                            "  mpq_file_name      : (Optional) Name of the MPQ file (default: Patch-X.MPQ)\n";
@@ -220,8 +875,8 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    // Check if --nolistfile argument is present and set the flag
-    if (argc > 1)
+    // Check if --nolistfile or --level arguments are present and set the flags
+    while (argc > 1 && std::string(argv[1]).at(0) == '-')
     {
         if (std::string(argv[1]) == "--nolistfile") 
         {
@@ -229,13 +884,111 @@ int main(int argc, char* argv[])
             argc--;
             argv++;
         }
-        else if (std::string(argv[1]).at(0) == '-')
+        else if (std::string(argv[1]) == "--autocompress")
+        {
+            autoCompress = true;
+            argc--;
+            argv++;
+        }
+        else if (std::string(argv[1]) == "--dedup")
+        {
+            dedup = true;
+            argc--;
+            argv++;
+        }
+        else if (std::string(argv[1]) == "--extract")
+        {
+            extract = true;
+            argc--;
+            argv++;
+        }
+        else if (std::string(argv[1]) == "--verify")
+        {
+            verify = true;
+            argc--;
+            argv++;
+        }
+        else if (std::string(argv[1]) == "--stress" && argc > 2 && atoi(argv[2]) >= 1)
+        {
+            stressThreads = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+        else if (std::string(argv[1]) == "--selftest")
+        {
+            selfTest = true;
+            argc--;
+            argv++;
+        }
+        else if (std::string(argv[1]) == "--update")
+        {
+            update = true;
+            argc--;
+            argv++;
+        }
+        else if (std::string(argv[1]) == "--compact" && argc > 2 && atoi(argv[2]) >= 1 && atoi(argv[2]) <= 100)
+        {
+            compactThreshold = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+        else if (std::string(argv[1]) == "--level" && argc > 2 && atoi(argv[2]) >= 1 && atoi(argv[2]) <= 9)
+        {
+            compressionLevel = atoi(argv[2]);
+            argc -= 2;
+            argv += 2;
+        }
+        else
         {
             logger.PrintError(std::format("Wrong parameter: {}", argv[1]).c_str());
             logger.PrintMessage(helpText.c_str());
             return 1;
         }
     }
+
+    // The archive is only compacted after an update
+    if (compactThreshold != 0 && !update)
+    {
+        logger.PrintError("--compact can only be used with --update");
+        logger.PrintMessage(helpText.c_str());
+        return 1;
+    }
+
+    if (selfTest)
+        return RunSelfTests();
+
+    // --verify and --stress need the MPQ name
+    if ((verify || stressThreads != 0) && argc < 2)
+    {
+        logger.PrintError("Missing MPQ file name");
+        logger.PrintMessage(helpText.c_str());
+        return 1;
+    }
+
+    if (stressThreads != 0)
+    {
+        auto mpqFullPath = GetMpqPath(argv[1]);
+        if (mpqFullPath.empty())
+        {
+            logger.PrintError(std::format("Invalid MPQ path: {}", argv[1]).c_str());
+            exit(1);
+        }
+
+        return StressReadMPQ(mpqFullPath, stressThreads, 4);
+    }
+
+    if (verify)
+    {
+        auto mpqFullPath = GetMpqPath(argv[1]);
+        if (mpqFullPath.empty())
+        {
+            logger.PrintError(std::format("Invalid MPQ path: {}", argv[1]).c_str());
+            exit(1);
+        }
+
+        return VerifyMPQ(mpqFullPath);
+    }
+
     if (argc > 1)
         directoryPath = argv[1];
     else 
@@ -247,6 +1000,18 @@ int main(int argc, char* argv[])
     if (argc > 2)
         mpqFileName = argv[2];
 
+    if (extract)
+    {
+        auto mpqFullPath = GetMpqPath(mpqFileName);
+        if (mpqFullPath.empty())
+        {
+            logger.PrintError(std::format("Invalid MPQ path: {}", mpqFileName).c_str());
+            exit(1);
+        }
+
+        return ExtractFilesFromMPQ(mpqFullPath, directoryPath);
+    }
+
     // V4 seems to be supported by wow 335. 
     auto createFlags = MPQ_CREATE_ARCHIVE_V2; 
     if (buildListFile)
@@ -266,6 +1031,14 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    // Only add what has changed since the last build
+    if (update && std::filesystem::exists(mpqFullPath))
+    {
+        int result = UpdateMPQ(mpqFullPath, fileList, compressionLevel, autoCompress, compactThreshold, dedup);
+        if (result != UPDATE_NEEDS_REBUILD)
+            return result;
+    }
+
     DeleteMPQFileIfExists(mpqFileName);
 
     auto currentDir = std::filesystem::current_path();
@@ -278,8 +1051,16 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
-    for (auto const& file : fileList)
-        AddFileToMPQ(hMpq, logger, file.first, file.second, false); // getting file corrupted if patch is true here, dunno how to use it
+    SFileSetThreadCount(hMpq, std::thread::hardware_concurrency());
+
+    if (compressionLevel != 0)
+    {
+        SFILE_COMPRESSION_PARAMS compressionParams = {};
+        compressionParams.nZlibLevel = compressionLevel;
+        SFileSetCompressionParams(hMpq, &compressionParams);
+    }
+
+    AddFilesToMPQ(hMpq, logger, fileList, false, autoCompress, false, dedup); // getting file corrupted if patch is true here, dunno how to use it
 
     SFileCloseArchive(hMpq);
 